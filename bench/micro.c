@@ -0,0 +1,396 @@
+/**
+ * Microbenchmarks of the request parser, request processing and the file
+ * layer, on a corpus of realistic requests and on files of 100 B to 100 MB.
+ *
+ * For each case, reports the time, the number of allocations, the bytes
+ * allocated and the bytes copied, per operation. Bytes copied are what the
+ * operation writes into memory: generated header fields for requests, and
+ * file content for file reads and writes (parsing copies nothing).
+ *
+ * Usage: micro [filter], where only cases with the filter in their names run
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include "cache.h"
+#include "compress.h"
+#include "file.h"
+#include "http.h"
+#include "metrics.h"
+#include "mime.h"
+#include "parser.h"
+#include "config.h"
+
+/**
+ * Minimum time a case runs for, in nanoseconds, once calibrated.
+ */
+#define MICRO_MIN_TIME (200 * 1000000)
+
+/********** Internal types **********/
+
+/**
+ * A case: one operation, run over and over.
+ *
+ * @return Bytes copied by the operation.
+ */
+typedef gsize (*MicroFunc)(gconstpointer data);
+
+/**
+ * A request of the corpus.
+ */
+struct MicroRequest {
+  const char *name;
+  const char *text;
+};
+
+/**
+ * A file of the corpus.
+ */
+struct MicroFile {
+  const char *name;
+  gsize       size;
+  gchar      *path; ///< Path to request
+};
+
+/********** Internal States **********/
+
+static const struct MicroRequest requests[] = {
+  {
+    "browser-get",
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Accept-Encoding: identity\r\n"
+    "Accept-Language: en-US,en;q=0.9,zh-CN;q=0.8\r\n"
+    "Cookie: session=3f2a9c1d7e5b4a60; theme=dark; _ga=GA1.1.1234567890.1697500000\r\n"
+    "\r\n"
+  },
+  {
+    "browser-get-range",
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/118.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Range: bytes=0-99,1000-\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n"
+  },
+  {
+    "head",
+    "HEAD /index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: curl/8.4.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n"
+  },
+  {
+    "get-missing",
+    "GET /no/such/file.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: curl/8.4.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n"
+  },
+  {
+    "post-body",
+    "POST /upload.json HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Content-Type: application/json\r\n"
+    "Content-Length: 64\r\n"
+    "Origin: https://www.example.com\r\n"
+    "Accept: application/json\r\n"
+    "\r\n"
+    "{\"name\":\"teapot\",\"kind\":\"short and stout\",\"handle\":true,\"n\":1}\n"
+  },
+  {
+    "malformed",
+    "GET /index.html HTTP/1.1\r\n"
+    "Host : www.example.com\r\n"
+    "Accept: */*\r\n"
+    "\r\n"
+  },
+  {
+    "incomplete",
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,applicati"
+  },
+};
+
+static struct MicroFile micro_files[] = {
+  { "100B", 100, NULL },
+  { "4KiB", 4 << 10, NULL },
+  { "64KiB", 64 << 10, NULL },
+  { "1MiB", 1 << 20, NULL },
+  { "16MiB", 16 << 20, NULL },
+  { "100MiB", 100 << 20, NULL },
+};
+
+static const char *filter  = NULL;
+static gchar      *content = NULL; ///< Content of the files, as large as the largest
+
+// Allocations made by the thread running the cases, while it counts them
+static __thread gboolean counting    = FALSE;
+static __thread guint64  allocations = 0;
+static __thread guint64  allocated   = 0;
+
+/********** Allocation counting **********/
+
+#ifdef __GLIBC__
+// Everything (GLib included) allocates through these, so wrapping them is
+// enough to count; the real ones are still there under another name
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size)
+{
+  if (counting) {
+    allocations++;
+    allocated += size;
+  }
+
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+  if (counting) {
+    allocations++;
+    allocated += n * size;
+  }
+
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+  if (counting) {
+    allocations++;
+    allocated += size;
+  }
+
+  return __libc_realloc(p, size);
+}
+#endif
+
+/********** Private APIs **********/
+
+static void micro_log_discard(const gchar *domain, GLogLevelFlags level, const gchar *message, gpointer data)
+{
+  (void)domain;
+  (void)level;
+  (void)message;
+  (void)data;
+}
+
+static gint64 micro_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Run a case until it has run long enough to be timed, and report it.
+ */
+static void micro_run(const char *group, const char *name, MicroFunc func, gconstpointer data)
+{
+  gchar *title = g_strconcat(group, "/", name, NULL);
+  if (filter && !strstr(title, filter)) {
+    g_free(title);
+    return;
+  }
+
+  // Warm up caches (of the CPU, of the kernel and of Teapot)
+  func(data);
+
+  // Double the iterations until the batch takes long enough
+  guint64 iterations = 1;
+  gint64  elapsed    = 0;
+  guint64 copied     = 0;
+
+  for (;;) {
+    copied       = 0;
+    allocations  = 0;
+    allocated    = 0;
+    counting     = TRUE;
+
+    gint64 start = micro_now();
+    for (guint64 i = 0; i < iterations; i++)
+      copied += func(data);
+    elapsed = micro_now() - start;
+
+    counting = FALSE;
+
+    if (elapsed >= MICRO_MIN_TIME)
+      break;
+
+    // Aim a little over the minimum, rather than doubling blindly
+    guint64 wanted = elapsed > 0 ? iterations * MICRO_MIN_TIME / (guint64)elapsed + 1 : iterations * 100;
+    iterations = MIN(MAX(wanted + wanted / 5, iterations * 2), iterations * 100);
+  }
+
+  gdouble n = (gdouble)iterations;
+
+  g_print(
+    "%-32s %10" G_GUINT64_FORMAT " %14.1f %10.2f %14.1f %14.1f\n",
+    title, iterations, (gdouble)elapsed / n,
+    (gdouble)allocations / n, (gdouble)allocated / n, (gdouble)copied / n
+  );
+
+  g_free(title);
+}
+
+static gsize micro_parse(gconstpointer data)
+{
+  const struct MicroRequest *request = data;
+  struct TeapotHttpRequest parsed;
+
+  teapot_parser_parse(&parsed, request->text, strlen(request->text));
+
+  // Not much to keep the compiler from dropping the call, but enough
+  __asm__ volatile("" : : "g"(&parsed) : "memory");
+
+  // Spans point into the input: nothing is copied
+  return 0;
+}
+
+static gsize micro_process(gconstpointer data)
+{
+  const struct MicroRequest *request = data;
+  bool   keep_alive = true;
+  size_t consumed   = 0;
+  gsize  copied     = 0;
+
+  // Like a connection's, reused from one request to the next
+  static struct TeapotArena arena = TEAPOT_ARENA_INIT;
+
+  struct TeapotHttpOutput *output = teapot_http_process(&arena, &keep_alive, &consumed, request->text, strlen(request->text));
+
+  for (struct TeapotHttpOutput *o = output; o; o = o->next)
+    copied += o->buf_length;
+
+  teapot_http_output_release(output);
+  teapot_arena_reset(&arena);
+
+  return copied;
+}
+
+static gsize micro_file_read(gconstpointer data)
+{
+  const struct MicroFile *file = data;
+
+  struct TeapotFile *read = teapot_file_read(file->path, 0, TEAPOT_FILE_READ_RANGE_FULL);
+  if (!read)
+    g_error("Failed to read %s", file->path);
+
+  gsize copied = read->size;
+  teapot_file_unref(read);
+
+  return copied;
+}
+
+static gsize micro_file_write(gconstpointer data)
+{
+  const struct MicroFile *file = data;
+
+  gchar *path = g_strconcat(file->path, ".written", NULL);
+
+  // Writing never replaces a file, so each one goes away right after; the
+  // unlink is part of the operation
+  if (!teapot_file_write((const uint8_t *)content, file->size, path))
+    g_error("Failed to write %s", path);
+
+  g_unlink(path + 1);
+  g_free(path);
+
+  return file->size;
+}
+
+/********** Main **********/
+
+int main(int argc, char **argv)
+{
+  GError *error = NULL;
+
+  filter = argc > 1 ? argv[1] : NULL;
+
+  // Quiet, please: the malformed cases are meant to be rejected
+  g_log_set_handler(NULL, G_LOG_LEVEL_MESSAGE | G_LOG_LEVEL_WARNING | G_LOG_LEVEL_INFO | G_LOG_LEVEL_DEBUG, micro_log_discard, NULL);
+
+  // Teapot serves the current directory
+  gchar *dir = g_dir_make_tmp("teapot-micro-XXXXXX", &error);
+  if (!dir || g_chdir(dir) != 0) {
+    g_printerr("Failed to create a temporary directory: %s\n", error ? error->message : g_strerror(errno));
+    g_clear_error(&error);
+    return 1;
+  }
+
+  teapot_metrics_init(false);
+  teapot_mime_init(NULL, false);
+  teapot_cache_init(TEAPOT_DEFAULT_CACHE_SIZE, TEAPOT_DEFAULT_CACHE_MAX_FILE_SIZE);
+  teapot_compress_init(0, NULL);
+  teapot_http_init(TEAPOT_DEFAULT_MAX_HEADER_SIZE, TEAPOT_DEFAULT_MAX_BODY_SIZE);
+
+  gsize content_size = micro_files[G_N_ELEMENTS(micro_files) - 1].size;
+  content = g_malloc(content_size);
+  for (gsize i = 0; i < content_size; i++)
+    content[i] = (i % 64 == 63) ? '\n' : (gchar)('a' + i % 26);
+
+  g_file_set_contents("index.html", content, 2048, NULL);
+  for (gsize i = 0; i < G_N_ELEMENTS(micro_files); i++) {
+    gchar *name = g_strconcat("file-", micro_files[i].name, NULL);
+    g_file_set_contents(name, content, (gssize)micro_files[i].size, NULL);
+    micro_files[i].path = g_strconcat("/", name, NULL);
+    g_free(name);
+  }
+
+  g_print("%-32s %10s %14s %10s %14s %14s\n", "case", "iterations", "ns/op", "allocs/op", "alloc B/op", "copied B/op");
+
+  for (gsize i = 0; i < G_N_ELEMENTS(requests); i++)
+    micro_run("parse", requests[i].name, micro_parse, &requests[i]);
+
+  for (gsize i = 0; i < G_N_ELEMENTS(requests); i++)
+    micro_run("process", requests[i].name, micro_process, &requests[i]);
+
+  for (gsize i = 0; i < G_N_ELEMENTS(micro_files); i++)
+    micro_run("file_read", micro_files[i].name, micro_file_read, &micro_files[i]);
+
+  for (gsize i = 0; i < G_N_ELEMENTS(micro_files); i++)
+    micro_run("file_write", micro_files[i].name, micro_file_write, &micro_files[i]);
+
+  // Clean up after ourselves
+  GDir *d = g_dir_open(".", 0, NULL);
+  for (const gchar *name; d && (name = g_dir_read_name(d)); )
+    g_unlink(name);
+  if (d)
+    g_dir_close(d);
+
+  g_chdir("/");
+  g_rmdir(dir);
+  g_free(dir);
+  g_free(content);
+
+  return 0;
+}
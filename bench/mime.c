@@ -0,0 +1,75 @@
+/**
+ * Compare the compiled-in MIME table with asking GIO for the content type,
+ * which is what file lookups used to do.
+ *
+ * Usage: mime [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <gio/gio.h>
+#include "mime.h"
+
+static const char *names[] = {
+  "index.html", "style.css", "app.js", "logo.png", "photo.jpg", "data.json",
+  "feed.xml", "font.woff2", "video.mp4", "notes.txt", "icon.svg", "archive.zip",
+};
+
+int main(int argc, char **argv)
+{
+  guint iterations = argc > 1 ? (guint)strtoul(argv[1], NULL, 10) : 1000;
+  GError *error = NULL;
+
+  gchar *dir = g_dir_make_tmp("teapot-bench-XXXXXX", &error);
+  if (!dir) {
+    g_printerr("Failed to create a temporary directory: %s\n", error->message);
+    g_clear_error(&error);
+    return 1;
+  }
+
+  // Files with a little content each, as GIO may look into them
+  GFile *files[G_N_ELEMENTS(names)];
+  for (gsize i = 0; i < G_N_ELEMENTS(names); i++) {
+    gchar *path = g_build_filename(dir, names[i], NULL);
+    g_file_set_contents(path, "<!DOCTYPE html>\n", -1, NULL);
+    files[i] = g_file_new_for_path(path);
+    g_free(path);
+  }
+
+  gint64 start = g_get_monotonic_time();
+  for (guint n = 0; n < iterations; n++) {
+    for (gsize i = 0; i < G_N_ELEMENTS(names); i++) {
+      GFileInfo *info = g_file_query_info(files[i], "standard::*", G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL, NULL);
+      g_clear_object(&info);
+    }
+  }
+  gint64 gio_time = g_get_monotonic_time() - start;
+
+  // Enough to be measurable at all
+  guint table_iterations = iterations * 1000;
+  gsize found = 0;
+
+  start = g_get_monotonic_time();
+  for (guint n = 0; n < table_iterations; n++) {
+    for (gsize i = 0; i < G_N_ELEMENTS(names); i++)
+      found += teapot_mime_type(names[i]) != NULL;
+  }
+  gint64 table_time = g_get_monotonic_time() - start;
+
+  gdouble lookups = (gdouble)G_N_ELEMENTS(names);
+  gdouble gio_ns   = (gdouble)gio_time * 1000.0 / (lookups * iterations);
+  gdouble table_ns = (gdouble)table_time * 1000.0 / (lookups * table_iterations);
+
+  g_print("g_file_query_info(\"standard::*\"): %10.1f ns/lookup\n", gio_ns);
+  g_print("teapot_mime_type():               %10.1f ns/lookup (%zu found)\n", table_ns, found);
+  g_print("speedup:                          %10.1fx\n", gio_ns / table_ns);
+
+  for (gsize i = 0; i < G_N_ELEMENTS(names); i++) {
+    g_file_delete(files[i], NULL, NULL);
+    g_clear_object(&files[i]);
+  }
+  g_rmdir(dir);
+  g_free(dir);
+
+  return 0;
+}
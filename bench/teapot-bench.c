@@ -0,0 +1,798 @@
+/**
+ * A load generator for Teapot, over HTTP or HTTPS on loopback.
+ *
+ * In closed-loop mode (the default), each connection sends a request as soon
+ * as the previous response has arrived, which measures throughput. With
+ * --rate, requests are instead scheduled at a fixed overall rate (open loop),
+ * and latency is measured from when each request was due rather than when
+ * it was actually sent: a server that stalls is charged for every request it
+ * held up, instead of the stall hiding them (coordinated omission).
+ *
+ * Unless --path is given, a synthetic document root is generated with files
+ * of sizes drawn from --sizes, and every request asks for a random one. With
+ * --teapot, the server is started on that document root, and stopped when
+ * done, so a run needs nothing but the two programs.
+ *
+ * Usage: teapot-bench [options], see --help
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+/**
+ * Latencies are recorded in log-linear (HDR style) histograms: each power of
+ * 2 is split into 2^BENCH_SUB_BITS buckets, so any value is off by at most
+ * 1/2^BENCH_SUB_BITS (under 1%).
+ */
+#define BENCH_SUB_BITS 7
+#define BENCH_SUB      (1 << BENCH_SUB_BITS)
+
+/**
+ * Largest power of 2 (of nanoseconds) told apart, about 18 minutes.
+ */
+#define BENCH_MAX_EXPONENT 40
+
+#define BENCH_BUCKETS ((BENCH_MAX_EXPONENT - BENCH_SUB_BITS + 2) * BENCH_SUB)
+
+/**
+ * Size of the receive buffer of a connection, which must hold a whole
+ * response header.
+ */
+#define BENCH_BUFFER_SIZE 65536
+
+/**
+ * Status codes counted one by one.
+ */
+#define BENCH_MAX_STATUS 600
+
+/********** Internal types **********/
+
+/**
+ * A file of the synthetic document root.
+ */
+struct BenchFile {
+  gchar *name; ///< Name, relative to the document root
+  gsize  size; ///< Size in bytes
+};
+
+/**
+ * A class of file sizes, from --sizes.
+ */
+struct BenchSize {
+  gsize size;   ///< Size in bytes
+  guint weight; ///< Relative share of the files
+};
+
+/**
+ * One connection, driven by its own thread.
+ */
+struct BenchWorker {
+  guint     id;
+  GThread  *thread;
+  GRand    *rand;
+
+  GSocketClient *client;
+  GIOStream     *stream; ///< NULL when not connected
+
+  gchar buffer[BENCH_BUFFER_SIZE];
+
+  guint64 requests;  ///< Responses received in time
+  guint64 errors;    ///< Failed connections or requests
+  guint64 connects;  ///< Connections (and TLS handshakes) made
+  guint64 bytes;     ///< Bytes received, header and body
+  guint64 statuses[BENCH_MAX_STATUS];
+  guint64 latencies[BENCH_BUCKETS];
+  guint64 latency_sum;
+};
+
+/********** Internal States **********/
+
+// Options
+static gchar   *host        = NULL;
+static gint     port        = 8080;
+static gboolean tls         = FALSE;
+static gint     connections = 16;
+static gint     duration    = 10;
+static gint     rate        = 0;
+static gboolean no_keepalive = FALSE;
+static gchar   *path        = NULL;
+static gchar   *root        = NULL;
+static gint     n_files     = 100;
+static gchar   *sizes       = NULL;
+static gint     seed        = 1;
+static gchar   *teapot      = NULL;
+static gchar   *cert        = NULL;
+static gchar   *key         = NULL;
+
+static GOptionEntry options[] = {
+  { "host", 'H', 0, G_OPTION_ARG_STRING, &host, "Address of the server (default 127.0.0.1)", "address" },
+  { "port", 'p', 0, G_OPTION_ARG_INT, &port, "Port of the server (default 8080)", "port" },
+  { "tls", 's', 0, G_OPTION_ARG_NONE, &tls, "Talk HTTPS (certificates are not verified)", NULL },
+  { "connections", 'c', 0, G_OPTION_ARG_INT, &connections, "Number of concurrent connections (default 16)", "n" },
+  { "duration", 'd', 0, G_OPTION_ARG_INT, &duration, "Seconds to run for (default 10)", "seconds" },
+  { "rate", 'r', 0, G_OPTION_ARG_INT, &rate, "Requests per second over all connections, open loop (default 0, closed loop)", "n" },
+  { "no-keepalive", 'k', 0, G_OPTION_ARG_NONE, &no_keepalive, "Make a new connection for every request", NULL },
+  { "path", 'u', 0, G_OPTION_ARG_STRING, &path, "Request only this path, without generating a document root", "path" },
+  { "root", 'R', 0, G_OPTION_ARG_FILENAME, &root, "Where to generate the document root (default a temporary directory, removed afterwards)", "dir" },
+  { "files", 'n', 0, G_OPTION_ARG_INT, &n_files, "Number of files to generate (default 100)", "n" },
+  { "sizes", 'z', 0, G_OPTION_ARG_STRING, &sizes, "Sizes of the files and their shares (default 1k:50,16k:30,256k:15,4m:5)", "size:weight,..." },
+  { "seed", 'S', 0, G_OPTION_ARG_INT, &seed, "Seed of the file sizes and requested files (default 1)", "n" },
+  { "teapot", 't', 0, G_OPTION_ARG_FILENAME, &teapot, "Start this Teapot on the document root for the run", "path" },
+  { "cert", 0, 0, G_OPTION_ARG_FILENAME, &cert, "TLS certificate for the started Teapot", "path" },
+  { "key", 0, 0, G_OPTION_ARG_FILENAME, &key, "TLS private key for the started Teapot", "path" },
+  { NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL },
+};
+
+static struct BenchFile *files = NULL;
+
+static gint64 start_time = 0; ///< When requests start, in nanoseconds
+static gint64 end_time   = 0; ///< When requests stop, in nanoseconds
+
+/********** Private APIs **********/
+
+static gint64 bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_sleep_until(gint64 when)
+{
+  struct timespec ts = {
+    .tv_sec  = when / 1000000000,
+    .tv_nsec = when % 1000000000,
+  };
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+/**
+ * Find the bucket of a value.
+ */
+static guint bench_bucket(guint64 value)
+{
+  if (value < BENCH_SUB)
+    return (guint)value;
+
+  guint exponent = (guint)(63 - __builtin_clzll(value));
+  if (exponent > BENCH_MAX_EXPONENT)
+    return BENCH_BUCKETS - 1;
+
+  guint sub = (guint)(value >> (exponent - BENCH_SUB_BITS)) & (BENCH_SUB - 1);
+
+  return (exponent - BENCH_SUB_BITS + 1) * BENCH_SUB + sub;
+}
+
+/**
+ * Upper bound (exclusive) of a bucket.
+ */
+static guint64 bench_bucket_upper(guint bucket)
+{
+  if (bucket < BENCH_SUB)
+    return bucket + 1;
+
+  guint exponent = bucket / BENCH_SUB + BENCH_SUB_BITS - 1;
+  guint64 sub    = bucket % BENCH_SUB;
+
+  return (BENCH_SUB + sub + 1) << (exponent - BENCH_SUB_BITS);
+}
+
+static guint64 bench_quantile(const guint64 *histogram, guint64 count, gdouble q)
+{
+  // q = 1 stands for the largest value
+  guint64 rank = MIN((guint64)((gdouble)count * q), count - 1);
+  guint64 seen = 0;
+
+  for (guint i = 0; i < BENCH_BUCKETS; i++) {
+    seen += histogram[i];
+    if (seen > rank)
+      return bench_bucket_upper(i);
+  }
+
+  return 0;
+}
+
+/**
+ * Parse a size like "512", "16k" or "4m".
+ */
+static gsize bench_parse_size(const char *str)
+{
+  gchar  *end  = NULL;
+  guint64 size = g_ascii_strtoull(str, &end, 10);
+
+  switch (g_ascii_tolower(*end)) {
+    case 'k':
+      size <<= 10;
+      break;
+    case 'm':
+      size <<= 20;
+      break;
+    case 'g':
+      size <<= 30;
+      break;
+    default:
+      break;
+  }
+
+  return (gsize)size;
+}
+
+/**
+ * Parse --sizes into a list of struct BenchSize.
+ *
+ * @return The list, or NULL if it is malformed.
+ */
+static GArray *bench_parse_sizes(const char *spec)
+{
+  GArray *ret   = g_array_new(FALSE, FALSE, sizeof(struct BenchSize));
+  gchar **items = g_strsplit(spec, ",", -1);
+
+  for (gchar **item = items; *item; item++) {
+    gchar *colon = strchr(*item, ':');
+    struct BenchSize size = {
+      .size   = bench_parse_size(*item),
+      .weight = colon ? (guint)strtoul(colon + 1, NULL, 10) : 1,
+    };
+
+    if (!g_ascii_isdigit(**item) || size.weight == 0) {
+      g_printerr("Malformed size: %s\n", *item);
+      g_array_unref(ret);
+      ret = NULL;
+      break;
+    }
+
+    g_array_append_val(ret, size);
+  }
+
+  g_strfreev(items);
+
+  return ret;
+}
+
+/**
+ * Generate the document root: n_files files, with sizes drawn from --sizes.
+ *
+ * @return TRUE on success.
+ */
+static gboolean bench_generate(const GArray *classes)
+{
+  GError *error = NULL;
+  GRand  *rand  = g_rand_new_with_seed((guint32)seed);
+
+  guint total_weight = 0;
+  for (guint i = 0; i < classes->len; i++)
+    total_weight += g_array_index(classes, struct BenchSize, i).weight;
+
+  files = g_new0(struct BenchFile, (gsize)n_files);
+  gsize total_size = 0;
+
+  for (gint i = 0; i < n_files; i++) {
+    guint pick = (guint)g_rand_int_range(rand, 0, (gint32)total_weight);
+    guint c    = 0;
+    while (pick >= g_array_index(classes, struct BenchSize, c).weight)
+      pick -= g_array_index(classes, struct BenchSize, c++).weight;
+
+    files[i].size = g_array_index(classes, struct BenchSize, c).size;
+    files[i].name = g_strdup_printf("file-%05d.html", i);
+
+    // Text, so that the content looks like what is usually served
+    gchar *content = g_malloc(files[i].size);
+    for (gsize j = 0; j < files[i].size; j++)
+      content[j] = (j % 64 == 63) ? '\n' : (gchar)('a' + g_rand_int_range(rand, 0, 26));
+
+    gchar *filename = g_build_filename(root, files[i].name, NULL);
+    gboolean r = g_file_set_contents(filename, content, (gssize)files[i].size, &error);
+    g_free(filename);
+    g_free(content);
+
+    if (!r) {
+      g_printerr("Failed to generate %s: %s\n", files[i].name, error->message);
+      g_clear_error(&error);
+      g_rand_free(rand);
+      return FALSE;
+    }
+
+    total_size += files[i].size;
+  }
+
+  g_rand_free(rand);
+
+  g_print("Generated %d files (%zu bytes) in %s\n", n_files, total_size, root);
+
+  return TRUE;
+}
+
+static void bench_remove_root(void)
+{
+  for (gint i = 0; i < n_files && files[i].name; i++) {
+    gchar *filename = g_build_filename(root, files[i].name, NULL);
+    g_unlink(filename);
+    g_free(filename);
+  }
+
+  g_rmdir(root);
+}
+
+/**
+ * Start Teapot on the document root, and wait until it accepts connections.
+ *
+ * @return Its PID, or 0 on failure.
+ */
+static GPid bench_spawn_teapot(void)
+{
+  GError *error = NULL;
+  GPid    pid   = 0;
+
+  // Teapot serves both protocols; the one not measured goes next door
+  gchar *http_port  = g_strdup_printf("%d", tls ? port + 1 : port);
+  gchar *https_port = g_strdup_printf("%d", tls ? port : port + 1);
+
+  // Teapot runs in the document root, so paths must not be relative
+  gchar *teapot_path = g_canonicalize_filename(teapot, NULL);
+  gchar *cert_path   = g_canonicalize_filename(cert ? cert : "cert.pem", NULL);
+  gchar *key_path    = g_canonicalize_filename(key ? key : "key.pem", NULL);
+
+  gchar *argv[] = {
+    teapot_path,
+    "--bind", host,
+    "--http-port", http_port,
+    "--https-port", https_port,
+    "--cert", cert_path,
+    "--key", key_path,
+    "--keepalive-requests", "0",
+    NULL,
+  };
+
+  if (!g_spawn_async(root, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL, &pid, &error)) {
+    g_printerr("Failed to start %s: %s\n", teapot, error->message);
+    g_clear_error(&error);
+    pid = 0;
+  }
+
+  g_free(http_port);
+  g_free(https_port);
+  g_free(teapot_path);
+  g_free(cert_path);
+  g_free(key_path);
+
+  if (!pid)
+    return 0;
+
+  // Give it up to 5 seconds to come up
+  GSocketClient *client = g_socket_client_new();
+  for (gint i = 0; i < 100; i++) {
+    GSocketConnection *conn = g_socket_client_connect_to_host(client, host, (guint16)port, NULL, NULL);
+    if (conn) {
+      g_io_stream_close(G_IO_STREAM(conn), NULL, NULL);
+      g_clear_object(&conn);
+      g_clear_object(&client);
+      return pid;
+    }
+
+    g_usleep(50 * G_TIME_SPAN_MILLISECOND);
+  }
+
+  g_clear_object(&client);
+  g_printerr("%s did not come up on %s:%d\n", teapot, host, port);
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  g_spawn_close_pid(pid);
+
+  return 0;
+}
+
+static gboolean bench_accept_certificate(GTlsConnection *conn, GTlsCertificate *peer_cert, GTlsCertificateFlags errors, gpointer data)
+{
+  (void)conn;
+  (void)peer_cert;
+  (void)errors;
+  (void)data;
+
+  // Teapot is usually run with a self-signed certificate for benchmarks
+  return TRUE;
+}
+
+/**
+ * Connect to the server, and do the TLS handshake if needed.
+ */
+static gboolean bench_connect(struct BenchWorker *worker)
+{
+  GError *error = NULL;
+
+  GSocketConnection *conn = g_socket_client_connect_to_host(worker->client, host, (guint16)port, NULL, &error);
+  if (!conn)
+    goto fail;
+
+  // Requests are small and must go out at once
+  g_socket_set_option(g_socket_connection_get_socket(conn), IPPROTO_TCP, TCP_NODELAY, 1, NULL);
+
+  if (!tls) {
+    worker->stream = G_IO_STREAM(conn);
+    worker->connects++;
+    return TRUE;
+  }
+
+  GIOStream *tls_conn = g_tls_client_connection_new(G_IO_STREAM(conn), NULL, &error);
+  g_clear_object(&conn);
+  if (!tls_conn)
+    goto fail;
+
+  g_signal_connect(tls_conn, "accept-certificate", G_CALLBACK(bench_accept_certificate), NULL);
+
+  if (!g_tls_connection_handshake(G_TLS_CONNECTION(tls_conn), NULL, &error)) {
+    g_clear_object(&tls_conn);
+    goto fail;
+  }
+
+  worker->stream = tls_conn;
+  worker->connects++;
+  return TRUE;
+
+fail:
+  // Only the first failure of a connection is worth telling
+  if (worker->errors == 0)
+    g_printerr("Connection %u: %s\n", worker->id, error->message);
+  g_clear_error(&error);
+  worker->errors++;
+  return FALSE;
+}
+
+static void bench_disconnect(struct BenchWorker *worker)
+{
+  if (!worker->stream)
+    return;
+
+  g_io_stream_close(worker->stream, NULL, NULL);
+  g_clear_object(&worker->stream);
+}
+
+/**
+ * Find a header field in a response header, ignoring case.
+ *
+ * @return The value, or NULL if there is no such field.
+ */
+static const gchar *bench_header(const gchar *header, gsize length, const gchar *name)
+{
+  gsize name_length = strlen(name);
+  const gchar *end  = header + length;
+
+  for (const gchar *p = header; p < end; p++) {
+    const gchar *eol = memchr(p, '\n', (gsize)(end - p));
+    if (!eol)
+      break;
+
+    if ((gsize)(eol - p) > name_length && p[name_length] == ':' && g_ascii_strncasecmp(p, name, name_length) == 0) {
+      p += name_length + 1;
+      while (*p == ' ' || *p == '\t')
+        p++;
+      return p;
+    }
+
+    p = eol;
+  }
+
+  return NULL;
+}
+
+/**
+ * Send a request, and read its response (discarding the body).
+ *
+ * @param keep [out] Whether the connection can be used again.
+ * @return The status code, or 0 on failure.
+ */
+static guint bench_request(struct BenchWorker *worker, const gchar *target, gboolean *keep)
+{
+  GInputStream  *in  = g_io_stream_get_input_stream(worker->stream);
+  GOutputStream *out = g_io_stream_get_output_stream(worker->stream);
+
+  gchar *request = g_strdup_printf(
+    "GET %s HTTP/1.1\r\n"
+    "Host: %s\r\n"
+    "User-Agent: teapot-bench\r\n"
+    "%s"
+    "\r\n",
+    target, host, no_keepalive ? "Connection: close\r\n" : ""
+  );
+  gboolean r = g_output_stream_write_all(out, request, strlen(request), NULL, NULL, NULL);
+  g_free(request);
+
+  if (!r)
+    return 0;
+
+  // The header
+  gsize        length = 0;
+  const gchar *eoh    = NULL;
+
+  while (!eoh) {
+    if (length == BENCH_BUFFER_SIZE)
+      return 0;
+
+    gssize bytes = g_input_stream_read(in, worker->buffer + length, BENCH_BUFFER_SIZE - length, NULL, NULL);
+    if (bytes <= 0)
+      return 0;
+
+    length += (gsize)bytes;
+    eoh = g_strstr_len(worker->buffer, (gssize)length, "\r\n\r\n");
+  }
+
+  gsize header_length = (gsize)(eoh - worker->buffer) + 4;
+
+  if (length < 12 || strncmp(worker->buffer, "HTTP/1.", 7) != 0)
+    return 0;
+
+  guint status = (guint)strtoul(worker->buffer + 9, NULL, 10);
+  if (status < 100 || status >= BENCH_MAX_STATUS)
+    return 0;
+
+  const gchar *connection = bench_header(worker->buffer, header_length, "Connection");
+  *keep = !no_keepalive && !(connection && g_ascii_strncasecmp(connection, "close", 5) == 0);
+
+  // The body; without a length, it lasts until the connection is closed
+  const gchar *content_length = bench_header(worker->buffer, header_length, "Content-Length");
+  gboolean     until_eof      = !content_length && status != 204 && status != 304;
+  guint64      remaining      = content_length ? g_ascii_strtoull(content_length, NULL, 10) : 0;
+  guint64      received       = length - header_length;
+
+  if (until_eof)
+    *keep = FALSE;
+
+  remaining = received >= remaining ? 0 : remaining - received;
+
+  while (remaining > 0 || until_eof) {
+    gssize bytes = g_input_stream_read(in, worker->buffer, BENCH_BUFFER_SIZE, NULL, NULL);
+    if (bytes == 0 && until_eof)
+      break;
+    if (bytes <= 0)
+      return 0;
+
+    received  += (guint64)bytes;
+    remaining -= MIN(remaining, (guint64)bytes);
+  }
+
+  worker->bytes += header_length + received;
+
+  return status;
+}
+
+static gpointer bench_worker_run(gpointer data)
+{
+  struct BenchWorker *worker = data;
+
+  // Connections take their turns evenly in open-loop mode
+  gint64 interval = rate > 0 ? (gint64)connections * 1000000000 / rate : 0;
+  gint64 next     = start_time + interval * worker->id / connections;
+
+  bench_sleep_until(start_time);
+
+  for (;;) {
+    gint64 due;
+
+    if (rate > 0) {
+      if (next >= end_time)
+        break;
+
+      // When running late, requests go out back to back until caught up,
+      // and their latencies include the wait
+      bench_sleep_until(next);
+      due   = next;
+      next += interval;
+    } else {
+      due = bench_now();
+      if (due >= end_time)
+        break;
+    }
+
+    if (!worker->stream && !bench_connect(worker)) {
+      // Do not spin on a server which is down
+      g_usleep(10 * G_TIME_SPAN_MILLISECOND);
+      continue;
+    }
+
+    const gchar *target = path;
+    gchar       *file_target = NULL;
+    if (!target) {
+      file_target = g_strconcat("/", files[g_rand_int_range(worker->rand, 0, n_files)].name, NULL);
+      target      = file_target;
+    }
+
+    gboolean keep   = FALSE;
+    guint    status = bench_request(worker, target, &keep);
+    gint64   done   = bench_now();
+    g_free(file_target);
+
+    if (status == 0) {
+      worker->errors++;
+      bench_disconnect(worker);
+      continue;
+    }
+
+    // Responses straddling the end still count, as they were due in time
+    guint64 latency = (guint64)(done - due);
+    worker->statuses[status]++;
+    worker->latencies[bench_bucket(latency)]++;
+    worker->latency_sum += latency;
+    worker->requests++;
+
+    if (!keep)
+      bench_disconnect(worker);
+  }
+
+  bench_disconnect(worker);
+
+  return NULL;
+}
+
+static void bench_report(struct BenchWorker *workers, gint64 elapsed)
+{
+  guint64 requests = 0;
+  guint64 errors   = 0;
+  guint64 connects = 0;
+  guint64 bytes    = 0;
+  guint64 sum      = 0;
+  guint64 statuses[BENCH_MAX_STATUS] = { 0 };
+
+  guint64 *latencies = g_new0(guint64, BENCH_BUCKETS);
+
+  for (gint i = 0; i < connections; i++) {
+    requests += workers[i].requests;
+    errors   += workers[i].errors;
+    connects += workers[i].connects;
+    bytes    += workers[i].bytes;
+    sum      += workers[i].latency_sum;
+
+    for (guint s = 0; s < BENCH_MAX_STATUS; s++)
+      statuses[s] += workers[i].statuses[s];
+    for (guint b = 0; b < BENCH_BUCKETS; b++)
+      latencies[b] += workers[i].latencies[b];
+  }
+
+  gdouble seconds = (gdouble)elapsed / 1e9;
+
+  g_print("\n");
+  g_print("%-12s %" G_GUINT64_FORMAT " in %.2f s, %" G_GUINT64_FORMAT " connections, %" G_GUINT64_FORMAT " errors\n", "Requests:", requests, seconds, connects, errors);
+  g_print("%-12s %.1f req/s\n", "Throughput:", (gdouble)requests / seconds);
+  g_print("%-12s %.2f MiB/s\n", "Transfer:", (gdouble)bytes / seconds / (1 << 20));
+
+  if (requests > 0) {
+    g_print("%-12s mean %.3f ms\n", "Latency:", (gdouble)sum / (gdouble)requests / 1e6);
+
+    static const gdouble quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    for (gsize i = 0; i < G_N_ELEMENTS(quantiles); i++)
+      g_print("%12s p%-6g %.3f ms\n", "", quantiles[i] * 100, (gdouble)bench_quantile(latencies, requests, quantiles[i]) / 1e6);
+    g_print("%12s max     %.3f ms\n", "", (gdouble)bench_quantile(latencies, requests, 1.0) / 1e6);
+  }
+
+  g_print("%-12s", "Statuses:");
+  for (guint s = 0; s < BENCH_MAX_STATUS; s++) {
+    if (statuses[s])
+      g_print(" %u: %" G_GUINT64_FORMAT, s, statuses[s]);
+  }
+  g_print("\n");
+
+  g_free(latencies);
+}
+
+/********** Main **********/
+
+int main(int argc, char **argv)
+{
+  GError *error = NULL;
+  int     ret   = 0;
+
+  GOptionContext *context = g_option_context_new("- load generator for Teapot");
+  g_option_context_add_main_entries(context, options, NULL);
+  if (!g_option_context_parse(context, &argc, &argv, &error)) {
+    g_printerr("%s\n", error->message);
+    g_clear_error(&error);
+    g_option_context_free(context);
+    return 1;
+  }
+  g_option_context_free(context);
+
+  if (!host)
+    host = g_strdup("127.0.0.1");
+  if (port < 1 || port > G_MAXUINT16 || (teapot && port == G_MAXUINT16)) {
+    g_printerr("Port number should range from 1 to 65535.\n");
+    return 1;
+  }
+  if (connections < 1 || duration < 1 || rate < 0 || n_files < 1) {
+    g_printerr("Connections, duration and files should be positive, and rate not negative.\n");
+    return 1;
+  }
+
+  // Prepare the document root
+  gboolean temp_root = FALSE;
+  if (!path) {
+    GArray *classes = bench_parse_sizes(sizes ? sizes : "1k:50,16k:30,256k:15,4m:5");
+    if (!classes)
+      return 1;
+
+    if (root) {
+      g_mkdir_with_parents(root, 0755);
+    } else {
+      root = g_dir_make_tmp("teapot-bench-XXXXXX", &error);
+      if (!root) {
+        g_printerr("Failed to create a temporary directory: %s\n", error->message);
+        g_clear_error(&error);
+        g_array_unref(classes);
+        return 1;
+      }
+      temp_root = TRUE;
+    }
+
+    gboolean r = bench_generate(classes);
+    g_array_unref(classes);
+    if (!r) {
+      ret = 1;
+      goto out;
+    }
+  } else if (teapot && !root) {
+    g_printerr("--teapot with --path needs --root to serve from.\n");
+    return 1;
+  }
+
+  GPid pid = 0;
+  if (teapot) {
+    pid = bench_spawn_teapot();
+    if (!pid) {
+      ret = 1;
+      goto out;
+    }
+  }
+
+  g_print(
+    "%s %s://%s:%d, %d connections%s, %d s, %s\n",
+    teapot ? "Running Teapot on" : "Benchmarking",
+    tls ? "https" : "http", host, port, connections,
+    no_keepalive ? " (no keep-alive)" : "", duration,
+    rate > 0 ? "open loop" : "closed loop"
+  );
+  if (rate > 0)
+    g_print("Target rate: %d req/s\n", rate);
+
+  // Start everyone at the same time, once all threads are up
+  struct BenchWorker *workers = g_new0(struct BenchWorker, (gsize)connections);
+  start_time = bench_now() + 100 * 1000000 + (gint64)connections * 100000;
+  end_time   = start_time + (gint64)duration * 1000000000;
+
+  for (gint i = 0; i < connections; i++) {
+    workers[i].id     = (guint)i;
+    workers[i].rand   = g_rand_new_with_seed((guint32)seed + (guint32)i);
+    workers[i].client = g_socket_client_new();
+    workers[i].thread = g_thread_new("bench_worker", bench_worker_run, &workers[i]);
+  }
+
+  for (gint i = 0; i < connections; i++) {
+    g_thread_join(workers[i].thread);
+    g_rand_free(workers[i].rand);
+    g_clear_object(&workers[i].client);
+  }
+
+  bench_report(workers, MAX(bench_now(), end_time) - start_time);
+  g_free(workers);
+
+  if (pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    g_spawn_close_pid(pid);
+  }
+
+out:
+  if (temp_root)
+    bench_remove_root();
+
+  return ret;
+}
@@ -0,0 +1,173 @@
+#include <string.h>
+#include <sys/socket.h>
+#include <gio/gio.h>
+#include "log.h"
+#include "metrics.h"
+#include "admission.h"
+#include "config.h"
+
+/**
+ * Wait for a thread above which the adaptive queue limit is cut, when no
+ * maximum wait is set (otherwise half of it).
+ */
+#define ADAPTIVE_TARGET_WAIT (100 * G_TIME_SPAN_MILLISECOND)
+
+/**
+ * Bounds of the adaptive queue limit, the upper one applying when no maximum
+ * queue is set.
+ */
+#define ADAPTIVE_MIN_LIMIT 4
+#define ADAPTIVE_MAX_LIMIT 4096
+
+/**
+ * Factor the adaptive queue limit is cut by, at most once per target wait.
+ */
+#define ADAPTIVE_BACKOFF 0.7
+
+/**
+ * Reads made to drain what a shed client has sent, before answering.
+ */
+#define SHED_DRAIN_READS 4
+
+/********** Internal States **********/
+
+static gchar *rejection        = NULL; ///< The 503 response, built once
+static gsize  rejection_length = 0;
+
+/********** Private APIs **********/
+
+/**
+ * Count one more against a limit, unless it has been reached.
+ */
+static bool teapot_admission_take(gint *count, gint limit)
+{
+  if (limit <= 0) {
+    g_atomic_int_inc(count);
+    return true;
+  }
+
+  if (g_atomic_int_add(count, 1) >= limit) {
+    g_atomic_int_add(count, -1);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Adapt the queue limit to a wait observed: additive increase (by one per
+ * limit worth of connections served in time), multiplicative decrease.
+ */
+static void teapot_admission_adapt(struct TeapotAdmission *admission, gint64 wait, gint64 now)
+{
+  gint64  target = admission->max_queue_wait ? admission->max_queue_wait / 2 : ADAPTIVE_TARGET_WAIT;
+  gdouble upper  = admission->max_queue ? (gdouble)admission->max_queue : ADAPTIVE_MAX_LIMIT;
+
+  g_mutex_lock(&admission->lock);
+
+  if (wait > target) {
+    // Those queued meanwhile are to wait as long; cut once for all of them
+    if (now - admission->decreased > target) {
+      admission->limit     = MAX(admission->limit * ADAPTIVE_BACKOFF, ADAPTIVE_MIN_LIMIT);
+      admission->decreased = now;
+      teapot_trace("%s: queue limit cut to %.0f after waiting %" G_GINT64_FORMAT " us", admission->name, admission->limit, wait);
+    }
+  } else {
+    admission->limit = MIN(admission->limit + 1.0 / admission->limit, upper);
+  }
+
+  g_atomic_int_set(&admission->queue_limit, (gint)admission->limit);
+
+  g_mutex_unlock(&admission->lock);
+}
+
+/********** Public APIs **********/
+
+void teapot_admission_init(struct TeapotAdmission *admission, const gchar *name, guint max_connections, guint max_queue, guint max_queue_wait, bool adaptive)
+{
+  admission->name            = name;
+  admission->max_connections = max_connections;
+  admission->max_queue       = max_queue;
+  admission->max_queue_wait  = (gint64)max_queue_wait * G_TIME_SPAN_MILLISECOND;
+  admission->adaptive        = adaptive;
+
+  admission->connections = 0;
+  admission->queued      = 0;
+  admission->limit       = max_queue ? (gdouble)max_queue : ADAPTIVE_MAX_LIMIT;
+  admission->decreased   = 0;
+  admission->queue_limit = (adaptive || max_queue) ? (gint)admission->limit : 0;
+  g_mutex_init(&admission->lock);
+
+  if (!rejection)
+    teapot_admission_set_retry_after(TEAPOT_DEFAULT_RETRY_AFTER);
+
+  g_message(
+    "%s: at most %u connections, %u queued for %u ms%s (0 for no limit)",
+    name, max_connections, max_queue, max_queue_wait, adaptive ? ", queue limit adapted to waits" : ""
+  );
+}
+
+void teapot_admission_set_retry_after(guint seconds)
+{
+  g_free(rejection);
+
+  rejection = g_strdup_printf(
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Retry-After: %u\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n",
+    seconds
+  );
+  rejection_length = strlen(rejection);
+}
+
+bool teapot_admission_enter(struct TeapotAdmission *admission)
+{
+  return teapot_admission_take(&admission->connections, (gint)admission->max_connections);
+}
+
+void teapot_admission_leave(struct TeapotAdmission *admission)
+{
+  g_atomic_int_add(&admission->connections, -1);
+}
+
+bool teapot_admission_enqueue(struct TeapotAdmission *admission)
+{
+  return teapot_admission_take(&admission->queued, g_atomic_int_get(&admission->queue_limit));
+}
+
+bool teapot_admission_dequeue(struct TeapotAdmission *admission, gint64 queued)
+{
+  g_atomic_int_add(&admission->queued, -1);
+
+  gint64 now  = g_get_monotonic_time();
+  gint64 wait = now - queued;
+
+  if (admission->adaptive)
+    teapot_admission_adapt(admission, wait, now);
+
+  return admission->max_queue_wait == 0 || wait <= admission->max_queue_wait;
+}
+
+void teapot_admission_shed(GSocketConnection *socket_conn, bool answer)
+{
+  teapot_metrics_count(TEAPOT_METRICS_CONNECTIONS_SHED, 1);
+
+  if (answer) {
+    gint  fd = g_socket_get_fd(g_socket_connection_get_socket(socket_conn));
+    gchar discard[1024];
+
+    // Closing with a request unread would reset the connection, and the
+    // answer with it; read what has arrived so far, without waiting
+    for (gint i = 0; i < SHED_DRAIN_READS && recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0; i++)
+      ;
+
+    // A fresh socket has room for this, so it never blocks
+    if (send(fd, rejection, rejection_length, MSG_DONTWAIT | MSG_NOSIGNAL) > 0)
+      shutdown(fd, SHUT_WR);
+  }
+
+  g_io_stream_close(G_IO_STREAM(socket_conn), NULL, NULL);
+  g_object_unref(socket_conn);
+}
@@ -0,0 +1,97 @@
+#ifndef TEAPOT_ADMISSION_H
+#define TEAPOT_ADMISSION_H
+
+// C99 boolean
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+
+#include <gio/gio.h>
+#include <glib.h>
+
+/**
+ * Limits of a listener, and what is admitted against them.
+ *
+ * Connections beyond the limits are shed right after being accepted, so that
+ * those admitted keep their latency instead of everyone slowing down.
+ */
+struct TeapotAdmission {
+  const gchar *name;        ///< "HTTP" or "HTTPS", for logging
+
+  guint  max_connections;   ///< Most connections open at once, 0 for no limit
+  guint  max_queue;         ///< Most connections waiting for a thread, 0 for no limit
+  gint64 max_queue_wait;    ///< Longest a connection may wait for a thread (us), 0 for no limit
+  bool   adaptive;          ///< Whether the queue limit follows the observed waits
+
+  gint   connections;       ///< Connections open (atomic)
+  gint   queued;            ///< Connections waiting for a thread (atomic)
+  gint   queue_limit;       ///< Current limit of queued (atomic), see `adaptive`
+
+  GMutex lock;              ///< Protects the fields below
+  gdouble limit;            ///< Adaptive limit, with its fractional part
+  gint64  decreased;        ///< When the adaptive limit was last decreased
+};
+
+/**
+ * Set up the limits of a listener.
+ *
+ * @param admission       [out] The admission control to set up.
+ * @param name            [in]  Name of the listener, for logging. Not copied.
+ * @param max_connections [in]  Most connections open at once, 0 for no limit.
+ * @param max_queue       [in]  Most connections waiting for a thread, 0 for no
+ *                              limit.
+ * @param max_queue_wait  [in]  Longest a connection may wait for a thread, in
+ *                              milliseconds, 0 for no limit.
+ * @param adaptive        [in]  Whether to adapt the queue limit to the waits
+ *                              observed (AIMD): cut it when connections wait
+ *                              too long, raise it slowly while they do not.
+ */
+void teapot_admission_init(struct TeapotAdmission *admission, const gchar *name, guint max_connections, guint max_queue, guint max_queue_wait, bool adaptive);
+
+/**
+ * Set the Retry-After value of 503 responses sent when shedding.
+ *
+ * @param seconds [in] Seconds after which clients may try again.
+ */
+void teapot_admission_set_retry_after(guint seconds);
+
+/**
+ * Admit a connection against the limit of open connections.
+ *
+ * @return true if admitted; it must be released with `teapot_admission_leave`.
+ */
+bool teapot_admission_enter(struct TeapotAdmission *admission);
+
+/**
+ * Release a connection admitted by `teapot_admission_enter`.
+ */
+void teapot_admission_leave(struct TeapotAdmission *admission);
+
+/**
+ * Admit a connection into the queue of a thread pool.
+ *
+ * @return true if admitted; `teapot_admission_dequeue` must be called when a
+ *         thread takes it.
+ */
+bool teapot_admission_enqueue(struct TeapotAdmission *admission);
+
+/**
+ * Take a connection out of the queue, and learn from how long it waited.
+ *
+ * @param queued [in] When the connection was queued (`g_get_monotonic_time`).
+ * @return true if it has not waited too long to be served.
+ */
+bool teapot_admission_dequeue(struct TeapotAdmission *admission, gint64 queued);
+
+/**
+ * Shed a connection which was not admitted: answer 503 Service Unavailable
+ * (with Retry-After) over plain HTTP, or just close it over HTTPS, where an
+ * answer would need the very handshake being avoided.
+ *
+ * @param socket_conn [in] The connection. The reference held by the caller
+ *                         is taken over.
+ * @param answer      [in] Whether to answer 503 before closing.
+ */
+void teapot_admission_shed(GSocketConnection *socket_conn, bool answer);
+
+#endif
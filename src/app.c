@@ -1,6 +1,17 @@
 #include <stdio.h>
+#include <signal.h>
 #include <gio/gio.h>
 #include <glib.h>
+#include <glib-unix.h>
+#include "admission.h"
+#include "cache.h"
+#include "compress.h"
+#include "connection.h"
+#include "http.h"
+#include "log.h"
+#include "metrics.h"
+#include "mime.h"
+#include "reactor.h"
 #include "server.h"
 #include "app.h"
 #include "redir.h"
@@ -9,24 +20,289 @@
 // Address and ports to bind on
 // Strings are set later to prevent memory freeing on static data
 // (which is illegal)
-static struct TeapotHttpBinding http_binding = {
+static struct TeapotBinding http_binding = {
+  .name    = "HTTP",
   .address = NULL,
   .port    = TEAPOT_DEFAULT_HTTP_PORT,
+  .tls     = FALSE,
+  .max_connections = TEAPOT_DEFAULT_MAX_CONNECTIONS,
+  .acceptors       = TEAPOT_DEFAULT_ACCEPTORS,
 };
 
-static struct TeapotHttpsBinding https_binding = {
+static struct TeapotBinding https_binding = {
+  .name      = "HTTPS",
   .address   = NULL,
   .port      = TEAPOT_DEFAULT_HTTPS_PORT,
+  .tls       = TRUE,
   .cert_path = NULL,
   .pkey_path = NULL,
+  .max_connections      = TEAPOT_DEFAULT_MAX_CONNECTIONS,
+  .handshake_threads    = TEAPOT_DEFAULT_HANDSHAKE_THREADS,
+  .handshake_queue      = TEAPOT_DEFAULT_HANDSHAKE_QUEUE,
+  .handshake_queue_wait = TEAPOT_DEFAULT_HANDSHAKE_QUEUE_WAIT,
+  .adaptive             = FALSE,
+  .acceptors            = TEAPOT_DEFAULT_ACCEPTORS,
 };
 
+// Listeners of [Listener <name>] sections (struct TeapotBinding), which
+// replace the HTTP and HTTPS ones above; NULL if there are none
+static GPtrArray *listeners = NULL;
+
+// Retry-After of responses to connections shed under overload
+static guint retry_after = TEAPOT_DEFAULT_RETRY_AFTER;
+
+static struct TeapotMetricsBinding metrics_binding = {
+  .address = NULL,
+  .port    = TEAPOT_DEFAULT_METRICS_PORT,
+  .path    = NULL,
+};
+
+// Number of reactor threads driving the connections
+static guint reactor_threads = TEAPOT_DEFAULT_REACTOR_THREADS;
+
+// Sockets sharing the address of each listener, and whether threads stick to
+// processors
+static guint    acceptors    = TEAPOT_DEFAULT_ACCEPTORS;
+static gboolean cpu_affinity = TEAPOT_DEFAULT_CPU_AFFINITY;
+
+// Options of listening sockets, defaults for the [Listener <name>] sections
+static struct TeapotSocketOptions socket_options = {
+  .backlog        = TEAPOT_DEFAULT_LISTEN_BACKLOG,
+  .defer_accept   = TEAPOT_DEFAULT_DEFER_ACCEPT,
+  .fast_open      = TEAPOT_DEFAULT_FAST_OPEN,
+  .nodelay        = TEAPOT_DEFAULT_TCP_NODELAY,
+  .send_buffer    = TEAPOT_DEFAULT_SEND_BUFFER,
+  .receive_buffer = TEAPOT_DEFAULT_RECEIVE_BUFFER,
+  .accept_batch   = TEAPOT_DEFAULT_ACCEPT_BATCH,
+};
+
+// Persistent connection limits
+static guint keepalive_requests = TEAPOT_DEFAULT_KEEPALIVE_REQUESTS;
+static guint keepalive_timeout  = TEAPOT_DEFAULT_KEEPALIVE_TIMEOUT;
+
+// Request limits
+static guint64 max_header_size = TEAPOT_DEFAULT_MAX_HEADER_SIZE;
+static guint64 max_body_size   = TEAPOT_DEFAULT_MAX_BODY_SIZE;
+
+// Static content cache limits
+static guint64 cache_size          = TEAPOT_DEFAULT_CACHE_SIZE;
+static guint64 cache_max_file_size = TEAPOT_DEFAULT_CACHE_MAX_FILE_SIZE;
+
+// Content compression settings; types are set later like the strings above
+static guint64  gzip_min_size = TEAPOT_DEFAULT_GZIP_MIN_SIZE;
+static gchar  **gzip_types    = NULL;
+
+// Where the access log goes, NULL for nowhere
+static gchar *access_log = NULL;
+
+// MIME types in addition to the compiled-in ones, from the [MIME] section
+static GHashTable *mime_types = NULL;
+static gboolean    mime_sniff = TEAPOT_DEFAULT_MIME_SNIFF;
+
+// The configuration file read, if any, to read again on SIGHUP
+static gchar *config_path = NULL;
+
 /********** Private APIs **********/
 
+/**
+ * Read one redirection list of the URL section into a set of rules.
+ *
+ * @return 0 on success, 1 if the list is malformed.
+ */
+static int teapot_read_redirection_list(GKeyFile *conf, const char *status, struct TeapotRedirRoutes *routes)
+{
+  GError *error = NULL;
+  int     r     = 0;
+
+  gchar *path_key   = g_strdup_printf("%s-path", status);
+  gchar *target_key = g_strdup_printf("%s-target", status);
+
+  gsize n_redir_path = 0;
+  gsize n_redir_target = 0;
+  gchar **redir_path = g_key_file_get_string_list(conf, "URL", path_key, &n_redir_path, NULL);
+  gchar **redir_target = redir_path ? g_key_file_get_string_list(conf, "URL", target_key, &n_redir_target, &error) : NULL;
+
+  g_free(path_key);
+  g_free(target_key);
+
+  // We just skip it if not defined
+  if (!redir_path)
+    return 0;
+
+  if (!redir_target) {
+    g_warning("Malformed %s list: %s", status, error->message);
+    g_clear_error(&error);
+    g_strfreev(redir_path);
+    return 0;
+  }
+
+  if (n_redir_path != n_redir_target) {
+    // Two lists have different length, not good
+    g_warning("Malformed %s list: number of path and target does not match", status);
+    r = 1;
+  }
+
+  // Compile the rules into the routes (which copy them)
+  for (gsize i = 0; r == 0 && i < n_redir_path; i++) {
+    g_debug("%s: %s -> %s", status, redir_path[i], redir_target[i]);
+
+    if (!teapot_redir_routes_add(routes, g_str_equal(status, "301"), redir_path[i], redir_target[i]))
+      r = 1;
+  }
+
+  g_strfreev(redir_target);
+  g_strfreev(redir_path);
+
+  return r;
+}
+
+/**
+ * Read the URL section and publish the redirections in it, replacing those
+ * in use. Nothing is replaced if a list is malformed.
+ *
+ * @return 0 on success, 1 if a list is malformed.
+ */
+static int teapot_read_redirections(GKeyFile *conf)
+{
+  struct TeapotRedirRoutes *routes = teapot_redir_routes_new();
+
+  if (teapot_read_redirection_list(conf, "301", routes) != 0 || teapot_read_redirection_list(conf, "302", routes) != 0) {
+    teapot_redir_routes_free(routes);
+    return 1;
+  }
+
+  g_message("Setting up redirection");
+
+  // The routes are read by the reactors from now on
+  teapot_redir_publish(routes);
+
+  return 0;
+}
+
+/**
+ * Read a [Listener <name>] section into a listener of its own.
+ *
+ * @return 0 on success, 1 if the section is malformed.
+ */
+static int teapot_read_listener(GKeyFile *conf, const gchar *group)
+{
+  GError  *error     = NULL;
+  gint     temp_int  = 0;
+  gboolean temp_bool = FALSE;
+  gchar   *temp_str  = NULL;
+
+  struct TeapotBinding *binding = g_new0(struct TeapotBinding, 1);
+
+  binding->name      = g_strdup(group + strlen("Listener "));
+  binding->tls       = g_key_file_get_boolean(conf, group, "tls", NULL);
+  binding->address   = g_key_file_get_string(conf, group, "bind", NULL);
+  binding->cert_path = g_key_file_get_string(conf, group, "cert", NULL); // Set later if NULL
+  binding->pkey_path = g_key_file_get_string(conf, group, "key", NULL);
+  binding->ipv6_only = g_key_file_get_boolean(conf, group, "ipv6-only", NULL);
+
+  if (!binding->address)
+    binding->address = g_strdup(TEAPOT_DEFAULT_BIND_ADDRESS);
+
+  // Limits not given are those of the [Teapot] section
+  binding->max_connections      = binding->tls ? https_binding.max_connections : http_binding.max_connections;
+  binding->handshake_threads    = https_binding.handshake_threads;
+  binding->handshake_queue      = https_binding.handshake_queue;
+  binding->handshake_queue_wait = https_binding.handshake_queue_wait;
+  binding->adaptive             = https_binding.adaptive;
+  binding->acceptors            = acceptors;
+  binding->options              = socket_options;
+
+  struct {
+    const gchar *key;
+    guint       *value;
+    guint        min;
+  } limits[] = {
+    { "max-connections", &binding->max_connections, 0 },
+    { "handshake-threads", &binding->handshake_threads, 1 },
+    { "handshake-queue", &binding->handshake_queue, 0 },
+    { "handshake-queue-wait", &binding->handshake_queue_wait, 0 },
+    { "acceptors", &binding->acceptors, 0 },
+    { "listen-backlog", &binding->options.backlog, 1 },
+    { "defer-accept", &binding->options.defer_accept, 0 },
+    { "fast-open", &binding->options.fast_open, 0 },
+    { "send-buffer", &binding->options.send_buffer, 0 },
+    { "receive-buffer", &binding->options.receive_buffer, 0 },
+    { "accept-batch", &binding->options.accept_batch, 1 },
+  };
+
+  for (gsize i = 0; i < G_N_ELEMENTS(limits); i++) {
+    temp_int = g_key_file_get_integer(conf, group, limits[i].key, &error);
+    if (!error) {
+      if (temp_int < (gint)limits[i].min) {
+        g_printerr("[%s] %s should be at least %u.\n", group, limits[i].key, limits[i].min);
+        return 1;
+      }
+
+      *limits[i].value = (guint)temp_int;
+    } else {
+      g_clear_error(&error);
+    }
+  }
+
+  temp_bool = g_key_file_get_boolean(conf, group, "handshake-queue-adaptive", &error);
+  if (!error)
+    binding->adaptive = temp_bool;
+  else
+    g_clear_error(&error);
+
+  temp_bool = g_key_file_get_boolean(conf, group, "tcp-nodelay", &error);
+  if (!error)
+    binding->options.nodelay = temp_bool;
+  else
+    g_clear_error(&error);
+
+  if (g_str_has_prefix(binding->address, "unix:")) {
+    // Permissions of the socket file, in octal
+    temp_str = g_key_file_get_string(conf, group, "mode", NULL);
+    if (temp_str) {
+      gchar  *end  = NULL;
+      guint64 mode = g_ascii_strtoull(temp_str, &end, 8);
+
+      if (end == temp_str || *end != '\0' || mode > 0777) {
+        g_printerr("[%s] mode should be permissions in octal, like 0660.\n", group);
+        g_free(temp_str);
+        return 1;
+      }
+
+      binding->mode = (guint)mode;
+      g_free(temp_str);
+    }
+  } else {
+    // Port number is actually from 1 to 65535
+    temp_int = g_key_file_get_integer(conf, group, "port", &error);
+    if (error || temp_int < 1 || temp_int > G_MAXUINT16) {
+      g_printerr("[%s] port should range from 1 to 65535.\n", group);
+      g_clear_error(&error);
+      return 1;
+    }
+
+    binding->port = (guint16)temp_int;
+  }
+
+  g_debug(
+    "Listener %s set to %s:%d%s",
+    binding->name, binding->address, binding->port, binding->tls ? " (TLS)" : ""
+  );
+
+  if (!listeners)
+    listeners = g_ptr_array_new();
+  g_ptr_array_add(listeners, binding);
+
+  return 0;
+}
+
 static int teapot_read_config_file(const char *path)
 {
   gchar   *temp_str  = NULL;
   gint32   temp_port = 0;
+  gint     temp_int  = 0;
+  guint64  temp_size = 0;
+  gboolean temp_bool = FALSE;
   GError  *error     = NULL;
   gboolean r         = FALSE;
 
@@ -46,22 +322,65 @@ static int teapot_read_config_file(const char *path)
     http_binding.address  = g_strdup(temp_str);
     https_binding.address = g_strdup(temp_str);
     g_free(temp_str);
+  } else {
+    g_clear_error(&error);
+  }
+
+  temp_str = g_key_file_get_string(conf, "Teapot", "metrics-bind", &error);
+  if (temp_str) {
+    g_free(metrics_binding.address);
+    metrics_binding.address = temp_str;
+  } else {
+    g_clear_error(&error);
+  }
+
+  temp_port = (gint32)g_key_file_get_integer(conf, "Teapot", "metrics-port", &error);
+  if (!error) {
+    // 0 turns the endpoint off
+    if (temp_port < 0 || temp_port > G_MAXUINT16) {
+      g_printerr("Port number should range from 1 to 65535.\n");
+      return 1;
+    }
+
+    metrics_binding.port = (guint16)temp_port;
+  } else {
+    g_clear_error(&error);
+  }
+
+  temp_str = g_key_file_get_string(conf, "Teapot", "metrics-path", &error);
+  if (temp_str) {
+    g_free(metrics_binding.path);
+    metrics_binding.path = temp_str;
+  } else {
+    g_clear_error(&error);
+  }
+
+  temp_str = g_key_file_get_string(conf, "Teapot", "access-log", &error);
+  if (temp_str) {
+    g_free(access_log);
+    access_log = temp_str;
+  } else {
+    g_clear_error(&error);
   }
 
   temp_str = g_key_file_get_string(conf, "Teapot", "cert", &error);
   if (temp_str) {
     https_binding.cert_path = g_strdup(temp_str);
     g_free(temp_str);
+  } else {
+    g_clear_error(&error);
   }
 
   temp_str = g_key_file_get_string(conf, "Teapot", "key", &error);
   if (temp_str) {
     https_binding.pkey_path = g_strdup(temp_str);
     g_free(temp_str);
+  } else {
+    g_clear_error(&error);
   }
 
   temp_port = (gint32)g_key_file_get_integer(conf, "Teapot", "http-port", &error);
-  if (temp_str != 0) {
+  if (!error) {
     // Port number is actually from 1 to 65535
     if (temp_port < 1 || temp_port > G_MAXUINT16) {
       g_printerr("Port number should range from 1 to 65535.\n");
@@ -69,10 +388,12 @@ static int teapot_read_config_file(const char *path)
     }
 
     http_binding.port = (guint16)CLAMP(temp_port, 1, G_MAXUINT16);
+  } else {
+    g_clear_error(&error);
   }
 
   temp_port = (gint32)g_key_file_get_integer(conf, "Teapot", "https-port", &error);
-  if (temp_str != 0) {
+  if (!error) {
     // Port number is actually from 1 to 65535
     if (temp_port < 1 || temp_port > 65535) {
       g_printerr("Port number should range from 1 to 65535.\n");
@@ -80,54 +401,181 @@ static int teapot_read_config_file(const char *path)
     }
 
     https_binding.port = (guint16)CLAMP(temp_port, 1, G_MAXUINT16);
+  } else {
+    g_clear_error(&error);
   }
 
-  // Also reads URL section for 302 redirection list
-  gsize n_redir_path = 0;
-  gchar **redir_path = g_key_file_get_string_list(conf, "URL", "302-path", &n_redir_path, &error);
-  if (redir_path) {
-    gsize n_redir_target = 0;
-    gchar **redir_target = g_key_file_get_string_list(conf, "URL", "302-target", &n_redir_target, &error);
-    if (redir_target) {
-
-      g_message("Setting up redirection");
-
-      if (n_redir_path != n_redir_target) {
-        // Two lists have different length, not good
-        g_warning("Malformed 302 list: number of path and target does not match");
+  temp_int = g_key_file_get_integer(conf, "Teapot", "reactor-threads", &error);
+  if (!error) {
+    if (temp_int < 0) {
+      g_printerr("Number of reactor threads cannot be negative.\n");
+      return 1;
+    }
 
-        // Free resources
-        g_strfreev(redir_target);
-        g_strfreev(redir_path);
-        g_key_file_free(conf);
+    reactor_threads = (guint)temp_int;
+  } else {
+    g_clear_error(&error);
+  }
 
-        // In this case we shall not continue
+  // Limits under overload, and how connections are accepted; negative values
+  // are refused as for the others
+  struct {
+    const gchar *key;
+    guint       *value;
+    guint        min;
+  } limits[] = {
+    { "http-max-connections", &http_binding.max_connections, 0 },
+    { "https-max-connections", &https_binding.max_connections, 0 },
+    { "handshake-threads", &https_binding.handshake_threads, 1 },
+    { "handshake-queue", &https_binding.handshake_queue, 0 },
+    { "handshake-queue-wait", &https_binding.handshake_queue_wait, 0 },
+    { "retry-after", &retry_after, 0 },
+    { "acceptors", &acceptors, 0 },
+    { "listen-backlog", &socket_options.backlog, 1 },
+    { "defer-accept", &socket_options.defer_accept, 0 },
+    { "fast-open", &socket_options.fast_open, 0 },
+    { "send-buffer", &socket_options.send_buffer, 0 },
+    { "receive-buffer", &socket_options.receive_buffer, 0 },
+    { "accept-batch", &socket_options.accept_batch, 1 },
+  };
+
+  for (gsize i = 0; i < G_N_ELEMENTS(limits); i++) {
+    temp_int = g_key_file_get_integer(conf, "Teapot", limits[i].key, &error);
+    if (!error) {
+      if (temp_int < (gint)limits[i].min) {
+        g_printerr("%s should be at least %u.\n", limits[i].key, limits[i].min);
         return 1;
       }
 
-      // Build the hash table (with destroy notifiers)
-      GHashTable *redir_list = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+      *limits[i].value = (guint)temp_int;
+    } else {
+      g_clear_error(&error);
+    }
+  }
 
-      for (gsize i = 0; i < n_redir_path; i++) {
-        g_debug("302: %s -> %s", redir_path[i], redir_target[i]);
-        g_hash_table_insert(redir_list, g_strdup(redir_path[i]), g_strdup(redir_target[i]));
-      }
+  http_binding.acceptors  = acceptors;
+  https_binding.acceptors = acceptors;
 
-      // Put the hash table into our provider
-      teapot_redir_302_init(redir_list);
+  temp_bool = g_key_file_get_boolean(conf, "Teapot", "handshake-queue-adaptive", &error);
+  if (!error)
+    https_binding.adaptive = temp_bool;
+  else
+    g_clear_error(&error);
 
-      // The provider holds a reference, so we unref here
-      g_hash_table_unref(redir_list);
+  temp_bool = g_key_file_get_boolean(conf, "Teapot", "cpu-affinity", &error);
+  if (!error)
+    cpu_affinity = temp_bool;
+  else
+    g_clear_error(&error);
 
-      // Free unused memory, they are already duplicated into the hash table
-      g_strfreev(redir_target);
-      g_strfreev(redir_path);
+  temp_bool = g_key_file_get_boolean(conf, "Teapot", "tcp-nodelay", &error);
+  if (!error)
+    socket_options.nodelay = temp_bool;
+  else
+    g_clear_error(&error);
 
-    } else {
-      g_warning("Malformed 302 list: %s", error->message);
-      g_clear_error(&error);
+  temp_int = g_key_file_get_integer(conf, "Teapot", "keepalive-requests", &error);
+  if (!error) {
+    if (temp_int < 0) {
+      g_printerr("Maximum requests per connection cannot be negative.\n");
+      return 1;
     }
-  } else {} // we just skip it if not defined
+
+    keepalive_requests = (guint)temp_int;
+  } else {
+    g_clear_error(&error);
+  }
+
+  temp_int = g_key_file_get_integer(conf, "Teapot", "keepalive-timeout", &error);
+  if (!error) {
+    if (temp_int < 0) {
+      g_printerr("Idle timeout cannot be negative.\n");
+      return 1;
+    }
+
+    keepalive_timeout = (guint)temp_int;
+  } else {
+    g_clear_error(&error);
+  }
+
+  temp_size = g_key_file_get_uint64(conf, "Teapot", "max-header-size", &error);
+  if (!error)
+    max_header_size = temp_size;
+  else
+    g_clear_error(&error);
+
+  temp_size = g_key_file_get_uint64(conf, "Teapot", "max-body-size", &error);
+  if (!error)
+    max_body_size = temp_size;
+  else
+    g_clear_error(&error);
+
+  temp_size = g_key_file_get_uint64(conf, "Teapot", "cache-size", &error);
+  if (!error)
+    cache_size = temp_size;
+  else
+    g_clear_error(&error);
+
+  temp_size = g_key_file_get_uint64(conf, "Teapot", "cache-max-file-size", &error);
+  if (!error)
+    cache_max_file_size = temp_size;
+  else
+    g_clear_error(&error);
+
+  temp_size = g_key_file_get_uint64(conf, "Teapot", "gzip-min-size", &error);
+  if (!error)
+    gzip_min_size = temp_size;
+  else
+    g_clear_error(&error);
+
+  // An empty list turns compression off
+  gchar **temp_list = g_key_file_get_string_list(conf, "Teapot", "gzip-types", NULL, &error);
+  if (temp_list) {
+    g_strfreev(gzip_types);
+    gzip_types = temp_list;
+  } else {
+    g_clear_error(&error);
+  }
+
+  temp_bool = g_key_file_get_boolean(conf, "Teapot", "mime-sniff", &error);
+  if (!error)
+    mime_sniff = temp_bool;
+  else
+    g_clear_error(&error);
+
+  // MIME section: each key is an extension, each value its type
+  gchar **mime_extensions = g_key_file_get_keys(conf, "MIME", NULL, NULL);
+  if (mime_extensions) {
+    if (!mime_types)
+      mime_types = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+    for (gchar **extension = mime_extensions; *extension; extension++) {
+      gchar *type = g_key_file_get_string(conf, "MIME", *extension, NULL);
+      if (type)
+        g_hash_table_insert(mime_types, g_strdup(*extension), type);
+    }
+
+    g_strfreev(mime_extensions);
+  }
+
+  // Each [Listener <name>] section is a listener of its own
+  gchar **groups = g_key_file_get_groups(conf, NULL);
+  for (gchar **group = groups; *group; group++) {
+    if (g_str_has_prefix(*group, "Listener ") && teapot_read_listener(conf, *group) != 0) {
+      g_strfreev(groups);
+      g_key_file_free(conf);
+      return 1;
+    }
+  }
+  g_strfreev(groups);
+
+  // Also reads URL section for redirection lists
+  if (teapot_read_redirections(conf) != 0) {
+    g_key_file_free(conf);
+
+    // In this case we shall not continue
+    return 1;
+  }
 
   g_key_file_free(conf);
 
@@ -151,7 +599,7 @@ static int teapot_handle_options(GApplication *app, GVariantDict *opts, gpointer
 
     // The configuration file specified in command line wins
     int r = teapot_read_config_file(temp_str);
-    g_free(temp_str);
+    config_path = temp_str;
 
     // An error occurred during configuration reading
     if (r != 0)
@@ -163,8 +611,10 @@ static int teapot_handle_options(GApplication *app, GVariantDict *opts, gpointer
     GFile *default_config = g_file_new_for_path(TEAPOT_DEFAULT_CONFIG_FILE_PATH);
     int r = 0;
 
-    if (g_file_query_exists(default_config, NULL))
+    if (g_file_query_exists(default_config, NULL)) {
       r = teapot_read_config_file(TEAPOT_DEFAULT_CONFIG_FILE_PATH);
+      config_path = g_strdup(TEAPOT_DEFAULT_CONFIG_FILE_PATH);
+    }
 
     g_clear_object(&default_config);
 
@@ -230,8 +680,35 @@ static int teapot_handle_options(GApplication *app, GVariantDict *opts, gpointer
     https_binding.port = (guint16)CLAMP(temp_port, 1, G_MAXUINT16);
   }
 
+  if (g_variant_dict_lookup(opts, "reactor-threads", "i", &temp_port)) {
+    if (temp_port < 0) {
+      g_printerr("Number of reactor threads cannot be negative.\n");
+      return 1;
+    }
+
+    reactor_threads = (guint)temp_port;
+  }
+
+  if (g_variant_dict_lookup(opts, "keepalive-requests", "i", &temp_port)) {
+    if (temp_port < 0) {
+      g_printerr("Maximum requests per connection cannot be negative.\n");
+      return 1;
+    }
+
+    keepalive_requests = (guint)temp_port;
+  }
+
+  if (g_variant_dict_lookup(opts, "keepalive-timeout", "i", &temp_port)) {
+    if (temp_port < 0) {
+      g_printerr("Idle timeout cannot be negative.\n");
+      return 1;
+    }
+
+    keepalive_timeout = (guint)temp_port;
+  }
+
   // Two ports cannot be the same
-  if (http_binding.port == https_binding.port) {
+  if (!listeners && http_binding.port == https_binding.port) {
     g_printerr("HTTP and HTTPS binding ports cannot be the same.\n");
     return 1;
   }
@@ -242,11 +719,65 @@ static int teapot_handle_options(GApplication *app, GVariantDict *opts, gpointer
   g_debug("HTTPS binding set to %s:%d%s", https_binding.address, https_binding.port, https_binding.port == TEAPOT_DEFAULT_HTTPS_PORT ? " (default)" : "");
   g_debug("TLS certificate path set to %s", https_binding.cert_path);
   g_debug("TLS peivate key path set to %s", https_binding.pkey_path);
+  g_debug("Reactor threads set to %u%s", reactor_threads, reactor_threads == 0 ? " (one per processor)" : "");
+  g_debug("Persistent connections: at most %u requests, %u seconds idle", keepalive_requests, keepalive_timeout);
+  g_debug("Cache size set to %" G_GUINT64_FORMAT " bytes, files up to %" G_GUINT64_FORMAT " bytes", cache_size, cache_max_file_size);
 
   // A negative exit code let GApplication continue to run
   return -1;
 }
 
+static gboolean teapot_on_sigusr1(gpointer data)
+{
+  (void) data;
+
+  // The log has been rotated
+  teapot_log_reopen();
+
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean teapot_on_reclaim(gpointer data)
+{
+  (void) data;
+
+  // Retry until every reactor has been quiescent since the lists were replaced
+  return teapot_redir_reclaim() ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+static gboolean teapot_on_sighup(gpointer data)
+{
+  (void) data;
+  GError *error = NULL;
+
+  if (!config_path) {
+    g_warning("Reload: no configuration file to read");
+    return G_SOURCE_CONTINUE;
+  }
+
+  GKeyFile *conf = g_key_file_new();
+
+  if (!g_key_file_load_from_file(conf, config_path, G_KEY_FILE_NONE, &error)) {
+    g_warning("Reload: cannot load config file %s: %s", config_path, error->message);
+    g_clear_error(&error);
+    g_key_file_free(conf);
+    return G_SOURCE_CONTINUE;
+  }
+
+  // Only the redirections can change under running connections; the rest
+  // (bindings, limits, caches) still needs a restart
+  g_message("Reload: reading the URL section of %s", config_path);
+
+  if (teapot_read_redirections(conf) != 0)
+    g_warning("Reload: redirections kept as they were");
+  else if (teapot_redir_reclaim())
+    g_timeout_add_seconds(1, teapot_on_reclaim, NULL);
+
+  g_key_file_free(conf);
+
+  return G_SOURCE_CONTINUE;
+}
+
 static void teapot_activate(GApplication *app, gpointer data)
 {
   (void) data;
@@ -258,11 +789,70 @@ static void teapot_activate(GApplication *app, gpointer data)
   // Increase reference count of the application, we are going to ignite
   g_application_hold(app);
 
-  // Spawn HTTP listener
-  g_thread_unref(g_thread_new("http_listener", (GThreadFunc)teapot_http_listener, &http_binding));
+  // Requests are logged from now on; SIGUSR1 reopens the log
+  teapot_log_init(access_log);
+  g_unix_signal_add(SIGUSR1, teapot_on_sigusr1, NULL);
+
+  // SIGHUP reloads the redirections
+  g_unix_signal_add(SIGHUP, teapot_on_sighup, NULL);
+
+  // Metrics are only recorded if someone can read them
+  teapot_metrics_init(metrics_binding.port != 0);
+
+  // Types of files are known from their names
+  teapot_mime_init(mime_types, mime_sniff);
 
-  // Spawn HTTPS listener
-  g_thread_unref(g_thread_new("https_listener", (GThreadFunc)teapot_https_listener, &https_binding));
+  // Files served will be cached from now on
+  teapot_cache_init((gsize)cache_size, (gsize)cache_max_file_size);
+
+  // Text files will be compressed for clients accepting it
+  if (!gzip_types)
+    gzip_types = g_strsplit(TEAPOT_DEFAULT_GZIP_TYPES, ";", -1);
+  teapot_compress_init((gsize)gzip_min_size, gzip_types);
+
+  // Spawn reactors, which drive all the connections accepted by the listeners
+  teapot_http_init((size_t)max_header_size, (size_t)max_body_size);
+  teapot_connection_init(keepalive_requests);
+  teapot_reactor_init(reactor_threads, keepalive_timeout, cpu_affinity);
+
+  // Connections beyond the limits of the listeners are told to come back
+  teapot_admission_set_retry_after(retry_after);
+
+  if (listeners) {
+    // Spawn the listeners of the configuration file
+    for (guint i = 0; i < listeners->len; i++) {
+      struct TeapotBinding *binding = g_ptr_array_index(listeners, i);
+
+      // Those without a certificate of their own use the one given globally
+      if (!binding->cert_path)
+        binding->cert_path = g_strdup(https_binding.cert_path);
+      if (!binding->pkey_path)
+        binding->pkey_path = g_strdup(https_binding.pkey_path);
+
+      gchar *name = g_strdup_printf("listener_%u", i);
+      g_thread_unref(g_thread_new(name, (GThreadFunc)teapot_listener, binding));
+      g_free(name);
+    }
+  } else {
+    http_binding.options  = socket_options;
+    https_binding.options = socket_options;
+
+    // Spawn HTTP listener
+    g_thread_unref(g_thread_new("http_listener", (GThreadFunc)teapot_listener, &http_binding));
+
+    // Spawn HTTPS listener
+    g_thread_unref(g_thread_new("https_listener", (GThreadFunc)teapot_listener, &https_binding));
+  }
+
+  // Spawn metrics listener
+  if (metrics_binding.port != 0) {
+    if (!metrics_binding.address)
+      metrics_binding.address = g_strdup(TEAPOT_DEFAULT_METRICS_ADDRESS);
+    if (!metrics_binding.path)
+      metrics_binding.path = g_strdup(TEAPOT_DEFAULT_METRICS_PATH);
+
+    g_thread_unref(g_thread_new("metrics_listener", (GThreadFunc)teapot_metrics_listener, &metrics_binding));
+  }
 
   // This handler will return, but since we've increased the refcount of app,
   // GApplication will keep running.
@@ -282,6 +872,9 @@ int teapot_run(int argc, char **argv)
   g_application_add_main_option(app, "https-port", 'P', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, "Port to bind the HTTPS service", "port");
   g_application_add_main_option(app, "cert", 'c', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING, "The TLS certificate to use", "path");
   g_application_add_main_option(app, "key", 'k', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING, "The TLS private key to use", "path");
+  g_application_add_main_option(app, "reactor-threads", 't', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, "Number of threads driving connections (0 for one per processor)", "n");
+  g_application_add_main_option(app, "keepalive-requests", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, "Maximum requests per persistent connection (0 for unlimited)", "n");
+  g_application_add_main_option(app, "keepalive-timeout", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, "Seconds before an idle connection is closed (0 for never)", "seconds");
   g_application_add_main_option(app, "version", 'v', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, "Show version string", NULL);
 
   // Register handlers to signals to support running of GApplication
@@ -0,0 +1,160 @@
+#include <string.h>
+#include <glib.h>
+#include "arena.h"
+
+/**
+ * Size of a chunk, header included. Most requests fit into one.
+ */
+#define ARENA_CHUNK_SIZE (16 * 1024)
+
+/**
+ * Allocations larger than this get a chunk of their own, which is freed
+ * (rather than kept) on reset.
+ */
+#define ARENA_LARGE_SIZE (ARENA_CHUNK_SIZE / 4)
+
+/**
+ * Most chunks a thread keeps for reuse; more are freed.
+ */
+#define ARENA_CACHED_CHUNKS 64
+
+/**
+ * Alignment of every allocation, enough for any type.
+ */
+#define ARENA_ALIGNMENT 16
+
+/********** Internal types **********/
+
+struct TeapotArenaChunk {
+  struct TeapotArenaChunk *next; ///< Next chunk in the arena, or in the cache
+  gsize size;                    ///< Bytes in data
+  gsize used;                    ///< Bytes of data allocated
+  char data[] __attribute__((aligned(ARENA_ALIGNMENT)));
+};
+
+/**
+ * Chunks a thread keeps for reuse.
+ */
+struct TeapotArenaCache {
+  struct TeapotArenaChunk *chunks;
+  guint n_chunks;
+};
+
+static void teapot_arena_cache_free(gpointer data);
+
+/********** Internal States **********/
+
+// The cache of each thread is freed when the thread exits
+static GPrivate thread_cache = G_PRIVATE_INIT(teapot_arena_cache_free);
+
+/********** Private APIs **********/
+
+static void teapot_arena_cache_free(gpointer data)
+{
+  struct TeapotArenaCache *cache = data;
+
+  while (cache->chunks) {
+    struct TeapotArenaChunk *next = cache->chunks->next;
+    g_free(cache->chunks);
+    cache->chunks = next;
+  }
+
+  g_free(cache);
+}
+
+static struct TeapotArenaCache *teapot_arena_cache(void)
+{
+  struct TeapotArenaCache *cache = g_private_get(&thread_cache);
+
+  if (!cache) {
+    cache = g_new0(struct TeapotArenaCache, 1);
+    g_private_set(&thread_cache, cache);
+  }
+
+  return cache;
+}
+
+/**
+ * Get a chunk with room for at least the given size.
+ */
+static struct TeapotArenaChunk *teapot_arena_chunk_new(gsize size)
+{
+  struct TeapotArenaChunk *chunk = NULL;
+
+  if (size <= ARENA_LARGE_SIZE) {
+    struct TeapotArenaCache *cache = teapot_arena_cache();
+
+    if (cache->chunks) {
+      chunk = cache->chunks;
+      cache->chunks = chunk->next;
+      cache->n_chunks--;
+    } else {
+      chunk = g_malloc(ARENA_CHUNK_SIZE);
+      chunk->size = ARENA_CHUNK_SIZE - sizeof(struct TeapotArenaChunk);
+    }
+  } else {
+    chunk = g_malloc(sizeof(struct TeapotArenaChunk) + size);
+    chunk->size = size;
+  }
+
+  chunk->used = 0;
+
+  return chunk;
+}
+
+/********** Public APIs **********/
+
+gpointer teapot_arena_alloc(struct TeapotArena *arena, gsize size)
+{
+  struct TeapotArenaChunk *chunk = arena->chunks;
+  gsize aligned = (size + ARENA_ALIGNMENT - 1) & ~(gsize)(ARENA_ALIGNMENT - 1);
+
+  if (chunk && chunk->size - chunk->used >= aligned) {
+    gpointer ret = chunk->data + chunk->used;
+    chunk->used += aligned;
+    return ret;
+  }
+
+  chunk = teapot_arena_chunk_new(aligned);
+  chunk->used = aligned;
+
+  if (aligned > ARENA_LARGE_SIZE && arena->chunks) {
+    // Keep allocating from the current chunk, which still has room
+    chunk->next = arena->chunks->next;
+    arena->chunks->next = chunk;
+  } else {
+    chunk->next   = arena->chunks;
+    arena->chunks = chunk;
+  }
+
+  return chunk->data;
+}
+
+gpointer teapot_arena_alloc0(struct TeapotArena *arena, gsize size)
+{
+  gpointer ret = teapot_arena_alloc(arena, size);
+  memset(ret, 0, size);
+
+  return ret;
+}
+
+void teapot_arena_reset(struct TeapotArena *arena)
+{
+  if (!arena->chunks)
+    return;
+
+  struct TeapotArenaCache *cache = teapot_arena_cache();
+
+  while (arena->chunks) {
+    struct TeapotArenaChunk *chunk = arena->chunks;
+    arena->chunks = chunk->next;
+
+    if (chunk->size == ARENA_CHUNK_SIZE - sizeof(struct TeapotArenaChunk) && cache->n_chunks < ARENA_CACHED_CHUNKS) {
+      chunk->next   = cache->chunks;
+      cache->chunks = chunk;
+      cache->n_chunks++;
+    } else {
+      g_free(chunk);
+    }
+  }
+}
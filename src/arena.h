@@ -0,0 +1,52 @@
+#ifndef TEAPOT_ARENA_H
+#define TEAPOT_ARENA_H
+
+#include <glib.h>
+
+/**
+ * A bump allocator for memory living as long as a request (or a few
+ * pipelined ones): allocating moves a pointer, and everything is freed at
+ * once by `teapot_arena_reset`.
+ *
+ * Memory comes in chunks, kept by each thread for the next arenas to use, so
+ * that in a steady state requests take nothing from malloc at all.
+ */
+struct TeapotArena {
+  struct TeapotArenaChunk *chunks; ///< Chunks in use, the current one first, or NULL
+};
+
+/**
+ * An empty arena, holding no memory.
+ */
+#define TEAPOT_ARENA_INIT { NULL }
+
+/**
+ * Allocate memory from an arena. It is suitably aligned for any type, and
+ * freed by `teapot_arena_reset` only.
+ *
+ * @param arena [in] The arena to allocate from.
+ * @param size  [in] Number of bytes to allocate.
+ * @return The memory. Never NULL.
+ */
+gpointer teapot_arena_alloc(struct TeapotArena *arena, gsize size);
+
+/**
+ * Allocate zeroed memory from an arena, see `teapot_arena_alloc`.
+ */
+gpointer teapot_arena_alloc0(struct TeapotArena *arena, gsize size);
+
+/**
+ * Allocate one zeroed element of a type from an arena.
+ */
+#define teapot_arena_new0(arena, type) ((type *)teapot_arena_alloc0((arena), sizeof(type)))
+
+/**
+ * Free everything allocated from an arena, which holds no memory afterwards
+ * and may be used again. Its chunks go to the calling thread, for the next
+ * arenas to use.
+ *
+ * @param arena [in] The arena to reset.
+ */
+void teapot_arena_reset(struct TeapotArena *arena);
+
+#endif
@@ -0,0 +1,410 @@
+#include <errno.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <glib.h>
+#include "file.h"
+#include "cache.h"
+
+/**
+ * Number of shards the cache is split into. Each shard has its own lock, so
+ * threads looking up different files seldom wait for each other.
+ */
+#define CACHE_SHARDS 16
+
+/**
+ * Events on a watched directory which make cached files stale.
+ */
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/**
+ * Shortest interval between warnings about directories which cannot be
+ * watched (e.g. once max_user_watches is reached).
+ */
+#define WATCH_WARNING_INTERVAL (60 * G_TIME_SPAN_SECOND)
+
+/********** Internal types **********/
+
+/**
+ * A file in the cache.
+ */
+struct TeapotCacheEntry {
+  gchar             *path;     ///< Absolute path of the file (or another key)
+  struct TeapotFile *file;     ///< The file, with its content loaded
+  GList              lru_link; ///< Link in the LRU queue of the shard
+};
+
+/**
+ * A shard of the cache.
+ */
+struct TeapotCacheShard {
+  GMutex      lock;       ///< Protects everything below
+  GHashTable *entries;    ///< Absolute path -> struct TeapotCacheEntry
+  GQueue      lru;        ///< Entries, least recently used first
+  gsize       size;       ///< Bytes of content in the shard
+  guint64     generation; ///< Increased on every invalidation
+};
+
+/********** Internal States **********/
+
+static struct TeapotCacheShard shards[CACHE_SHARDS];
+static gsize    shard_capacity = 0;
+static gsize    max_size       = 0;
+static gboolean enabled        = FALSE;
+
+static gint        inotify_fd   = -1;
+static GMutex      watch_lock;
+static GHashTable *watches      = NULL; ///< Watch descriptor -> directory
+static GHashTable *watched_dirs = NULL; ///< Directory -> watch descriptor
+static gint64      watch_warned = 0;    ///< When a failure to watch was last told
+
+/********** Private APIs **********/
+
+static struct TeapotCacheShard *teapot_cache_shard(const char *abspath)
+{
+  return &shards[g_str_hash(abspath) % CACHE_SHARDS];
+}
+
+/**
+ * Remove an entry from its shard. The shard must be locked.
+ */
+static void teapot_cache_remove(struct TeapotCacheShard *shard, struct TeapotCacheEntry *entry)
+{
+  g_hash_table_remove(shard->entries, entry->path);
+  g_queue_unlink(&shard->lru, &entry->lru_link);
+  shard->size -= entry->file->size;
+
+  teapot_file_unref(entry->file);
+  g_free(entry->path);
+  g_free(entry);
+}
+
+/**
+ * Look an entry up, marking it as the most recently used one.
+ *
+ * @param generation [out] Generation of the shard at the time of the lookup.
+ * @return A reference to the cached file, or NULL on a miss.
+ */
+static struct TeapotFile *teapot_cache_find(const char *key, guint64 *generation)
+{
+  struct TeapotCacheShard *shard = teapot_cache_shard(key);
+  struct TeapotFile *file = NULL;
+
+  g_mutex_lock(&shard->lock);
+
+  struct TeapotCacheEntry *entry = g_hash_table_lookup(shard->entries, key);
+  if (entry) {
+    g_queue_unlink(&shard->lru, &entry->lru_link);
+    g_queue_push_tail_link(&shard->lru, &entry->lru_link);
+    file = teapot_file_ref(entry->file);
+  }
+
+  *generation = shard->generation;
+
+  g_mutex_unlock(&shard->lock);
+
+  return file;
+}
+
+/**
+ * Put a loaded file into its shard, evicting the least recently used files to
+ * make room.
+ *
+ * @param generation [in] Generation of the shard before the file was loaded.
+ *                        If a file has been invalidated since, the content may
+ *                        be stale, and it is not cached. NULL to skip the
+ *                        check.
+ */
+static void teapot_cache_insert(const char *abspath, struct TeapotFile *file, const guint64 *generation)
+{
+  struct TeapotCacheShard *shard = teapot_cache_shard(abspath);
+
+  if (file->size > shard_capacity)
+    return;
+
+  g_mutex_lock(&shard->lock);
+
+  if ((generation && shard->generation != *generation) || g_hash_table_lookup(shard->entries, abspath)) {
+    g_mutex_unlock(&shard->lock);
+    return;
+  }
+
+  while (shard->size + file->size > shard_capacity) {
+    GList *oldest = g_queue_peek_head_link(&shard->lru);
+    g_debug("Cache: evicting %s", ((struct TeapotCacheEntry *)oldest->data)->path);
+    teapot_cache_remove(shard, oldest->data);
+  }
+
+  struct TeapotCacheEntry *entry = g_new0(struct TeapotCacheEntry, 1);
+
+  entry->path          = g_strdup(abspath);
+  entry->file          = teapot_file_ref(file);
+  entry->lru_link.data = entry;
+
+  g_hash_table_insert(shard->entries, entry->path, entry);
+  g_queue_push_tail_link(&shard->lru, &entry->lru_link);
+  shard->size += file->size;
+
+  g_mutex_unlock(&shard->lock);
+
+  g_debug("Cache: cached %s (%zu bytes)", abspath, file->size);
+}
+
+/**
+ * Drop everything from the cache.
+ */
+static void teapot_cache_flush(void)
+{
+  for (guint i = 0; i < CACHE_SHARDS; i++) {
+    struct TeapotCacheShard *shard = &shards[i];
+    GList *oldest = NULL;
+
+    g_mutex_lock(&shard->lock);
+
+    while ((oldest = g_queue_peek_head_link(&shard->lru)))
+      teapot_cache_remove(shard, oldest->data);
+    shard->generation++;
+
+    g_mutex_unlock(&shard->lock);
+  }
+
+  teapot_file_forget(NULL);
+}
+
+/**
+ * Make sure the directory containing a file is watched.
+ *
+ * @return TRUE if it was watched already; a file opened before its directory
+ *         was watched may have changed unnoticed, so it is not to be cached.
+ */
+static gboolean teapot_cache_watch(const char *abspath)
+{
+  gchar *dir = g_path_get_dirname(abspath);
+  gboolean watched = TRUE;
+  gboolean added   = FALSE;
+
+  g_mutex_lock(&watch_lock);
+
+  if (!g_hash_table_lookup(watched_dirs, dir)) {
+    int wd = inotify_add_watch(inotify_fd, dir, WATCH_EVENTS | IN_ONLYDIR);
+    watched = FALSE;
+
+    if (wd < 0) {
+      // Removed meanwhile, which is no news; other failures (such as running
+      // out of watches) would repeat for every request, so they are told once
+      // in a while
+      int    error = errno;
+      gint64 now   = g_get_monotonic_time();
+      if (error != ENOENT && now - watch_warned >= WATCH_WARNING_INTERVAL) {
+        g_warning("Cache: failed to watch %s: %s", dir, g_strerror(error));
+        watch_warned = now;
+      }
+    } else {
+      g_debug("Cache: watching %s", dir);
+      g_hash_table_insert(watched_dirs, g_strdup(dir), GINT_TO_POINTER(wd));
+      g_hash_table_insert(watches, GINT_TO_POINTER(wd), g_strdup(dir));
+      added = TRUE;
+    }
+  }
+
+  g_mutex_unlock(&watch_lock);
+
+  // Metadata looked up before the watch may be stale, and nothing would tell
+  if (added)
+    teapot_file_forget(NULL);
+
+  g_free(dir);
+  return watched;
+}
+
+/**
+ * Handle one inotify event.
+ */
+static void teapot_cache_handle_event(const struct inotify_event *event)
+{
+  if (event->mask & IN_Q_OVERFLOW) {
+    // Events have been lost, so anything may be stale
+    g_message("Cache: inotify queue overflowed, flushing");
+    teapot_cache_flush();
+    return;
+  }
+
+  g_mutex_lock(&watch_lock);
+
+  gchar *dir = g_strdup(g_hash_table_lookup(watches, GINT_TO_POINTER(event->wd)));
+
+  if (event->mask & IN_IGNORED) {
+    // The watch is gone (e.g. the directory has been removed)
+    g_hash_table_remove(watches, GINT_TO_POINTER(event->wd));
+    if (dir)
+      g_hash_table_remove(watched_dirs, dir);
+  }
+
+  g_mutex_unlock(&watch_lock);
+
+  if (!dir)
+    return;
+
+  if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+    // Paths of every file under the directory changed
+    teapot_cache_flush();
+  } else if (event->len > 0) {
+    gchar *abspath = g_build_filename(dir, event->name, NULL);
+    teapot_cache_invalidate(abspath);
+    g_free(abspath);
+  }
+
+  g_free(dir);
+}
+
+/**
+ * Main loop of the thread reading inotify events.
+ */
+static gpointer teapot_cache_watcher(gpointer data)
+{
+  (void) data;
+
+  // Buffer aligned for struct inotify_event, as inotify(7) suggests
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  for (;;) {
+    ssize_t bytes = read(inotify_fd, buf, sizeof(buf));
+    if (bytes < 0) {
+      if (errno == EINTR)
+        continue;
+
+      g_warning("Cache: failed to read inotify events: %s", g_strerror(errno));
+      continue;
+    }
+
+    for (char *p = buf; p < buf + bytes; ) {
+      const struct inotify_event *event = (const struct inotify_event *)(void *)p;
+
+      teapot_cache_handle_event(event);
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+
+  return NULL;
+}
+
+/********** Public APIs **********/
+
+void teapot_cache_init(gsize capacity, gsize max_file_size)
+{
+  if (enabled) {
+    g_warning("Cache: double initialization");
+    return;
+  }
+
+  if (capacity == 0) {
+    g_message("Cache: disabled");
+    return;
+  }
+
+  inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (inotify_fd < 0) {
+    // Without invalidation the cache would serve stale files forever
+    g_warning("Cache: failed to initialize inotify: %s", g_strerror(errno));
+    g_warning("Cache: disabled");
+    return;
+  }
+
+  for (guint i = 0; i < CACHE_SHARDS; i++) {
+    g_mutex_init(&shards[i].lock);
+    shards[i].entries = g_hash_table_new(g_str_hash, g_str_equal);
+    g_queue_init(&shards[i].lru);
+  }
+
+  g_mutex_init(&watch_lock);
+  watches      = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+  watched_dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+  shard_capacity = capacity / CACHE_SHARDS;
+  max_size       = MIN(max_file_size, shard_capacity);
+  enabled        = TRUE;
+
+  g_thread_unref(g_thread_new("cache_watcher", teapot_cache_watcher, NULL));
+
+  g_message("Cache: %zu bytes, files up to %zu bytes", capacity, max_size);
+}
+
+struct TeapotFile *teapot_cache_get(const char *path)
+{
+  if (!enabled)
+    return teapot_file_open(path);
+
+  gchar *abspath = teapot_file_path(path);
+  if (!abspath)
+    return NULL;
+
+  guint64 generation = 0;
+  struct TeapotFile *file = teapot_cache_find(abspath, &generation);
+  if (file) {
+    g_free(abspath);
+    return file;
+  }
+
+  // Miss: large files are sent from the disk as usual
+  file = teapot_file_open(path);
+  if (!file || file->size > max_size) {
+    g_free(abspath);
+    return file;
+  }
+
+  // Only files worth caching have their directory watched; one opened before
+  // the watch is sent from the disk this once, as it may have changed since
+  if (!teapot_cache_watch(abspath)) {
+    g_free(abspath);
+    return file;
+  }
+
+  if (!teapot_file_load(file)) {
+    teapot_file_unref(file);
+    g_free(abspath);
+    return NULL;
+  }
+
+  teapot_cache_insert(abspath, file, &generation);
+
+  g_free(abspath);
+  return file;
+}
+
+struct TeapotFile *teapot_cache_lookup(const char *key)
+{
+  guint64 generation = 0;
+
+  if (!enabled)
+    return NULL;
+
+  return teapot_cache_find(key, &generation);
+}
+
+void teapot_cache_store(const char *key, struct TeapotFile *file)
+{
+  if (!enabled)
+    return;
+
+  teapot_cache_insert(key, file, NULL);
+}
+
+void teapot_cache_invalidate(const char *abspath)
+{
+  teapot_file_forget(abspath);
+
+  if (!enabled)
+    return;
+
+  struct TeapotCacheShard *shard = teapot_cache_shard(abspath);
+
+  g_mutex_lock(&shard->lock);
+
+  struct TeapotCacheEntry *entry = g_hash_table_lookup(shard->entries, abspath);
+  if (entry) {
+    g_debug("Cache: invalidating %s", abspath);
+    teapot_cache_remove(shard, entry);
+  }
+  shard->generation++;
+
+  g_mutex_unlock(&shard->lock);
+}
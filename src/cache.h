@@ -0,0 +1,66 @@
+#ifndef TEAPOT_CACHE_H
+#define TEAPOT_CACHE_H
+
+#include <glib.h>
+#include "file.h"
+
+/**
+ * Initialize the static content cache.
+ *
+ * The cache keeps the content of recently served files in memory, evicting
+ * the least recently used ones once it grows over its capacity. Files are
+ * watched with inotify, and dropped from the cache as soon as they change on
+ * disk.
+ *
+ * @param capacity      [in] Maximum bytes of content kept in memory. 0
+ *                           disables the cache.
+ * @param max_file_size [in] Files larger than this are never cached (they are
+ *                           sent straight from the disk instead).
+ */
+void teapot_cache_init(gsize capacity, gsize max_file_size);
+
+/**
+ * Get a file to serve, from the cache if possible.
+ *
+ * On a hit the cached `struct TeapotFile` is shared without copying. On a
+ * miss the file is opened; if it is small enough, it is loaded and put into
+ * the cache. This function is thread-safe.
+ *
+ * @param path [in] The requested path.
+ * @return A reference to the file, either with `content` loaded or with `fd`
+ *         opened. NULL if the file cannot be served. Drop the reference with
+ *         `teapot_file_unref` when it is no longer used.
+ */
+struct TeapotFile *teapot_cache_get(const char *path);
+
+/**
+ * Look a file derived from another one up in the cache.
+ *
+ * Derived files (e.g. compressed variants) are stored under keys which change
+ * whenever the original file does, so they are never stale; they simply age
+ * out of the cache.
+ *
+ * @param key [in] The key the file is stored under.
+ * @return A reference to the file, or NULL on a miss.
+ */
+struct TeapotFile *teapot_cache_lookup(const char *key);
+
+/**
+ * Store a derived file in the cache, see `teapot_cache_lookup`.
+ *
+ * @param key  [in] The key to store the file under. It must not start with
+ *                  '/', so it never collides with a path.
+ * @param file [in] The file to store, with its content loaded. The cache takes
+ *                  its own reference.
+ */
+void teapot_cache_store(const char *key, struct TeapotFile *file);
+
+/**
+ * Drop a file from the cache.
+ *
+ * @param abspath [in] Absolute path of the file, as given by
+ *                     `teapot_file_path`.
+ */
+void teapot_cache_invalidate(const char *abspath);
+
+#endif
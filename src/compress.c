@@ -0,0 +1,341 @@
+#include <gio/gio.h>
+#include "file.h"
+#include "cache.h"
+#include "compress.h"
+
+/**
+ * Compression level. Each version of a file is compressed only once, but
+ * while it is, clients are sent the file as is; beyond this level, the ratio
+ * hardly improves for much more time.
+ */
+#define COMPRESSION_LEVEL 6
+
+/**
+ * Threads compressing files, out of the way of the reactors.
+ */
+#define COMPRESSION_THREADS 1
+
+/********** Internal types **********/
+
+/**
+ * A file to compress, and the key to cache the result under.
+ */
+struct TeapotCompressJob {
+  gchar             *key;
+  struct TeapotFile *file;
+  enum TeapotEncoding encoding;
+};
+
+/********** Internal States **********/
+
+static gsize   min_file_size = 0;
+static gchar **mime_types    = NULL; ///< NULL when compression is disabled
+
+static GThreadPool *compressors = NULL;
+static GMutex       pending_lock;
+static GHashTable  *pending     = NULL; ///< Keys of the variants being compressed
+
+/********** Private APIs **********/
+
+/**
+ * Compress the content of a file in memory.
+ *
+ * @return The compressed variant, or NULL on failure.
+ */
+static struct TeapotFile *teapot_compress_data(const struct TeapotFile *file, enum TeapotEncoding encoding)
+{
+  GError *error = NULL;
+
+  GZlibCompressorFormat format = encoding == TEAPOT_ENCODING_GZIP ? G_ZLIB_COMPRESSOR_FORMAT_GZIP : G_ZLIB_COMPRESSOR_FORMAT_ZLIB;
+  GZlibCompressor *compressor = g_zlib_compressor_new(format, COMPRESSION_LEVEL);
+
+  // Text usually shrinks to well under a half
+  gsize    capacity   = file->size / 2 + 64;
+  gsize    in_offset  = 0;
+  gsize    out_length = 0;
+  uint8_t *out        = g_malloc(capacity);
+
+  for (;;) {
+    gsize bytes_read    = 0;
+    gsize bytes_written = 0;
+
+    GConverterResult r = g_converter_convert(
+      G_CONVERTER(compressor),
+      file->content + in_offset,
+      file->size - in_offset,
+      out + out_length,
+      capacity - out_length,
+      G_CONVERTER_INPUT_AT_END,
+      &bytes_read,
+      &bytes_written,
+      &error
+    );
+
+    if (r == G_CONVERTER_ERROR) {
+      if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_NO_SPACE)) {
+        // Not enough room for the compressor to make progress
+        g_clear_error(&error);
+        capacity *= 2;
+        out = g_realloc(out, capacity);
+        continue;
+      }
+
+      g_warning("Compress: failed to compress %s: %s", file->filename, error->message);
+      g_clear_error(&error);
+      g_free(out);
+      g_clear_object(&compressor);
+      return NULL;
+    }
+
+    in_offset  += bytes_read;
+    out_length += bytes_written;
+
+    if (r == G_CONVERTER_FINISHED)
+      break;
+
+    if (out_length == capacity) {
+      capacity *= 2;
+      out = g_realloc(out, capacity);
+    }
+  }
+
+  g_clear_object(&compressor);
+
+  g_debug("Compress: %s: %zu -> %zu bytes", file->filename, file->size, out_length);
+
+  return teapot_file_new_derived(out, out_length, file);
+}
+
+/**
+ * Compress a file and cache the result, in a compressing thread (GFunc).
+ */
+static void teapot_compress_run(struct TeapotCompressJob *job, gpointer user_data)
+{
+  struct TeapotFile *variant = teapot_compress_data(job->file, job->encoding);
+  if (variant) {
+    teapot_cache_store(job->key, variant);
+    teapot_file_unref(variant);
+  }
+
+  g_mutex_lock(&pending_lock);
+  g_hash_table_remove(pending, job->key);
+  g_mutex_unlock(&pending_lock);
+
+  teapot_file_unref(job->file);
+  g_free(job->key);
+  g_free(job);
+}
+
+/**
+ * Have a file compressed in the background, unless it is already being.
+ *
+ * @param key [in] Key to cache the variant under. Taken over.
+ */
+static void teapot_compress_queue(gchar *key, const struct TeapotFile *file, enum TeapotEncoding encoding)
+{
+  g_mutex_lock(&pending_lock);
+
+  if (g_hash_table_contains(pending, key)) {
+    g_mutex_unlock(&pending_lock);
+    g_free(key);
+    return;
+  }
+
+  g_hash_table_add(pending, g_strdup(key));
+  g_mutex_unlock(&pending_lock);
+
+  struct TeapotCompressJob *job = g_new0(struct TeapotCompressJob, 1);
+  job->key      = key;
+  job->file     = teapot_file_ref((struct TeapotFile *)file);
+  job->encoding = encoding;
+
+  g_thread_pool_push(compressors, job, NULL);
+}
+
+/**
+ * Compare a coding name in a header to a known one.
+ */
+static bool teapot_compress_coding_is(const char *name, gsize length, const char *coding)
+{
+  return strlen(coding) == length && g_ascii_strncasecmp(name, coding, length) == 0;
+}
+
+/**
+ * Parse a quality value ("0", "0.5", "1.000", ...) into thousandths.
+ *
+ * @param p [in,out] Start of the value; set to where it ends.
+ */
+static gint teapot_compress_parse_q(const char **p, const char *end)
+{
+  gint q = 0;
+
+  if (*p < end && (**p == '0' || **p == '1'))
+    q = (*(*p)++ - '0') * 1000;
+
+  if (*p < end && **p == '.') {
+    (*p)++;
+    for (gint scale = 100; *p < end && g_ascii_isdigit(**p); (*p)++) {
+      q += (**p - '0') * scale;
+      scale /= 10;
+    }
+  }
+
+  return MIN(q, 1000);
+}
+
+/********** Public APIs **********/
+
+void teapot_compress_init(gsize min_size, gchar **types)
+{
+  min_file_size = min_size;
+
+  g_strfreev(mime_types);
+  mime_types = types && types[0] ? g_strdupv(types) : NULL;
+
+  if (mime_types && !compressors) {
+    pending     = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    compressors = g_thread_pool_new((GFunc)teapot_compress_run, NULL, COMPRESSION_THREADS, FALSE, NULL);
+  }
+
+  if (mime_types)
+    g_message("Compress: compressing %u types from %zu bytes", g_strv_length(mime_types), min_file_size);
+  else
+    g_message("Compress: disabled");
+}
+
+enum TeapotEncoding teapot_compress_negotiate(const char *accept_encoding, size_t length)
+{
+  if (length == 0 || !mime_types)
+    return TEAPOT_ENCODING_IDENTITY;
+
+  // Quality values, in thousandths; -1 if the coding is not mentioned
+  gint gzip_q    = -1;
+  gint deflate_q = -1;
+  gint any_q     = -1;
+
+  const char *p   = accept_encoding;
+  const char *end = accept_encoding + length;
+  while (p < end) {
+    // Each element is: coding *( ";" parameter ), separated by ","
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+      p++;
+
+    const char *name = p;
+    while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+      p++;
+    gsize name_length = (gsize)(p - name);
+
+    gint q = 1000;
+    while (p < end && *p != ',') {
+      if ((*p == 'q' || *p == 'Q') && p + 1 < end && p[1] == '=') {
+        p += 2;
+        q = teapot_compress_parse_q(&p, end);
+      } else {
+        p++;
+      }
+    }
+
+    if (name_length == 0)
+      continue;
+
+    if (teapot_compress_coding_is(name, name_length, "gzip") || teapot_compress_coding_is(name, name_length, "x-gzip"))
+      gzip_q = q;
+    else if (teapot_compress_coding_is(name, name_length, "deflate"))
+      deflate_q = q;
+    else if (teapot_compress_coding_is(name, name_length, "*"))
+      any_q = q;
+  }
+
+  // "*" stands for every coding not mentioned
+  if (gzip_q < 0)
+    gzip_q = any_q;
+  if (deflate_q < 0)
+    deflate_q = any_q;
+
+  // Prefer gzip on a tie, as some clients get "deflate" wrong
+  if (gzip_q > 0 && gzip_q >= deflate_q)
+    return TEAPOT_ENCODING_GZIP;
+  if (deflate_q > 0)
+    return TEAPOT_ENCODING_DEFLATE;
+
+  return TEAPOT_ENCODING_IDENTITY;
+}
+
+bool teapot_compress_eligible(const struct TeapotFile *file)
+{
+  if (!mime_types || !file->content_type || file->size < min_file_size)
+    return false;
+
+  // Parameters (e.g. "; charset=utf-8") do not matter
+  gsize type_length = strcspn(file->content_type, ";");
+
+  for (gchar **type = mime_types; *type; type++) {
+    if (strlen(*type) == type_length && g_ascii_strncasecmp(*type, file->content_type, type_length) == 0)
+      return true;
+  }
+
+  return false;
+}
+
+struct TeapotFile *teapot_compress_get(const char *path, const struct TeapotFile *file, enum TeapotEncoding encoding)
+{
+  const char *coding = teapot_compress_encoding_to_string(encoding);
+  if (!coding)
+    return NULL;
+
+  // The identity of the file changes whenever the file does, so the variant
+  // cached under it is never stale
+  gchar *key = g_strdup_printf(
+    "%s:%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%" G_GINT64_FORMAT ":%zu",
+    coding, file->device, file->inode, file->mtime, file->size
+  );
+
+  struct TeapotFile *variant = teapot_cache_lookup(key);
+
+  if (!variant && encoding == TEAPOT_ENCODING_GZIP) {
+    // Precompressed by the administrator? Remembered until the original file
+    // changes if small enough to be cached, looked up again otherwise
+    gchar *sibling_path = g_strconcat(path, ".gz", NULL);
+    variant = teapot_cache_get(sibling_path);
+    g_free(sibling_path);
+
+    if (variant && variant->content)
+      teapot_cache_store(key, variant);
+  }
+
+  if (!variant && file->content) {
+    // Compressing would hold up every connection of the reactor, so it is
+    // done in the background, once; the file is sent as is meanwhile. Large
+    // files are never in memory, and always sent as is
+    teapot_compress_queue(key, file, encoding);
+    return NULL;
+  }
+
+  g_free(key);
+
+  // Incompressible content is remembered too, but sent as is
+  if (variant && variant->size >= file->size) {
+    teapot_file_unref(variant);
+    return NULL;
+  }
+
+  return variant;
+}
+
+const char *teapot_compress_encoding_to_string(enum TeapotEncoding encoding)
+{
+  const char *ret = NULL;
+
+  switch (encoding) {
+    case TEAPOT_ENCODING_GZIP:
+      ret = "gzip";
+      break;
+    case TEAPOT_ENCODING_DEFLATE:
+      ret = "deflate";
+      break;
+    case TEAPOT_ENCODING_IDENTITY:
+      break; // Remain ret to be NULL
+  }
+
+  return ret;
+}
@@ -0,0 +1,68 @@
+#ifndef TEAPOT_COMPRESS_H
+#define TEAPOT_COMPRESS_H
+
+#include <glib.h>
+#include "file.h"
+
+/**
+ * Content codings Teapot can send.
+ */
+enum TeapotEncoding {
+  TEAPOT_ENCODING_IDENTITY, ///< No compression
+  TEAPOT_ENCODING_GZIP,     ///< "gzip"
+  TEAPOT_ENCODING_DEFLATE,  ///< "deflate" (zlib format)
+};
+
+/**
+ * Initialize content compression.
+ *
+ * @param min_size [in] Files smaller than this are sent as is.
+ * @param types    [in] NULL-terminated list of MIME types worth compressing.
+ *                      The list is copied. NULL disables compression.
+ */
+void teapot_compress_init(gsize min_size, gchar **types);
+
+/**
+ * Choose a content coding from the Accept-Encoding header of a request.
+ *
+ * @param accept_encoding [in] Value of the Accept-Encoding header (not
+ *                             necessarily NUL-terminated).
+ * @param length          [in] Length of the value, 0 if there is no header.
+ * @return The preferred coding the client accepts.
+ */
+enum TeapotEncoding teapot_compress_negotiate(const char *accept_encoding, size_t length);
+
+/**
+ * Tell whether a file is worth compressing (by its type and size).
+ *
+ * @param file [in] The file to send.
+ * @return true if the file should be compressed for clients accepting it.
+ */
+bool teapot_compress_eligible(const struct TeapotFile *file);
+
+/**
+ * Get the compressed variant of a file.
+ *
+ * For gzip, a precompressed sibling (the path with ".gz" appended) is used if
+ * present. Otherwise the file is compressed in the background after the
+ * first request, and sent as is until then; either way the result is cached
+ * under the identity of the file, so it is produced once per version of the
+ * file.
+ *
+ * @param path     [in] The requested path of the file.
+ * @param file     [in] The file, as returned by `teapot_cache_get`.
+ * @param encoding [in] The coding to use, other than identity.
+ * @return A reference to the compressed variant, or NULL if there is none (in
+ *         which case the file should be sent as is).
+ */
+struct TeapotFile *teapot_compress_get(const char *path, const struct TeapotFile *file, enum TeapotEncoding encoding);
+
+/**
+ * Convert a content coding to its name in HTTP headers.
+ *
+ * @param encoding [in] The coding.
+ * @return A string constant, NULL for identity.
+ */
+const char *teapot_compress_encoding_to_string(enum TeapotEncoding encoding);
+
+#endif
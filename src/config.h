@@ -34,8 +34,157 @@
 #define TEAPOT_DEFAULT_CONFIG_FILE_PATH "teapot.conf"
 
 /**
- * Define default maximum thread allowed in a thread pool. -1 for unlimited.
+ * Define default number of reactor threads driving connections. 0 for one per
+ * processor.
  */
-#define TEAPOT_DEFAULT_THREAD_POOL_MAX_THREADS -1
+#define TEAPOT_DEFAULT_REACTOR_THREADS 0
+
+/**
+ * Define default number of sockets (and accepting threads) sharing the address
+ * of a listener with SO_REUSEPORT. 0 for one per processor.
+ */
+#define TEAPOT_DEFAULT_ACCEPTORS 1
+
+/**
+ * Define whether reactor and accepting threads are pinned to processors by
+ * default.
+ */
+#define TEAPOT_DEFAULT_CPU_AFFINITY FALSE
+
+/**
+ * Define default length of the queue of connections waiting to be accepted
+ * (capped by the kernel to net.core.somaxconn).
+ */
+#define TEAPOT_DEFAULT_LISTEN_BACKLOG 1024
+
+/**
+ * Define default time a connection may stay silent before being accepted
+ * anyway (TCP_DEFER_ACCEPT), in seconds. 0 to accept connections at once.
+ */
+#define TEAPOT_DEFAULT_DEFER_ACCEPT 0
+
+/**
+ * Define default number of pending TCP Fast Open requests. 0 to disable it.
+ */
+#define TEAPOT_DEFAULT_FAST_OPEN 0
+
+/**
+ * Define whether Nagle's algorithm is disabled on connections by default.
+ */
+#define TEAPOT_DEFAULT_TCP_NODELAY TRUE
+
+/**
+ * Define default send and receive buffer sizes of connections, in bytes. 0
+ * for those of the system.
+ */
+#define TEAPOT_DEFAULT_SEND_BUFFER    0
+#define TEAPOT_DEFAULT_RECEIVE_BUFFER 0
+
+/**
+ * Define default number of connections accepted in a row before they are
+ * handed over.
+ */
+#define TEAPOT_DEFAULT_ACCEPT_BATCH 64
+
+/**
+ * Define default maximum number of requests served on a persistent connection.
+ * 0 for unlimited.
+ */
+#define TEAPOT_DEFAULT_KEEPALIVE_REQUESTS 100
+
+/**
+ * Define default idle timeout of a connection, in seconds. 0 to never time out.
+ */
+#define TEAPOT_DEFAULT_KEEPALIVE_TIMEOUT 5
+
+/**
+ * Define default maximum length of the request line and header, in bytes.
+ */
+#define TEAPOT_DEFAULT_MAX_HEADER_SIZE (8 * 1024)
+
+/**
+ * Define default maximum length of the content of a request, in bytes.
+ */
+#define TEAPOT_DEFAULT_MAX_BODY_SIZE (8 * 1024 * 1024)
+
+/**
+ * Define default capacity of the static content cache, in bytes. 0 to disable.
+ */
+#define TEAPOT_DEFAULT_CACHE_SIZE (64 * 1024 * 1024)
+
+/**
+ * Define default size of the largest file put into the cache, in bytes.
+ */
+#define TEAPOT_DEFAULT_CACHE_MAX_FILE_SIZE (1024 * 1024)
+
+/**
+ * Define default size of the smallest file sent compressed, in bytes.
+ */
+#define TEAPOT_DEFAULT_GZIP_MIN_SIZE 256
+
+/**
+ * Define default MIME types sent compressed, separated by ';'.
+ */
+#define TEAPOT_DEFAULT_GZIP_TYPES "text/html;text/css;text/plain;text/javascript;application/javascript;application/json;application/xml;image/svg+xml"
+
+/**
+ * Define whether files of unknown extensions are sniffed for their MIME type
+ * by default.
+ */
+#define TEAPOT_DEFAULT_MIME_SNIFF FALSE
+
+/**
+ * Define default port of the metrics endpoint. 0 to disable it.
+ */
+#define TEAPOT_DEFAULT_METRICS_PORT 0
+
+/**
+ * Define default address of the metrics endpoint, which should not be
+ * reachable from the outside.
+ */
+#define TEAPOT_DEFAULT_METRICS_ADDRESS "127.0.0.1"
+
+/**
+ * Define default path of the metrics endpoint.
+ */
+#define TEAPOT_DEFAULT_METRICS_PATH "/metrics"
+
+/**
+ * Define timeout of a request to the metrics endpoint, in seconds.
+ */
+#define TEAPOT_DEFAULT_METRICS_TIMEOUT 5
+
+/**
+ * Define default maximum threads doing (blocking) TLS handshakes.
+ */
+#define TEAPOT_DEFAULT_HANDSHAKE_THREADS 4
+
+/**
+ * Define default maximum number of connections waiting for a TLS handshake
+ * thread. 0 for no limit.
+ */
+#define TEAPOT_DEFAULT_HANDSHAKE_QUEUE 1024
+
+/**
+ * Define default longest time a connection may wait for a TLS handshake
+ * thread, in milliseconds. 0 for no limit.
+ */
+#define TEAPOT_DEFAULT_HANDSHAKE_QUEUE_WAIT 5000
+
+/**
+ * Define default maximum number of connections open at once on a listener.
+ * 0 for no limit.
+ */
+#define TEAPOT_DEFAULT_MAX_CONNECTIONS 0
+
+/**
+ * Define default Retry-After of responses to connections shed, in seconds.
+ */
+#define TEAPOT_DEFAULT_RETRY_AFTER 1
+
+/**
+ * Define default timeout of a TLS handshake, in seconds.
+ */
+#define TEAPOT_DEFAULT_HANDSHAKE_TIMEOUT 10
 
 #endif
@@ -0,0 +1,835 @@
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <gio/gio.h>
+#include "http.h"
+#include "log.h"
+#include "metrics.h"
+#include "connection.h"
+#include "config.h"
+
+/**
+ * Initial size of the request buffer. Most requests fit; the buffer grows for
+ * those which do not, as far as the limits set by `teapot_http_init` allow.
+ */
+#define BUFSIZE 4096
+
+/**
+ * Size of the chunks a file is read in when it cannot be sent with sendfile()
+ * (i.e. over TLS). This is the maximum size of a TLS record.
+ */
+#define FILE_CHUNK_SIZE 16384
+
+/**
+ * Bytes of a file read in one go for sending over TLS: a few records, which
+ * the TLS stream takes one at a time without them being read again.
+ */
+#define FILE_BUFFER_SIZE (4 * FILE_CHUNK_SIZE)
+
+/**
+ * Maximum number of pieces sent in one go. Far below IOV_MAX, but enough for
+ * a few pipelined responses.
+ */
+#define MAX_IOV 128
+
+/**
+ * Bytes of a ClientHello looked at, enough for any common one (those with
+ * post-quantum key shares are around 1.8 KiB).
+ */
+#define HELLO_PEEK_SIZE 4096
+
+/**
+ * Times to look again for the rest of a ClientHello split over segments,
+ * a millisecond apart.
+ */
+#define HELLO_PEEK_ATTEMPTS 10
+
+/**
+ * Most TLS send buffers a thread keeps for reuse; more are freed.
+ */
+#define CACHED_FILE_BUFFERS 16
+
+/********** Internal types **********/
+
+/**
+ * TLS send buffers a thread keeps for reuse, so that connections only hold
+ * one while they have responses to send.
+ */
+struct TeapotFileBufferCache {
+  gchar *buffers[CACHED_FILE_BUFFERS];
+  guint  n_buffers;
+};
+
+static void teapot_connection_buffers_free(gpointer data);
+
+/********** Internal States **********/
+
+static guint max_requests = TEAPOT_DEFAULT_KEEPALIVE_REQUESTS;
+
+// The buffers of each thread are freed when the thread exits
+static GPrivate file_buffers = G_PRIVATE_INIT(teapot_connection_buffers_free);
+
+/********** Private APIs **********/
+
+static void teapot_connection_buffers_free(gpointer data)
+{
+  struct TeapotFileBufferCache *cache = data;
+
+  for (guint i = 0; i < cache->n_buffers; i++)
+    g_free(cache->buffers[i]);
+
+  g_free(cache);
+}
+
+static struct TeapotFileBufferCache *teapot_connection_buffers(void)
+{
+  struct TeapotFileBufferCache *cache = g_private_get(&file_buffers);
+
+  if (!cache) {
+    cache = g_new0(struct TeapotFileBufferCache, 1);
+    g_private_set(&file_buffers, cache);
+  }
+
+  return cache;
+}
+
+/**
+ * Give a connection a TLS send buffer, unless it has one.
+ */
+static void teapot_connection_buffer_take(struct TeapotConnection *conn)
+{
+  if (conn->buf_file)
+    return;
+
+  struct TeapotFileBufferCache *cache = teapot_connection_buffers();
+
+  conn->buf_file        = cache->n_buffers > 0 ? cache->buffers[--cache->n_buffers] : g_malloc(FILE_BUFFER_SIZE);
+  conn->buf_file_length = 0;
+}
+
+/**
+ * Take back the TLS send buffer of a connection, which has nothing left in it
+ * to send.
+ */
+static void teapot_connection_buffer_give(struct TeapotConnection *conn)
+{
+  if (!conn->buf_file)
+    return;
+
+  struct TeapotFileBufferCache *cache = teapot_connection_buffers();
+
+  if (cache->n_buffers < CACHED_FILE_BUFFERS)
+    cache->buffers[cache->n_buffers++] = conn->buf_file;
+  else
+    g_free(conn->buf_file);
+
+  conn->buf_file        = NULL;
+  conn->buf_file_length = 0;
+}
+
+/**
+ * Receive bytes from the client without blocking.
+ *
+ * @return Number of bytes received, 0 on EOF, -1 on error, or -2 if the socket
+ *         would block.
+ */
+static gssize teapot_connection_recv(struct TeapotConnection *conn, gchar *buf, gsize size)
+{
+  if (conn->tls_conn) {
+    GError *error = NULL;
+    GPollableInputStream *in = G_POLLABLE_INPUT_STREAM(g_io_stream_get_input_stream(conn->tls_conn));
+
+    gssize r = g_pollable_input_stream_read_nonblocking(in, buf, size, NULL, &error);
+    if (r < 0) {
+      if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+        g_clear_error(&error);
+        return -2;
+      }
+
+      g_warning("%s: failed to read from %s: %s", conn->protocol, conn->peer, error->message);
+      g_clear_error(&error);
+    }
+
+    return r;
+  }
+
+  for (;;) {
+    ssize_t r = recv(conn->fd, buf, size, 0);
+    if (r >= 0)
+      return r;
+
+    if (errno == EINTR)
+      continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return -2;
+
+    g_warning("%s: failed to read from %s: %s", conn->protocol, conn->peer, g_strerror(errno));
+    return -1;
+  }
+}
+
+/**
+ * Write bytes to a TLS connection without blocking.
+ *
+ * @return Number of bytes written, -1 on error, or -2 if the socket would
+ *         block.
+ */
+static gssize teapot_connection_tls_write(struct TeapotConnection *conn, const void *buf, gsize size)
+{
+  GError *error = NULL;
+  GPollableOutputStream *out = G_POLLABLE_OUTPUT_STREAM(g_io_stream_get_output_stream(conn->tls_conn));
+
+  gssize r = g_pollable_output_stream_write_nonblocking(out, buf, size, NULL, &error);
+  if (r < 0) {
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+      g_clear_error(&error);
+      return -2;
+    }
+
+    g_message("%s: failed to write to %s: %s", conn->protocol, conn->peer, error->message);
+    g_clear_error(&error);
+  }
+
+  return r;
+}
+
+/**
+ * Send pieces of data to the client in one go without blocking.
+ *
+ * @param more [in] Whether more data follows immediately, so that the kernel
+ *                  can put them into the same segment.
+ * @return Number of bytes sent, -1 on error, or -2 if the socket would block.
+ */
+static gssize teapot_connection_sendv(struct TeapotConnection *conn, const struct iovec *iov, int n_iov, gboolean more)
+{
+  if (conn->tls_conn) {
+    // Every write becomes a TLS record of its own, so small pieces are put
+    // together first rather than sent as a flurry of tiny records
+    if (iov[0].iov_len >= FILE_CHUNK_SIZE || n_iov == 1)
+      return teapot_connection_tls_write(conn, iov[0].iov_base, iov[0].iov_len);
+
+    teapot_connection_buffer_take(conn);
+
+    // The file content read ahead is overwritten
+    conn->buf_file_length = 0;
+
+    gsize size = 0;
+    for (int i = 0; i < n_iov && size < FILE_CHUNK_SIZE; i++) {
+      gsize length = MIN(iov[i].iov_len, FILE_CHUNK_SIZE - size);
+
+      memcpy(conn->buf_file + size, iov[i].iov_base, length);
+      size += length;
+    }
+
+    return teapot_connection_tls_write(conn, conn->buf_file, size);
+  }
+
+  struct msghdr msg = {
+    .msg_iov    = (struct iovec *)(uintptr_t)iov,
+    .msg_iovlen = (size_t)n_iov,
+  };
+
+  for (;;) {
+    ssize_t r = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+    if (r >= 0)
+      return r;
+
+    if (errno == EINTR)
+      continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return -2;
+
+    g_message("%s: failed to write to %s: %s", conn->protocol, conn->peer, g_strerror(errno));
+    return -1;
+  }
+}
+
+/**
+ * Send part of a file to the client without blocking.
+ *
+ * Over plain HTTP the file goes from the page cache to the socket with
+ * sendfile(), without being copied into userspace. TLS has to encrypt it, so
+ * it is read a few records ahead instead; what the TLS stream has not taken
+ * yet (it takes a record per write, and none when the socket is full) is
+ * sent from the buffer next time rather than read again.
+ *
+ * @return Number of bytes sent, -1 on error, or -2 if the socket would block.
+ */
+static gssize teapot_connection_send_file(struct TeapotConnection *conn, int fd, off_t offset, gsize size)
+{
+  if (conn->tls_conn) {
+    if (offset < conn->buf_file_offset || offset >= conn->buf_file_offset + (off_t)conn->buf_file_length) {
+      teapot_connection_buffer_take(conn);
+
+      ssize_t bytes = pread(fd, conn->buf_file, MIN(size, FILE_BUFFER_SIZE), offset);
+      if (bytes <= 0) {
+        g_warning("%s: failed to read file for %s: %s", conn->protocol, conn->peer, bytes < 0 ? g_strerror(errno) : "file truncated");
+        return -1;
+      }
+
+      conn->buf_file_offset = offset;
+      conn->buf_file_length = (gsize)bytes;
+    }
+
+    gsize skip = (gsize)(offset - conn->buf_file_offset);
+
+    return teapot_connection_tls_write(conn, conn->buf_file + skip, MIN(size, conn->buf_file_length - skip));
+  }
+
+  for (;;) {
+    ssize_t r = sendfile(conn->fd, fd, &offset, size);
+    if (r > 0)
+      return r;
+
+    if (r == 0) {
+      g_warning("%s: file for %s truncated while sending", conn->protocol, conn->peer);
+      return -1;
+    }
+
+    if (errno == EINTR)
+      continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return -2;
+
+    g_message("%s: failed to write to %s: %s", conn->protocol, conn->peer, g_strerror(errno));
+    return -1;
+  }
+}
+
+/**
+ * Gather the pending responses in memory, so that they are sent in one go.
+ *
+ * Pieces are gathered from the first response (from where the last write
+ * stopped) through the following ones, until a response with its body in a
+ * file, whose header is the last thing gathered.
+ *
+ * @param iov  [out] Where to put the pieces, MAX_IOV entries.
+ * @param more [out] Whether more data follows the pieces gathered.
+ * @return Number of pieces gathered.
+ */
+static int teapot_connection_gather(struct TeapotConnection *conn, struct iovec *iov, gboolean *more)
+{
+  gsize skip  = conn->out_offset;
+  int   n_iov = 0;
+
+  *more = FALSE;
+
+  for (GList *l = g_queue_peek_head_link(&conn->outputs); l; l = l->next) {
+    const struct TeapotHttpOutput *output = l->data;
+
+    if (n_iov + output->n_iov > MAX_IOV) {
+      *more = TRUE;
+      break;
+    }
+
+    for (int i = 0; i < output->n_iov; i++) {
+      // Skip what has been written
+      if (skip >= output->iov[i].iov_len) {
+        skip -= output->iov[i].iov_len;
+        continue;
+      }
+
+      iov[n_iov].iov_base = (char *)output->iov[i].iov_base + skip;
+      iov[n_iov].iov_len  = output->iov[i].iov_len - skip;
+      n_iov++;
+      skip = 0;
+    }
+
+    if (output->body_length > 0) {
+      *more = TRUE;
+      break;
+    }
+  }
+
+  return n_iov;
+}
+
+/**
+ * Account for bytes written, dropping the responses which are complete.
+ */
+static void teapot_connection_advance(struct TeapotConnection *conn, gsize bytes)
+{
+  struct TeapotHttpOutput *output = NULL;
+
+  while ((output = g_queue_peek_head(&conn->outputs))) {
+    gsize total = output->length + output->body_length;
+
+    if (conn->out_offset + bytes < total) {
+      conn->out_offset += bytes;
+      return;
+    }
+
+    teapot_trace("%s: written %zu bytes", conn->protocol, total);
+
+    // The record is on the last output of a response
+    conn->log_bytes += total;
+    if (output->record.status != 0) {
+      teapot_metrics_status(output->record.status);
+      teapot_metrics_count(TEAPOT_METRICS_BYTES_SENT, conn->log_bytes);
+      teapot_metrics_observe(TEAPOT_METRICS_STAGE_WRITE, output->queued);
+
+      if (teapot_log_enabled()) {
+        output->record.time     = g_get_real_time();
+        output->record.duration = g_get_monotonic_time() - output->record.started;
+        output->record.bytes    = conn->log_bytes;
+        g_strlcpy(output->record.client, conn->peer, sizeof(output->record.client));
+
+        teapot_log_push(&output->record);
+      }
+
+      conn->log_bytes = 0;
+    }
+
+    bytes -= total - conn->out_offset;
+    conn->out_offset = 0;
+    conn->buf_file_length = 0; // Read ahead from the file of this response
+    teapot_http_output_release(g_queue_pop_head_link(&conn->outputs)->data);
+  }
+
+  // Every response has been sent, and everything they needed goes at once;
+  // an idle connection holds no send buffer either
+  teapot_arena_reset(&conn->arena);
+  teapot_connection_buffer_give(conn);
+}
+
+static enum TeapotConnectionState teapot_connection_process(struct TeapotConnection *conn);
+
+/**
+ * Write as much of the pending responses as the socket accepts.
+ */
+static enum TeapotConnectionState teapot_connection_on_writable(struct TeapotConnection *conn)
+{
+  struct TeapotHttpOutput *output = NULL;
+
+  // Pipelined requests: responses go out in the order of the requests
+  while ((output = g_queue_peek_head(&conn->outputs))) {
+    gssize r = 0;
+
+    if (conn->out_offset < output->length) {
+      // Headers (and bodies in memory) of as many responses as possible
+      struct iovec iov[MAX_IOV];
+      gboolean     more  = FALSE;
+      int          n_iov = teapot_connection_gather(conn, iov, &more);
+
+      r = teapot_connection_sendv(conn, iov, n_iov, more);
+    } else {
+      gsize body_offset = conn->out_offset - output->length;
+
+      r = teapot_connection_send_file(conn, output->body_fd, output->body_offset + (off_t)body_offset, output->body_length - body_offset);
+    }
+
+    if (r == -2)
+      return TEAPOT_CONNECTION_WRITING;
+    if (r < 0) {
+      teapot_trace("%s: %zu bytes remaining", conn->protocol, output->length + output->body_length - conn->out_offset);
+      return TEAPOT_CONNECTION_CLOSED;
+    }
+
+    teapot_connection_advance(conn, (gsize)r);
+  }
+
+  if (conn->closing)
+    return TEAPOT_CONNECTION_CLOSED;
+
+  // Requests may have been pipelined behind the ones just answered
+  return teapot_connection_process(conn);
+}
+
+/**
+ * Answer every complete request in the request buffer.
+ */
+static enum TeapotConnectionState teapot_connection_process(struct TeapotConnection *conn)
+{
+  gsize consumed = 0;
+
+  while (!conn->closing) {
+    gsize length = 0;
+
+    // Handle it
+    bool   keep_alive = max_requests == 0 || conn->n_requests + 1 < max_requests;
+    gint64 started    = teapot_log_enabled() ? g_get_monotonic_time() : 0;
+    struct TeapotHttpOutput *output = teapot_http_process(&conn->arena, &keep_alive, &length, conn->buf_in + consumed, conn->in_length - consumed);
+    if (!output)
+      break; // The rest has not fully arrived
+
+    conn->n_requests++;
+    consumed += length;
+
+    // Outputs of a response are sent (and freed) one after another
+    while (output) {
+      struct TeapotHttpOutput *next = output->next;
+
+      if (output->record.status != 0 && started != 0) {
+        output->record.handling = g_get_monotonic_time() - started;
+        output->record.started  = conn->request_started;
+      }
+      if (output->record.status != 0)
+        output->queued = teapot_metrics_now();
+
+      output->next      = NULL;
+      output->link.data = output;
+      g_queue_push_tail_link(&conn->outputs, &output->link);
+      output = next;
+    }
+
+    if (!keep_alive)
+      conn->closing = TRUE;
+  }
+
+  // Keep what follows (a partially received request) for the next read
+  if (consumed > 0) {
+    memmove(conn->buf_in, conn->buf_in + consumed, conn->in_length - consumed);
+    conn->in_length -= consumed;
+
+    // Which has started arriving by now
+    if (conn->in_length > 0 && teapot_log_enabled())
+      conn->request_started = g_get_monotonic_time();
+
+    // Give back what a large request needed
+    if (conn->in_capacity > BUFSIZE && conn->in_length <= BUFSIZE) {
+      conn->buf_in      = g_realloc(conn->buf_in, BUFSIZE);
+      conn->in_capacity = BUFSIZE;
+    }
+  }
+
+  // Most responses fit into the socket buffer, so try writing right away
+  // instead of waiting for another round trip through the reactor
+  if (!g_queue_is_empty(&conn->outputs))
+    return teapot_connection_on_writable(conn);
+
+  return conn->closing ? TEAPOT_CONNECTION_CLOSED : TEAPOT_CONNECTION_READING;
+}
+
+/**
+ * Read what has arrived and answer the requests which are complete.
+ */
+static enum TeapotConnectionState teapot_connection_on_readable(struct TeapotConnection *conn)
+{
+  for (;;) {
+    gsize    bytes  = 0;
+    gboolean eof    = FALSE;
+    gboolean filled = FALSE;
+
+    // The request in the buffer is still incomplete, but within the limits
+    // (or it would have been rejected), so make room for the rest
+    if (conn->in_length == conn->in_capacity) {
+      conn->in_capacity *= 2;
+      conn->buf_in       = g_realloc(conn->buf_in, conn->in_capacity);
+    }
+
+    // A new request starts arriving
+    if (conn->in_length == 0 && teapot_log_enabled())
+      conn->request_started = g_get_monotonic_time();
+
+    // Drain the socket (and, for HTTPS, the records buffered by TLS) so that
+    // pipelined requests are all seen
+    while (!filled) {
+      gssize r = teapot_connection_recv(conn, conn->buf_in + conn->in_length, conn->in_capacity - conn->in_length);
+      if (r == -2)
+        break;
+      if (r < 0)
+        return TEAPOT_CONNECTION_CLOSED;
+      if (r == 0) {
+        eof = TRUE;
+        break;
+      }
+
+      conn->in_length += (gsize)r;
+      bytes           += (gsize)r;
+      filled           = conn->in_length == conn->in_capacity;
+    }
+
+    if (bytes > 0)
+      teapot_trace("%s: read %zu bytes", conn->protocol, bytes);
+
+    if (bytes > 0 && conn->accepted != 0) {
+      teapot_metrics_observe(TEAPOT_METRICS_STAGE_ACCEPT, conn->accepted);
+      conn->accepted = 0;
+    }
+
+    enum TeapotConnectionState state = teapot_connection_process(conn);
+
+    // The client has finished sending; close once what it sent is answered
+    if (eof) {
+      conn->closing = TRUE;
+      if (state == TEAPOT_CONNECTION_READING)
+        state = TEAPOT_CONNECTION_CLOSED;
+    }
+
+    // With the buffer full, more may have arrived; for HTTPS, the rest of a
+    // record already decrypted stays within TLS, where epoll never sees it,
+    // so it is read now rather than after the idle timeout
+    if (!filled || state != TEAPOT_CONNECTION_READING)
+      return state;
+  }
+}
+
+/**
+ * Tell whether TLS holds data already decrypted, which epoll cannot see.
+ */
+static gboolean teapot_connection_tls_pending(struct TeapotConnection *conn)
+{
+  if (!conn->tls_conn)
+    return FALSE;
+
+  return g_pollable_input_stream_is_readable(G_POLLABLE_INPUT_STREAM(g_io_stream_get_input_stream(conn->tls_conn)));
+}
+
+/**
+ * Tell whether a ClientHello offers to resume a TLS session: with a
+ * pre_shared_key (TLS 1.3) or a non-empty session_ticket extension, or with a
+ * session ID from a client not offering TLS 1.3 (those which do send random
+ * IDs, for compatibility with middleboxes).
+ *
+ * Whether the server accepts is up to the TLS backend, and not told by GIO.
+ */
+static bool teapot_connection_hello_resumes(const guint8 *hello, gsize length)
+{
+  // Record header, then handshake header of a ClientHello
+  if (length < 9 || hello[0] != 0x16 || hello[5] != 0x01)
+    return false;
+
+  gsize end = MIN(length, 5 + (gsize)((hello[3] << 8) | hello[4]));
+  gsize i   = 9 + 2 + 32; // Past the version and random
+
+  if (i >= end)
+    return false;
+  gsize session_id_length = hello[i];
+  i += 1 + session_id_length;
+
+  if (i + 2 > end)
+    return false;
+  i += 2 + (gsize)((hello[i] << 8) | hello[i + 1]); // Cipher suites
+
+  if (i + 1 > end)
+    return false;
+  i += 1 + hello[i]; // Compression methods
+
+  i += 2; // Length of the extensions, which run to the end
+
+  bool tls13  = false;
+  bool ticket = false;
+  bool psk    = false;
+
+  while (i + 4 <= end) {
+    guint type             = (guint)((hello[i] << 8) | hello[i + 1]);
+    gsize extension_length = (gsize)((hello[i + 2] << 8) | hello[i + 3]);
+
+    if (type == 41)
+      psk = true;
+    else if (type == 35 && extension_length > 0)
+      ticket = true;
+    else if (type == 43)
+      tls13 = true;
+
+    i += 4 + extension_length;
+  }
+
+  return psk || ticket || (!tls13 && session_id_length > 0);
+}
+
+/**
+ * Peek at the ClientHello of a connection, leaving it for the handshake, and
+ * tell whether it offers to resume a session.
+ *
+ * @param deadline [in] Monotonic time after which to give up waiting.
+ */
+static bool teapot_connection_resumption_offered(struct TeapotConnection *conn, gint64 deadline)
+{
+  GSocket *socket = g_socket_connection_get_socket(conn->socket_conn);
+  guint8   hello[HELLO_PEEK_SIZE];
+
+  for (guint attempt = 0; attempt < HELLO_PEEK_ATTEMPTS; attempt++) {
+    gint64 remaining = deadline - g_get_monotonic_time();
+    if (remaining <= 0 || !g_socket_condition_timed_wait(socket, G_IO_IN, remaining, NULL, NULL))
+      return false;
+
+    ssize_t r = recv(conn->fd, hello, sizeof(hello), MSG_PEEK);
+    if (r <= 0)
+      return false;
+
+    // Wait a little for the rest of the first record, if it is not all there
+    gsize length = (gsize)r;
+    if (length == sizeof(hello) || (length >= 5 && length >= 5 + (gsize)((hello[3] << 8) | hello[4])))
+      return teapot_connection_hello_resumes(hello, length);
+
+    g_usleep(1000);
+  }
+
+  return false;
+}
+
+/********** Public APIs **********/
+
+void teapot_connection_init(guint max)
+{
+  max_requests = max;
+}
+
+struct TeapotConnection *teapot_connection_new(GSocketConnection *socket_conn, GTlsCertificate *tls)
+{
+  GError *error = NULL;
+
+  struct TeapotConnection *conn = g_new0(struct TeapotConnection, 1);
+
+  conn->socket_conn = socket_conn;
+  conn->fd          = g_socket_get_fd(g_socket_connection_get_socket(socket_conn));
+  conn->protocol    = tls ? "HTTPS" : "HTTP";
+  conn->state       = tls ? TEAPOT_CONNECTION_HANDSHAKING : TEAPOT_CONNECTION_READING;
+
+  conn->idle_link.data = conn;
+  conn->accepted       = teapot_metrics_now();
+  g_queue_init(&conn->outputs);
+
+  teapot_metrics_count(TEAPOT_METRICS_CONNECTIONS_ACCEPTED, 1);
+
+  // Get information about the client (only used to show to people)
+  GSocketAddress *remote_addr = g_socket_connection_get_remote_address(socket_conn, &error);
+  if (remote_addr && G_IS_INET_SOCKET_ADDRESS(remote_addr)) {
+    gchar *client_addr = g_inet_address_to_string(g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(remote_addr)));
+    conn->peer = g_strdup_printf(
+      g_socket_address_get_family(remote_addr) == G_SOCKET_FAMILY_IPV6 ? "[%s]:%" G_GUINT16_FORMAT : "%s:%" G_GUINT16_FORMAT,
+      client_addr, g_inet_socket_address_get_port(G_INET_SOCKET_ADDRESS(remote_addr))
+    );
+
+    g_free(client_addr);
+    g_clear_object(&remote_addr);
+  } else if (remote_addr) {
+    // Clients of a Unix domain socket have no address of their own
+    conn->peer = g_strdup("unix:");
+    g_clear_object(&remote_addr);
+  } else {
+    g_warning("%s: failed to retrieve remote address: %s", conn->protocol, error->message);
+    g_clear_error(&error);
+
+    teapot_connection_free(conn);
+    return NULL;
+  }
+
+  teapot_trace("%s: accepting connection from %s", conn->protocol, conn->peer);
+
+  if (tls) {
+    // Wrap the connection with GTlsServerConnection
+    conn->tls_conn = g_tls_server_connection_new(G_IO_STREAM(socket_conn), tls, &error);
+    if (!conn->tls_conn) {
+      g_warning("HTTPS: failed to wrap the stream into a TLS one: %s", error->message);
+      g_clear_error(&error);
+
+      teapot_connection_free(conn);
+      return NULL;
+    }
+  }
+
+  conn->buf_in      = g_malloc(BUFSIZE);
+  conn->in_capacity = BUFSIZE;
+
+  return conn;
+}
+
+void teapot_connection_free(struct TeapotConnection *conn)
+{
+  if (!conn)
+    return;
+
+  teapot_trace("%s: closing socket", conn->protocol);
+  teapot_metrics_count(TEAPOT_METRICS_CONNECTIONS_CLOSED, 1);
+
+  if (conn->admission)
+    teapot_admission_leave(conn->admission);
+
+  if (conn->tls_conn) {
+    g_io_stream_close(conn->tls_conn, NULL, NULL);
+    g_clear_object(&conn->tls_conn);
+  }
+
+  if (conn->socket_conn) {
+    g_io_stream_close(G_IO_STREAM(conn->socket_conn), NULL, NULL);
+    g_clear_object(&conn->socket_conn);
+  }
+
+  GList *link = NULL;
+  while ((link = g_queue_pop_head_link(&conn->outputs)))
+    teapot_http_output_release(link->data);
+  teapot_arena_reset(&conn->arena);
+
+  teapot_connection_buffer_give(conn);
+  g_free(conn->buf_in);
+  g_free(conn->peer);
+  g_free(conn);
+}
+
+gboolean teapot_connection_handshake(struct TeapotConnection *conn)
+{
+  GError *error = NULL;
+  GSocket *socket = g_socket_connection_get_socket(conn->socket_conn);
+
+  // A client which never finishes its handshake must not hold a thread
+  // forever; looking at its ClientHello comes out of the same time
+  gint64 deadline = g_get_monotonic_time() + TEAPOT_DEFAULT_HANDSHAKE_TIMEOUT * G_TIME_SPAN_SECOND;
+
+  // Resumption is only looked for when someone reads the counters
+  bool resuming = teapot_metrics_now() != 0 && teapot_connection_resumption_offered(conn, deadline);
+
+  gint64 remaining = deadline - g_get_monotonic_time();
+  if (remaining <= 0) {
+    g_warning("HTTPS: handshake with %s failed: timed out", conn->peer);
+    return FALSE;
+  }
+
+  g_socket_set_timeout(socket, (guint)((remaining + G_TIME_SPAN_SECOND - 1) / G_TIME_SPAN_SECOND));
+
+  // Time spent waiting for the ClientHello (while peeking) is not the
+  // handshake's
+  gint64 started = teapot_metrics_now();
+
+  gboolean r = g_tls_connection_handshake(G_TLS_CONNECTION(conn->tls_conn), NULL, &error);
+
+  g_socket_set_timeout(socket, 0);
+
+  if (!r) {
+    g_warning("HTTPS: handshake with %s failed: %s", conn->peer, error->message);
+    g_clear_error(&error);
+    return FALSE;
+  }
+
+  teapot_metrics_observe(TEAPOT_METRICS_STAGE_HANDSHAKE, started);
+  teapot_metrics_count(TEAPOT_METRICS_HANDSHAKES, 1);
+  if (resuming)
+    teapot_metrics_count(TEAPOT_METRICS_HANDSHAKES_RESUMING, 1);
+
+  conn->state = TEAPOT_CONNECTION_READING;
+  return TRUE;
+}
+
+enum TeapotConnectionState teapot_connection_handle(struct TeapotConnection *conn, guint32 events)
+{
+  // The peer has gone away (or the socket is broken), nothing more to do
+  if ((events & (EPOLLERR | EPOLLHUP)) && !(events & EPOLLIN)) {
+    conn->state = TEAPOT_CONNECTION_CLOSED;
+    return conn->state;
+  }
+
+  switch (conn->state) {
+    case TEAPOT_CONNECTION_READING:
+      if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        conn->state = teapot_connection_on_readable(conn);
+      break;
+    case TEAPOT_CONNECTION_WRITING:
+      if (events & EPOLLOUT)
+        conn->state = teapot_connection_on_writable(conn);
+
+      // Reading stopped while responses were waiting to be sent; what TLS
+      // holds already would not wake the reactor up
+      if (conn->state == TEAPOT_CONNECTION_READING && teapot_connection_tls_pending(conn))
+        conn->state = teapot_connection_on_readable(conn);
+      break;
+    case TEAPOT_CONNECTION_HANDSHAKING: // fall through
+    case TEAPOT_CONNECTION_CLOSED:
+      break;
+  }
+
+  return conn->state;
+}
@@ -0,0 +1,106 @@
+#ifndef TEAPOT_CONNECTION_H
+#define TEAPOT_CONNECTION_H
+
+#include <gio/gio.h>
+#include <glib.h>
+#include "admission.h"
+#include "arena.h"
+
+/**
+ * State of a connection in the event-driven engine.
+ *
+ * The state also tells the reactor which readiness event the connection is
+ * waiting for.
+ */
+enum TeapotConnectionState {
+  TEAPOT_CONNECTION_HANDSHAKING, ///< TLS handshake in progress (not in a reactor)
+  TEAPOT_CONNECTION_READING,     ///< Waiting for the request to arrive
+  TEAPOT_CONNECTION_WRITING,     ///< Waiting for the response to be flushed
+  TEAPOT_CONNECTION_CLOSED,      ///< Done, the connection should be freed
+};
+
+/**
+ * A client connection driven by the reactor.
+ */
+struct TeapotConnection {
+  GSocketConnection *socket_conn; ///< The accepted socket connection
+  GIOStream         *tls_conn;    ///< TLS wrapper of socket_conn, NULL for HTTP
+  gint               fd;          ///< Underlying (non-blocking) file descriptor
+  gchar             *peer;        ///< "address:port" of the client, for logging
+  const gchar       *protocol;    ///< "HTTP" or "HTTPS", for logging
+
+  enum TeapotConnectionState state; ///< Current state of the state machine
+  guint    n_requests;  ///< Number of requests served on this connection
+  gboolean closing;     ///< Close once the pending response is written
+
+  GList  idle_link;   ///< Link in the idle queue of the reactor
+  gint64 last_active; ///< Monotonic time of the last activity
+
+  gchar *buf_in;      ///< Request buffer
+  gsize  in_length;   ///< Bytes in the request buffer
+  gsize  in_capacity; ///< Size of the request buffer
+  gint64 request_started; ///< Monotonic time the next request started arriving
+  gint64 accepted;    ///< When the connection was accepted (see `teapot_metrics_now`), 0 once read from
+
+  struct TeapotAdmission *admission; ///< Admission the connection counts against, or NULL
+  gint64 handshake_queued; ///< Monotonic time the connection was queued for its handshake
+
+  GQueue outputs;    ///< Responses (struct TeapotHttpOutput) waiting to be sent
+  struct TeapotArena arena; ///< Where the responses (and their requests) are allocated, reset once all are sent
+  gsize  out_offset; ///< Bytes of the first response already written
+  gchar *buf_file;   ///< Buffer for sending over TLS (file content read ahead, small pieces put together), NULL while there is nothing to send
+  off_t  buf_file_offset; ///< Where the file content in buf_file starts in its file
+  gsize  buf_file_length; ///< Bytes of file content in buf_file, 0 for none
+  gsize  log_bytes;  ///< Bytes of the response being sent, for the access log
+};
+
+/**
+ * Set up connection-wide parameters.
+ *
+ * @param max_requests [in] Maximum number of requests served on a persistent
+ *                          connection before it is closed. 0 for unlimited.
+ */
+void teapot_connection_init(guint max_requests);
+
+/**
+ * Wrap an accepted socket connection into a `struct TeapotConnection`.
+ *
+ * @param socket_conn [in] The accepted connection. The connection takes over
+ *                         the reference held by the caller.
+ * @param tls         [in] Certificate to use for HTTPS, or NULL for HTTP.
+ * @return A new connection, or NULL on failure (socket_conn is closed).
+ */
+struct TeapotConnection *teapot_connection_new(GSocketConnection *socket_conn, GTlsCertificate *tls);
+
+/**
+ * Close the connection and free the memory occupied by it.
+ *
+ * @param conn [in] The connection to free.
+ */
+void teapot_connection_free(struct TeapotConnection *conn);
+
+/**
+ * Perform the TLS handshake of an HTTPS connection.
+ *
+ * The handshake is done in blocking mode (with a socket timeout), so this
+ * should be run outside of reactor threads. On success the connection is put
+ * into TEAPOT_CONNECTION_READING state.
+ *
+ * @param conn [in] The connection to shake hands on.
+ * @return TRUE on success, FALSE on failure.
+ */
+gboolean teapot_connection_handshake(struct TeapotConnection *conn);
+
+/**
+ * Advance the state machine of a connection upon readiness events.
+ *
+ * Never blocks: all socket operations are non-blocking, and the connection
+ * returns to the reactor whenever the socket would block.
+ *
+ * @param conn   [in] The connection which is ready.
+ * @param events [in] The epoll events reported on the connection.
+ * @return The new state of the connection.
+ */
+enum TeapotConnectionState teapot_connection_handle(struct TeapotConnection *conn, guint32 events);
+
+#endif
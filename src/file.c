@@ -1,20 +1,261 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <gio/gio.h>
 #include "file.h"
+#include "mime.h"
+
+/**
+ * How long looked up metadata is trusted without asking the file system
+ * again. Changes noticed by the cache (with inotify) are picked up at once.
+ */
+#define STAT_TTL (1 * G_TIME_SPAN_SECOND)
+
+/**
+ * Number of shards the metadata cache is split into, and number of entries
+ * in each. Every entry of an existing file holds a file descriptor, so the
+ * cache is kept small.
+ */
+#define STAT_SHARDS     8
+#define STAT_SHARD_SIZE 32
+
+/********** Internal types **********/
+
+/**
+ * Metadata of a path, as looked up recently.
+ */
+struct TeapotFileStat {
+  struct TeapotFile *file;    ///< The file, opened but not loaded; NULL if it cannot be served
+  gint64             expires; ///< Monotonic time the entry is valid until
+};
+
+/**
+ * A shard of the metadata cache.
+ */
+struct TeapotFileStatShard {
+  GMutex      lock;    ///< Protects entries
+  GHashTable *entries; ///< Absolute path -> struct TeapotFileStat
+};
+
+/********** Internal States **********/
+
+/**
+ * The directory files are served from, i.e. the current directory at startup.
+ */
+static gchar *document_root = NULL;
+
+static struct TeapotFileStatShard stat_shards[STAT_SHARDS];
 
 /********** Private APIs **********/
 
 static struct TeapotFile *teapot_file_new(void)
 {
-  return g_new0(struct TeapotFile, 1);
+  struct TeapotFile *file = g_new0(struct TeapotFile, 1);
+
+  file->fd        = -1;
+  file->ref_count = 1;
+
+  return file;
+}
+
+static const gchar *teapot_file_document_root(void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter(&initialized)) {
+    document_root = g_get_current_dir();
+    g_once_init_leave(&initialized, 1);
+  }
+
+  return document_root;
+}
+
+/**
+ * Take size and identity of an opened file from the file itself.
+ */
+static bool teapot_file_fstat(struct TeapotFile *file)
+{
+  struct stat st;
+  if (fstat(file->fd, &st) < 0) {
+    g_warning("File: failed to stat %s: %s", file->filename, g_strerror(errno));
+    return false;
+  }
+
+  file->size   = (size_t)st.st_size;
+  file->device = (uint64_t)st.st_dev;
+  file->inode  = (uint64_t)st.st_ino;
+  file->mtime  = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+
+  return true;
+}
+
+/**
+ * Find the MIME type of a file, by its name, or by its content if the name
+ * tells nothing and sniffing is enabled.
+ *
+ * @return The MIME type; the caller should free it.
+ */
+static gchar *teapot_file_content_type(GFile *file, const char *filename)
+{
+  const char *type = teapot_mime_type(filename);
+  if (type)
+    return g_strdup(type);
+
+  gchar *ret = NULL;
+
+  if (teapot_mime_sniffing()) {
+    GFileInfo *info = g_file_query_info(file, G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL, NULL);
+    if (info) {
+      ret = g_strdup(g_file_info_get_content_type(info));
+      g_clear_object(&info);
+    }
+  }
+
+  return ret ? ret : g_strdup("application/octet-stream");
+}
+
+/**
+ * Look a file up on the file system, and open it.
+ *
+ * @param abspath [in] Absolute path of the file, as given by `teapot_file_path`.
+ * @param path    [in] The requested path, for messages.
+ * @return A pointer to `struct TeapotFile` with `fd` opened, or NULL if the
+ *         path should not be served.
+ */
+static struct TeapotFile *teapot_file_lookup(const char *abspath, const char *path)
+{
+  GError *error = NULL;
+  GFile  *gfile = g_file_new_for_path(abspath);
+
+  // Existence, type and name in one go; the MIME type is worked out apart,
+  // as GIO would sniff the content for it
+  GFileInfo *info = g_file_query_info(gfile, G_FILE_ATTRIBUTE_STANDARD_TYPE "," G_FILE_ATTRIBUTE_STANDARD_NAME, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL, &error);
+
+  if (!info) {
+    g_clear_object(&gfile);
+
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+      g_message("File: %s: no such file, reject", path);
+    else
+      g_warning("Failed to query file info: %s", error->message);
+    g_clear_error(&error);
+
+    return NULL;
+  }
+
+  // TODO: currently we do not support directory listing
+  if (g_file_info_get_file_type(info) != G_FILE_TYPE_REGULAR) {
+    g_message("File: requested path is not a regular file, reject");
+    g_clear_object(&info);
+    g_clear_object(&gfile);
+
+    return NULL;
+  }
+
+  struct TeapotFile *ret = teapot_file_new();
+
+  ret->filename     = g_strdup(g_file_info_get_name(info));
+  ret->content_type = teapot_file_content_type(gfile, ret->filename);
+
+  g_debug("File: %s is of type %s", ret->filename, ret->content_type);
+
+  g_clear_object(&info);
+  g_clear_object(&gfile);
+
+  ret->fd = open(abspath, O_RDONLY | O_CLOEXEC);
+  if (ret->fd < 0) {
+    g_warning("File: failed to open %s: %s", ret->filename, g_strerror(errno));
+    teapot_file_unref(ret);
+
+    return NULL;
+  }
+
+  // Take the size from the opened file, which is what will be sent
+  if (!teapot_file_fstat(ret)) {
+    teapot_file_unref(ret);
+
+    return NULL;
+  }
+
+  return ret;
+}
+
+static struct TeapotFileStatShard *teapot_file_stat_shard(const char *abspath)
+{
+  return &stat_shards[g_str_hash(abspath) % STAT_SHARDS];
+}
+
+static void teapot_file_stat_free(gpointer data)
+{
+  struct TeapotFileStat *entry = data;
+
+  teapot_file_unref(entry->file);
+  g_free(entry);
+}
+
+static gboolean teapot_file_stat_expired(gpointer key, gpointer value, gpointer user_data)
+{
+  (void) key;
+
+  return ((struct TeapotFileStat *)value)->expires <= *(const gint64 *)user_data;
+}
+
+/**
+ * Remember the metadata of a path. The shard must be locked.
+ */
+static void teapot_file_stat_insert(struct TeapotFileStatShard *shard, const char *abspath, struct TeapotFile *file, gint64 now)
+{
+  if (!shard->entries)
+    shard->entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, teapot_file_stat_free);
+
+  // Expired entries hold files (and their descriptors) open, which keeps
+  // files replaced or deleted since on the disk; a shard is small to sweep
+  g_hash_table_foreach_remove(shard->entries, teapot_file_stat_expired, &now);
+
+  // Full of live entries: the file is simply looked up again next time
+  if (g_hash_table_size(shard->entries) >= STAT_SHARD_SIZE)
+    return;
+
+  struct TeapotFileStat *entry = g_new0(struct TeapotFileStat, 1);
+
+  entry->file    = file ? teapot_file_ref(file) : NULL;
+  entry->expires = now + STAT_TTL;
+
+  g_hash_table_replace(shard->entries, g_strdup(abspath), entry);
 }
 
 /********** Public APIs **********/
 
-void teapot_file_free(struct TeapotFile *file)
+char *teapot_file_path(const char *path)
+{
+  // For security consideration, we do not allow file access in parent directories
+  gchar *abspath = g_canonicalize_filename(path + 1, teapot_file_document_root());
+  g_debug("File: canonicalized filename: %s", abspath);
+  if (!g_str_has_prefix(abspath, teapot_file_document_root())) {
+    g_message("File: requested path goes out of scope, reject");
+    g_free(abspath);
+    return NULL;
+  }
+
+  return abspath;
+}
+
+struct TeapotFile *teapot_file_ref(struct TeapotFile *file)
+{
+  g_atomic_int_inc(&file->ref_count);
+
+  return file;
+}
+
+void teapot_file_unref(struct TeapotFile *file)
 {
   if (!file)
     return;
 
+  if (!g_atomic_int_dec_and_test(&file->ref_count))
+    return;
+
   g_debug("File: freeing %s of size %zu", file->filename, file->size);
 
   if (file->filename)
@@ -26,122 +267,207 @@ void teapot_file_free(struct TeapotFile *file)
   if (file->content)
     g_free(file->content);
 
-  file->size = 0;
+  if (file->fd >= 0)
+    close(file->fd);
+
+  g_free(file);
 }
 
-struct TeapotFile *teapot_file_read(const char *path, const size_t start, const size_t range)
+struct TeapotFile *teapot_file_stat(const char *path)
 {
-  GError  *error = NULL;
-  gboolean r     = FALSE;
+  gchar *abspath = teapot_file_path(path);
+  if (!abspath)
+    return NULL;
 
-  // For security consideration, we do not allow file access in parent directories
-  gchar *abspath = g_canonicalize_filename(path + 1, NULL);
-  g_debug("File: canonicalized filename: %s", abspath);
-  if (!g_str_has_prefix(abspath, g_get_current_dir())) {
-    g_message("File: requested path goes out of scope, reject");
+  struct TeapotFileStatShard *shard = teapot_file_stat_shard(abspath);
+  struct TeapotFile *file = NULL;
+  gint64 now = g_get_monotonic_time();
+
+  g_mutex_lock(&shard->lock);
+
+  struct TeapotFileStat *entry = shard->entries ? g_hash_table_lookup(shard->entries, abspath) : NULL;
+  if (entry && entry->expires > now) {
+    file = entry->file ? teapot_file_ref(entry->file) : NULL;
+
+    g_mutex_unlock(&shard->lock);
     g_free(abspath);
-    return NULL;
+
+    return file;
   }
 
-  GFile *file = g_file_new_for_path(abspath);
+  // Let go of the file looked up before at once, rather than when replaced
+  if (entry)
+    g_hash_table_remove(shard->entries, abspath);
+
+  g_mutex_unlock(&shard->lock);
+
+  // Missing files are remembered too, so they are not looked for over and over
+  file = teapot_file_lookup(abspath, path);
+
+  g_mutex_lock(&shard->lock);
+  teapot_file_stat_insert(shard, abspath, file, now);
+  g_mutex_unlock(&shard->lock);
+
   g_free(abspath);
 
-  // Check if the file exists (this only gives meaningful message on terminal)
-  if (!g_file_query_exists(file, NULL)) {
-    g_message("File: %s: no such file, reject", path);
-    g_clear_object(&file);
+  return file;
+}
 
-    return NULL;
+void teapot_file_forget(const char *abspath)
+{
+  if (!abspath) {
+    for (guint i = 0; i < STAT_SHARDS; i++) {
+      g_mutex_lock(&stat_shards[i].lock);
+      if (stat_shards[i].entries)
+        g_hash_table_remove_all(stat_shards[i].entries);
+      g_mutex_unlock(&stat_shards[i].lock);
+    }
+
+    return;
   }
 
-  // TODO: currently we do not support directory listing
-  GFileType file_type = g_file_query_file_type(file, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL);
-  if (file_type != G_FILE_TYPE_REGULAR) {
-    g_message("File: requested path is not a regular file, reject");
-    g_clear_object(&file);
+  struct TeapotFileStatShard *shard = teapot_file_stat_shard(abspath);
+
+  g_mutex_lock(&shard->lock);
+  if (shard->entries)
+    g_hash_table_remove(shard->entries, abspath);
+  g_mutex_unlock(&shard->lock);
+}
+
+struct TeapotFile *teapot_file_open(const char *path)
+{
+  struct TeapotFile *meta = teapot_file_stat(path);
+  if (!meta)
+    return NULL;
+
+  // The looked up file is shared, so the caller gets a file of its own, with
+  // a descriptor of its own
+  struct TeapotFile *ret = teapot_file_new();
+
+  ret->filename     = g_strdup(meta->filename);
+  ret->content_type = g_strdup(meta->content_type);
+  ret->fd           = fcntl(meta->fd, F_DUPFD_CLOEXEC, 0);
+
+  teapot_file_unref(meta);
+
+  if (ret->fd < 0) {
+    g_warning("File: failed to open %s: %s", ret->filename, g_strerror(errno));
+    teapot_file_unref(ret);
 
     return NULL;
   }
 
-  // Query file information
-  GFileInfo *info = g_file_query_info(file, "standard::*", G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL, &error);
-  if (!info) {
-    g_warning("Failed to query file info: %s", error->message);
-    g_clear_error(&error);
-    g_clear_object(&file);
+  // The file may have been written to in place since it was looked up
+  if (!teapot_file_fstat(ret)) {
+    teapot_file_unref(ret);
 
     return NULL;
   }
 
-  struct TeapotFile *ret = teapot_file_new();
+  g_debug("File: opened %s of size %zu", ret->filename, ret->size);
 
-  ret->filename     = g_strdup(g_file_info_get_name(info));
-  ret->content_type = g_strdup(g_file_info_get_content_type(info));
-  ret->start        = start;
+  return ret;
+}
 
-  g_debug("File: %s is of type %s", ret->filename, ret->content_type);
+struct TeapotFile *teapot_file_new_derived(uint8_t *content, size_t size, const struct TeapotFile *origin)
+{
+  struct TeapotFile *file = teapot_file_new();
 
-  g_clear_object(&info);
+  file->filename     = g_strdup(origin->filename);
+  file->content_type = g_strdup(origin->content_type);
+  file->content      = content;
+  file->size         = size;
+  file->device       = origin->device;
+  file->inode        = origin->inode;
+  file->mtime        = origin->mtime;
 
-  if (range == TEAPOT_FILE_READ_RANGE_FULL) {
-    // Read the whole file
-    r = g_file_load_contents(file, NULL, (char **)&(ret->content), &(ret->size), NULL, &error);
-    if (!r) {
-      g_warning("File: failed to load the whole file: %s", error->message);
-      g_clear_error(&error);
-      teapot_file_free(ret);
-      g_clear_object(&file);
+  return file;
+}
 
-      return NULL;
-    }
-  } else {
-    // Read partial file based on the designated start byte and range
-    GFileInputStream *stream_in = g_file_read(file, NULL, &error);
-    if (!stream_in) {
-      g_warning("Failed to create input stream: %s", error->message);
-      g_clear_error(&error);
-      teapot_file_free(ret);
-      g_clear_object(&file);
+bool teapot_file_load(struct TeapotFile *file)
+{
+  if (file->content)
+    return true;
 
-      return NULL;
+  // g_malloc(0) returns NULL, which would read as "not loaded"
+  file->content = g_malloc(MAX(file->size, 1));
+
+  size_t loaded = 0;
+  while (loaded < file->size) {
+    ssize_t bytes = pread(file->fd, file->content + loaded, file->size - loaded, (off_t)loaded);
+    if (bytes < 0 && errno == EINTR)
+      continue;
+
+    if (bytes <= 0) {
+      g_warning("File: failed to load %s: %s", file->filename, bytes < 0 ? g_strerror(errno) : "file truncated");
+      g_clear_pointer(&file->content, g_free);
+      return false;
     }
 
-    // Skip till start
-    gssize bytes_skipped = g_input_stream_skip(G_INPUT_STREAM(stream_in), start, NULL, &error);
-    if (bytes_skipped < 0) {
-      g_warning("Failed to seek file to start: %s", error->message);
-      g_clear_error(&error);
-      teapot_file_free(ret);
-      g_clear_object(&stream_in);
-      g_clear_object(&file);
+    loaded += (size_t)bytes;
+  }
+
+  // The content is all we need from now on
+  close(file->fd);
+  file->fd = -1;
+
+  g_debug("File: loaded %zu bytes", file->size);
 
+  return true;
+}
+
+struct TeapotFile *teapot_file_read(const char *path, const size_t start, const size_t range)
+{
+  struct TeapotFile *ret = teapot_file_open(path);
+  if (!ret)
+    return NULL;
+
+  if (range == TEAPOT_FILE_READ_RANGE_FULL && start == 0) {
+    // Read the whole file
+    if (!teapot_file_load(ret)) {
+      teapot_file_unref(ret);
       return NULL;
     }
 
-    // Allocate memory for buffer
+    return ret;
+  }
+
+  // Read partial file based on the designated start byte and range, at its
+  // position in the file rather than by reading through everything before it
+  size_t size = start < ret->size ? ret->size - start : 0;
+  if (range != TEAPOT_FILE_READ_RANGE_FULL)
+    size = MIN(size, range);
+
+  g_debug("File: allocating %zu bytes of memory", size);
+  uint8_t *content = g_malloc(MAX(size, 1));
 
-    g_debug("File: allocating %zu bytes of memory", range);
-    ret->content = g_malloc(range);
+  size_t loaded = 0;
+  while (loaded < size) {
+    ssize_t bytes = pread(ret->fd, content + loaded, size - loaded, (off_t)(start + loaded));
+    if (bytes < 0 && errno == EINTR)
+      continue;
 
-    // Read till range
-    gssize bytes_read = g_input_stream_read(G_INPUT_STREAM(stream_in), ret->content, range, NULL, &error);
-    if (bytes_read < 0) {
-      g_warning("Failed to load file into memory: %s", error->message);
-      g_clear_error(&error);
-      teapot_file_free(ret);
-      g_clear_object(&stream_in);
-      g_clear_object(&file);
+    if (bytes < 0) {
+      g_warning("Failed to load file into memory: %s", g_strerror(errno));
+      g_free(content);
+      teapot_file_unref(ret);
 
       return NULL;
     }
 
-    ret->size = (size_t)bytes_read;
+    if (bytes == 0)
+      break; // Truncated meanwhile; return what there is
+
+    loaded += (size_t)bytes;
   }
 
-  g_debug("File: loaded %zu bytes", ret->size);
+  close(ret->fd);
+  ret->fd      = -1;
+  ret->content = content;
+  ret->start   = start;
+  ret->size    = loaded;
 
-  // Free unused memory
-  g_clear_object(&file);
+  g_debug("File: loaded %zu bytes", ret->size);
 
   return ret;
 }
@@ -151,14 +477,9 @@ bool teapot_file_write(const uint8_t *content, const size_t size, const char *pa
   GError  *error = NULL;
   gboolean r     = FALSE;
 
-  // For security consideration, we do not allow file access in parent directories
-  gchar *abspath = g_canonicalize_filename(path + 1, NULL);
-  g_debug("File: canonicalized filename: %s", abspath);
-  if (!g_str_has_prefix(abspath, g_get_current_dir())) {
-    g_message("File: requested path goes out of scope, reject");
-    g_free(abspath);
+  gchar *abspath = teapot_file_path(path);
+  if (!abspath)
     return false;
-  }
 
   GFile *file = g_file_new_for_path(abspath);
 
@@ -192,6 +513,9 @@ bool teapot_file_write(const uint8_t *content, const size_t size, const char *pa
 
   g_debug("File: written %zu bytes", size);
 
+  // It may have been looked up as missing
+  teapot_file_forget(abspath);
+
   // Free unused memory
   g_clear_object(&file);
   g_free(abspath);
@@ -14,22 +14,109 @@
 #define TEAPOT_FILE_READ_RANGE_FULL 0
 
 /**
- * A data structure representing a file loaded into the memory.
+ * A data structure representing a file loaded into the memory, or opened for
+ * reading.
  */
 struct TeapotFile {
   char    *filename;     ///< Name of the file
   char    *content_type; ///< MIME type of the file
   size_t   start;        ///< Start byte of the file
   size_t   size;         ///< Size of the file
-  uint8_t *content;      ///< Binary content of the file
+  uint8_t *content;      ///< Binary content of the file, NULL if not loaded
+  int      fd;           ///< Opened file descriptor, -1 if not opened
+  int      ref_count;    ///< Reference count, see `teapot_file_ref`
+
+  // Identity of the file on disk; changes whenever the file does
+  uint64_t device;       ///< Device the file is on
+  uint64_t inode;        ///< Inode number of the file
+  int64_t  mtime;        ///< Last modification time, in nanoseconds since epoch
 };
 
 /**
- * Free the memory occupied by `struct TeapotFile`.
+ * Map a requested path to the absolute path of the file to serve.
+ *
+ * @param path [in] The requested path (starting with '/').
+ * @return The canonicalized absolute path, or NULL if the path goes out of the
+ *         document root. The caller should free the returned string.
+ */
+char *teapot_file_path(const char *path);
+
+/**
+ * Increase the reference count of `struct TeapotFile`.
+ *
+ * A file may be shared (e.g. by the cache and the responses being sent), so
+ * it is only freed when the last reference is dropped. This function is
+ * thread-safe.
+ *
+ * @param file [in] The `struct TeapotFile` to reference.
+ * @return The same file.
+ */
+struct TeapotFile *teapot_file_ref(struct TeapotFile *file);
+
+/**
+ * Decrease the reference count of `struct TeapotFile`, freeing the memory
+ * occupied by it (and closing the file if it is opened) when it drops to 0.
+ *
+ * @param file [in] The `struct TeapotFile` to unreference.
+ */
+void teapot_file_unref(struct TeapotFile *file);
+
+/**
+ * Look the metadata of a file up, without touching its content.
+ *
+ * Lookups are cached for a second (or until the change is noticed, see
+ * `teapot_file_forget`), so repeated requests for a path cost a hash lookup
+ * rather than a round of system calls. This function is thread-safe.
+ *
+ * @param path [in] The requested path.
+ * @return A reference to a shared `struct TeapotFile` with name, MIME type,
+ *         size and identity set (and `fd` opened, which must not be closed or
+ *         loaded). NULL if the file cannot be served.
+ */
+struct TeapotFile *teapot_file_stat(const char *path);
+
+/**
+ * Drop cached metadata, so the file is looked up again next time.
  *
- * @param file [in] The `struct TeapotFile` to free.
+ * @param abspath [in] Absolute path of the file, as given by
+ *                     `teapot_file_path`. NULL to drop everything.
+ */
+void teapot_file_forget(const char *abspath);
+
+/**
+ * Open file from path without loading it.
+ *
+ * The content is left NULL; the file can be sent from `fd` instead (e.g. with
+ * `sendfile()`), so it never has to be copied into memory. The file is looked
+ * up with `teapot_file_stat`.
+ *
+ * @param path [in] Path to the file to open.
+ * @return A pointer to `struct TeapotFile` representing the file, with `fd`
+ *         and `size` set. On failure, NULL is returned.
+ */
+struct TeapotFile *teapot_file_open(const char *path);
+
+/**
+ * Create a file derived from another one (e.g. a compressed variant) from
+ * content in memory.
+ *
+ * @param content [in] Content of the new file. The file takes the ownership.
+ * @param size    [in] Size of the content.
+ * @param origin  [in] The file it is derived from. Name, MIME type and
+ *                     identity are copied from it.
+ * @return A pointer to `struct TeapotFile` with `content` loaded.
+ */
+struct TeapotFile *teapot_file_new_derived(uint8_t *content, size_t size, const struct TeapotFile *origin);
+
+/**
+ * Load the whole content of an opened file into memory.
+ *
+ * On success the file is closed, and `content` holds `size` bytes.
+ *
+ * @param file [in] A file returned by `teapot_file_open`.
+ * @return true on success, false on failure.
  */
-void teapot_file_free(struct TeapotFile *file);
+bool teapot_file_load(struct TeapotFile *file);
 
 /**
  * Read file from path.
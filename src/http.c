@@ -1,14 +1,26 @@
 #include <glib.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <stdint.h>
+#include <time.h>
 #include "file.h"
+#include "cache.h"
+#include "compress.h"
 #include "redir.h"
+#include "parser.h"
+#include "log.h"
+#include "metrics.h"
 #include "http.h"
 #include "config.h"
 
 #define BUFSIZE 4096
 
+/**
+ * Size of the Date header field, e.g. "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n".
+ */
+#define HTTP_DATE_SIZE 40
+
 /********** Internal types **********/
 
 /**
@@ -30,47 +42,48 @@ enum HttpStatusCode {
     HTTP_STATUS_UNKNOWN,                ///< Unknown HTTP status code
     HTTP_STATUS_OK,                     ///< HTTP 200
     HTTP_STATUS_NO_CONTENT,             ///< HTTP 204
+    HTTP_STATUS_PARTIAL_CONTENT,        ///< HTTP 206
 
     HTTP_STATUS_MOVED_PERMANENTLY,      ///< HTTP 301
     HTTP_STATUS_FOUND,                  ///< HTTP 302
+    HTTP_STATUS_NOT_MODIFIED,           ///< HTTP 304
 
     HTTP_STATUS_BAD_REQUEST,            ///< HTTP 400
     HTTP_STATUS_FORBIDDEN,              ///< HTTP 403
     HTTP_STATUS_NOT_FOUND,              ///< HTTP 404
     HTTP_STATUS_METHOD_NOT_ALLOWED,     ///< HTTP 405
+    HTTP_STATUS_PAYLOAD_TOO_LARGE,      ///< HTTP 413
+    HTTP_STATUS_URI_TOO_LONG,           ///< HTTP 414
+    HTTP_STATUS_RANGE_NOT_SATISFIABLE,  ///< HTTP 416
+    HTTP_STATUS_HEADER_TOO_LARGE,       ///< HTTP 431
 
     HTTP_STATUS_INTERNAL_SERVER_ERROR,  ///< HTTP 500
+    HTTP_STATUS_NOT_IMPLEMENTED,        ///< HTTP 501
 
     HTCPCP_STATUS_I_AM_A_TEAPOT,        ///< HTCPCP 418 :)
 };
 
-/**
- * HTTP header indicator, mainly for use in http_extract_header().
- */
-enum RequestHeader {
-  HTTP_HOST,                          ///< "Host: "
-  HTTP_CONTENT_TYPE,                  ///< "Content-Type: "
-  HTTP_HEADER_CONTENT_LENGTH,         ///< "Content-Length: "
-  HTTP_HEADER_EXPECT,                 ///< "Expect: "
-};
-
 /**
  * An HTTP request entity.
  */
 struct HttpRequest {
     // Request line
     enum HttpMethod method;
-    char *path;
-    char *version;
-
-    // Header fields
-    char *host;
-    char *content_type;
+    char path[BUFSIZE]; ///< NUL-terminated copy of the request target
+    bool http_1_0;      ///< Whether the client speaks HTTP/1.0
+
+    // Header fields, pointing into the request (not NUL-terminated)
+    struct TeapotHttpSpan connection;
+    struct TeapotHttpSpan accept_encoding;
+    struct TeapotHttpSpan range;
+    struct TeapotHttpSpan if_range;
+    struct TeapotHttpSpan if_none_match;
+    struct TeapotHttpSpan if_modified_since;
     size_t content_length;
-    char *expect;
 
-    // Content
-    uint8_t *content;
+    // Content, pointing into the request, or to `decoded`
+    const uint8_t *content;
+    uint8_t       *decoded; ///< Content of a chunked request, or NULL
 };
 
 /**
@@ -84,11 +97,34 @@ struct HttpResponse {
     char *content_type;
     size_t content_length;
     char *connection;
-    char *location;
     char *allow;
+    const char *content_encoding;
+    const char *vary;
+    const char *accept_ranges;
+    bool content_range;  ///< Whether to send Content-Range (of the content, or "*")
+    size_t range_total;  ///< Length of the whole file, for Content-Range
+    const char *boundary; ///< Boundary of multipart/byteranges content, or NULL
+    const struct TeapotFile *validators; ///< File to send ETag and Last-Modified of, or NULL
+    const char *etag_coding; ///< Content coding the ETag is of, NULL for identity
 
     // Content
-    uint8_t *content;
+    const uint8_t *content;  ///< Content in memory, or NULL
+    struct TeapotFile *file; ///< Opened file to send the content from, or NULL
+    size_t content_offset;   ///< Where the content starts in content or file
+};
+
+/**
+ * Maximum number of ranges a request may ask for. More ranges than this are
+ * seldom useful, and would only make the response (and the work) larger.
+ */
+#define HTTP_MAX_RANGES 16
+
+/**
+ * A byte range of a file, both ends included.
+ */
+struct HttpRange {
+    size_t first;
+    size_t last;
 };
 
 /********** Internal states (variables) **********/
@@ -106,31 +142,73 @@ struct HttpResponse {
 
 /* String constants of HTTP contents for internal use */
 
-static const char *http_status_ok         = HTTP_VERSION " 200 OK";
-static const char *http_status_no_content = HTTP_VERSION " 204 No Content";
+/**
+ * A string constant with its length computed at compile time.
+ */
+struct HttpLine {
+  const char *data;
+  size_t      length;
+  unsigned    code;   ///< Status code of a status line, 0 for other lines
+};
 
-static const char *http_status_moved_permanently = HTTP_VERSION " 301 Moved Permanently";
-static const char *http_status_found             = HTTP_VERSION " 302 Found";
+#define HTTP_LINE(str) { str, sizeof(str) - 1, 0 }
+#define HTTP_STATUS_LINE(version, code, reason) { version " " #code " " reason "\r\n", sizeof(version " " #code " " reason "\r\n") - 1, code }
 
-static const char *http_status_bad_request            = HTTP_VERSION " 400 Bad Request";
-static const char *http_status_forbidden              = HTTP_VERSION " 403 Forbidden";
-static const char *http_status_not_found              = HTTP_VERSION " 404 Not Found";
-static const char *http_status_method_not_allowed     = HTTP_VERSION " 405 Method Not Allowed";
+/**
+ * Status lines, ready to be sent.
+ */
+static const struct HttpLine http_status_lines[] = {
+  [HTTP_STATUS_OK]         = HTTP_STATUS_LINE(HTTP_VERSION, 200, "OK"),
+  [HTTP_STATUS_NO_CONTENT] = HTTP_STATUS_LINE(HTTP_VERSION, 204, "No Content"),
+  [HTTP_STATUS_PARTIAL_CONTENT] = HTTP_STATUS_LINE(HTTP_VERSION, 206, "Partial Content"),
+
+  [HTTP_STATUS_MOVED_PERMANENTLY] = HTTP_STATUS_LINE(HTTP_VERSION, 301, "Moved Permanently"),
+  [HTTP_STATUS_FOUND]             = HTTP_STATUS_LINE(HTTP_VERSION, 302, "Found"),
+  [HTTP_STATUS_NOT_MODIFIED]      = HTTP_STATUS_LINE(HTTP_VERSION, 304, "Not Modified"),
+
+  [HTTP_STATUS_BAD_REQUEST]        = HTTP_STATUS_LINE(HTTP_VERSION, 400, "Bad Request"),
+  [HTTP_STATUS_FORBIDDEN]          = HTTP_STATUS_LINE(HTTP_VERSION, 403, "Forbidden"),
+  [HTTP_STATUS_NOT_FOUND]          = HTTP_STATUS_LINE(HTTP_VERSION, 404, "Not Found"),
+  [HTTP_STATUS_METHOD_NOT_ALLOWED] = HTTP_STATUS_LINE(HTTP_VERSION, 405, "Method Not Allowed"),
+  [HTTP_STATUS_PAYLOAD_TOO_LARGE]  = HTTP_STATUS_LINE(HTTP_VERSION, 413, "Payload Too Large"),
+  [HTTP_STATUS_URI_TOO_LONG]       = HTTP_STATUS_LINE(HTTP_VERSION, 414, "URI Too Long"),
+  [HTTP_STATUS_RANGE_NOT_SATISFIABLE] = HTTP_STATUS_LINE(HTTP_VERSION, 416, "Range Not Satisfiable"),
+  [HTTP_STATUS_HEADER_TOO_LARGE]   = HTTP_STATUS_LINE(HTTP_VERSION, 431, "Request Header Fields Too Large"),
+
+  [HTTP_STATUS_INTERNAL_SERVER_ERROR] = HTTP_STATUS_LINE(HTTP_VERSION, 500, "Server Internal Error"),
+  [HTTP_STATUS_NOT_IMPLEMENTED]       = HTTP_STATUS_LINE(HTTP_VERSION, 501, "Not Implemented"),
+
+  [HTCPCP_STATUS_I_AM_A_TEAPOT] = HTTP_STATUS_LINE(HTCPCP_VERSION, 418, "I'm a teapot"),
+};
 
-static const char *http_status_internal_server_error = HTTP_VERSION " 500 Server Internal Error";
+/* Header fields of responses, see teapot_http_output_field() */
+
+static const struct HttpLine http_field_content_type     = HTTP_LINE("Content-Type: ");
+static const struct HttpLine http_field_content_encoding = HTTP_LINE("Content-Encoding: ");
+static const struct HttpLine http_field_accept_ranges    = HTTP_LINE("Accept-Ranges: ");
+static const struct HttpLine http_field_vary             = HTTP_LINE("Vary: ");
+static const struct HttpLine http_field_connection       = HTTP_LINE("Connection: ");
+static const struct HttpLine http_field_allow            = HTTP_LINE("Allow: ");
+static const struct HttpLine http_crlf                   = HTTP_LINE("\r\n");
+
+static const char *http_day_names[]   = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char *http_month_names[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
 
 static const char *http_get    = "GET";
 static const char *http_head    = "HEAD";
 static const char *http_post   = "POST";
 static const char *http_delete = "DELETE";
 
-static const char *htcpcp_status_i_am_a_teapot = HTCPCP_VERSION " 418 I'm a teapot";
 static const char *htcpcp_brew = "BREW";
 
-static const char *http_header_host                 = "Host: ";
-static const char *http_header_content_type         = "Content-Type: ";
-static const char *http_header_content_length       = "Content-Length: ";
-static const char *http_header_expect               = "Expect: ";
+static const char *http_header_content_length    = "Content-Length";
+static const char *http_header_connection        = "Connection";
+static const char *http_header_accept_encoding   = "Accept-Encoding";
+static const char *http_header_transfer_encoding = "Transfer-Encoding";
+static const char *http_header_range             = "Range";
+static const char *http_header_if_range          = "If-Range";
+static const char *http_header_if_none_match     = "If-None-Match";
+static const char *http_header_if_modified_since = "If-Modified-Since";
 
 static const char *http_status_not_found_html =
   "<!DOCTYPE html>\r\n"
@@ -146,27 +224,12 @@ static const char *http_status_not_found_html =
   "</body>\r\n"
   "</html>\r\n";
 
-/********** Private APIs **********/
-
-/**
- * Convert string into integer.
- */
-static int toInteger(char a[]) {
-  int c = '\0', sign = 0, offset = 0, n = 0;
-
-  if (a[0] == '-') sign = -1;
+/* Limits on requests, see teapot_http_init() */
 
-  if (sign == -1) offset = 1;
-  else offset = 0;
-
-  n = 0;
-  for (c = offset; a[c] != '\0'; c++) {
-    n = n * 10 + a[c] - '0';
-  }
+static size_t max_header_size = TEAPOT_DEFAULT_MAX_HEADER_SIZE;
+static size_t max_body_size   = TEAPOT_DEFAULT_MAX_BODY_SIZE;
 
-  if (sign == -1) n = -n;
-  return n;
-}
+/********** Private APIs **********/
 
 /**
  * Convert enumeration HttpMethod to string.
@@ -203,353 +266,1026 @@ static const char *http_method_to_string(enum HttpMethod method)
 }
 
 /**
- * Convert enumeration HttpStatusCode to string.
- *
- * @param method [in] HttpStatusCode to convert.
- * @return A string constant representing the HTTP status. The caller should not
- *         free the string!
+ * Tell which method a request is of. Methods are case-sensitive.
  */
-static const char *http_status_to_string(enum HttpStatusCode status)
+static enum HttpMethod http_method_from_span(const char *input, struct TeapotHttpSpan span)
 {
-  const char *ret = NULL;
+  static const enum HttpMethod methods[] = { HTTP_GET, HTTP_HEAD, HTTP_POST, HTTP_DELETE, HTCPCP_BREW };
 
-  switch (status) {
-    case HTTP_STATUS_OK:
-      ret = http_status_ok;
-      break;
-    case HTTP_STATUS_NO_CONTENT:
-      ret = http_status_no_content;
-      break;
+  for (size_t i = 0; i < G_N_ELEMENTS(methods); i++) {
+    const char *name = http_method_to_string(methods[i]);
 
-    case HTTP_STATUS_MOVED_PERMANENTLY:
-      ret = http_status_moved_permanently;
-      break;
-    case HTTP_STATUS_FOUND:
-      ret = http_status_found;
-      break;
+    if (strlen(name) == span.length && memcmp(input + span.offset, name, span.length) == 0)
+      return methods[i];
+  }
 
-    case HTTP_STATUS_BAD_REQUEST:
-      ret = http_status_bad_request;
-      break;
-    case HTTP_STATUS_FORBIDDEN:
-      ret = http_status_forbidden;
-      break;
-    case HTTP_STATUS_NOT_FOUND:
-      ret = http_status_not_found;
-      break;
-    case HTTP_STATUS_METHOD_NOT_ALLOWED:
-      ret = http_status_method_not_allowed;
-      break;
+  return HTTP_METHOD_UNKNOWN;
+}
 
-    case HTTP_STATUS_INTERNAL_SERVER_ERROR:
-      ret = http_status_internal_server_error;
-      break;
+/**
+ * Parse the value of Content-Length.
+ *
+ * @return true on success, false if the value is not a valid length.
+ */
+static bool http_parse_length(const char *input, struct TeapotHttpSpan span, size_t *length)
+{
+  size_t value = 0;
 
-    case HTCPCP_STATUS_I_AM_A_TEAPOT:
-      ret = htcpcp_status_i_am_a_teapot;
-      break;
+  if (span.length == 0)
+    return false;
 
-    case HTTP_STATUS_UNKNOWN: // fall through
-    // default:
-      break; // Remain ret to be NULL
+  for (size_t i = 0; i < span.length; i++) {
+    char c = input[span.offset + i];
+    if (c < '0' || c > '9' || value > (SIZE_MAX - 9) / 10)
+      return false;
+
+    value = value * 10 + (size_t)(c - '0');
   }
-  return ret;
+
+  *length = value;
+  return true;
 }
 
-static enum HttpMethod http_extract_request_method(const char *req)
+/**
+ * Tell whether a comma-separated header value has a token in it, e.g.
+ * "close" in "Connection: Upgrade, close".
+ */
+static bool http_span_has_token(const char *input, struct TeapotHttpSpan span, const char *token)
 {
-  if (!req)
-    return HTTP_METHOD_UNKNOWN;
-
-  enum HttpMethod ret = HTTP_METHOD_UNKNOWN;
-
-  if (g_str_has_prefix(req, "GET"))
-    ret = HTTP_GET;
-  else if (g_str_has_prefix(req, "HEAD"))
-    ret = HTTP_HEAD;
-  else if (g_str_has_prefix(req, "POST"))
-    ret = HTTP_POST;
-  else if (g_str_has_prefix(req, "DELETE"))
-    ret = HTTP_DELETE;
-  else if (g_str_has_prefix(req, "BREW"))
-    ret = HTCPCP_BREW;
+  size_t token_length = strlen(token);
+  const char *p   = input + span.offset;
+  const char *end = p + span.length;
 
-  return ret;
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+      p++;
+
+    const char *start = p;
+    while (p < end && *p != ',' && *p != ' ' && *p != '\t')
+      p++;
+
+    if ((size_t)(p - start) == token_length && g_ascii_strncasecmp(start, token, token_length) == 0)
+      return true;
+  }
+
+  return false;
 }
 
-static char *http_extract_request_path(const char *req)
+/**
+ * Parse the Range header of a request (RFC 7233 2.1).
+ *
+ * @param size   [in]  Length of the file the ranges are of.
+ * @param ranges [out] The satisfiable ranges, HTTP_MAX_RANGES at most.
+ * @return Number of satisfiable ranges (0 if there is none), or -1 if the
+ *         header is to be ignored: it is malformed, or asks for too many
+ *         ranges.
+ */
+static int http_parse_ranges(const char *input, struct TeapotHttpSpan span, size_t size, struct HttpRange *ranges)
 {
-  if (!req)
-    return NULL;
+    const char *p   = input + span.offset;
+    const char *end = p + span.length;
+    int n_specs  = 0;
+    int n_ranges = 0;
+
+    if (span.length < strlen("bytes=") || g_ascii_strncasecmp(p, "bytes=", strlen("bytes=")) != 0)
+      return -1;
+    p += strlen("bytes=");
+
+    while (p < end) {
+      // Each range is "first-last", "first-" or "-suffix", separated by ","
+      while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+        p++;
+      if (p == end)
+        break;
 
-  char *buffer = g_malloc(BUFSIZE);
+      const char *spec = p;
+      while (p < end && *p != ',')
+        p++;
+      const char *spec_end = p;
+      while (spec_end[-1] == ' ' || spec_end[-1] == '\t')
+        spec_end--;
+
+      const char *dash = memchr(spec, '-', (size_t)(spec_end - spec));
+      if (!dash)
+        return -1;
+
+      struct TeapotHttpSpan first_span = { (size_t)(spec - input), (size_t)(dash - spec) };
+      struct TeapotHttpSpan last_span  = { (size_t)(dash + 1 - input), (size_t)(spec_end - dash - 1) };
+      size_t first = 0;
+      size_t last  = 0;
+
+      if (first_span.length == 0 && last_span.length == 0)
+        return -1;
+      if (first_span.length > 0 && !http_parse_length(input, first_span, &first))
+        return -1;
+      if (last_span.length > 0 && !http_parse_length(input, last_span, &last))
+        return -1;
+
+      n_specs++;
+
+      if (first_span.length == 0) {
+        // The final bytes of the file
+        if (last == 0 || size == 0)
+          continue; // Not satisfiable
+        first = size > last ? size - last : 0;
+        last  = size - 1;
+      } else {
+        if (last_span.length > 0 && last < first)
+          return -1;
+        if (first >= size)
+          continue; // Not satisfiable
+        if (last_span.length == 0 || last >= size)
+          last = size - 1;
+      }
 
-  sscanf(req, "%*s %4095s", buffer); // XXX: Hardcoded buffer size
+      if (n_ranges == HTTP_MAX_RANGES)
+        return -1;
 
-  char *ret = g_strdup(buffer);
+      ranges[n_ranges].first = first;
+      ranges[n_ranges].last  = last;
+      n_ranges++;
+    }
 
-  g_free(buffer);
-  return ret;
+    return n_specs > 0 ? n_ranges : -1;
 }
 
-static char *http_extract_request_version(const char *req)
+/**
+ * Walk a chunked body (RFC 7230 4.1), optionally decoding it.
+ *
+ * @param input      [in]  The body as sent, from its first chunk.
+ * @param length     [in]  Number of bytes of it received so far.
+ * @param out        [out] Where to copy the decoded body, or NULL.
+ * @param raw_length [out] Length of the body as sent, including the trailer.
+ * @param size       [out] Length of the decoded body.
+ * @return HTTP_STATUS_OK if the whole body has arrived, HTTP_STATUS_UNKNOWN
+ *         if more bytes are needed, or the status to reject the request with.
+ */
+static enum HttpStatusCode http_chunked_walk(const char *input, size_t length, uint8_t *out, size_t *raw_length, size_t *size)
 {
-  if (!req)
-    return NULL;
+    const char *p   = input;
+    const char *end = input + length;
+
+    *size = 0;
+
+    for (;;) {
+      // Chunk size in hex, maybe followed by extensions, which are ignored
+      const char *eol = memchr(p, '\n', (size_t)(end - p));
+      if (!eol)
+        return (size_t)(end - input) > max_body_size ? HTTP_STATUS_PAYLOAD_TOO_LARGE : HTTP_STATUS_UNKNOWN;
+
+      size_t chunk = 0;
+      const char *digit = p;
+      for (; digit < eol && g_ascii_isxdigit(*digit); digit++) {
+        if (chunk > (SIZE_MAX >> 4))
+          return HTTP_STATUS_PAYLOAD_TOO_LARGE;
+        chunk = (chunk << 4) | (size_t)g_ascii_xdigit_value(*digit);
+      }
+      if (digit == p || (*digit != ';' && *digit != '\r' && *digit != '\n'))
+        return HTTP_STATUS_BAD_REQUEST;
 
-  char *buffer = g_malloc(BUFSIZE);
+      p = eol + 1;
 
-  sscanf(req, "%*s %*s %4095s", buffer); // XXX: Hardcoded buffer size
+      // The framing counts against the limit too, so that it is never buffered
+      // without bound
+      if (chunk > max_body_size || (size_t)(p - input) + chunk > max_body_size)
+        return HTTP_STATUS_PAYLOAD_TOO_LARGE;
 
-  char *ret = g_strdup(buffer);
+      if (chunk == 0)
+        break;
 
-  g_free(buffer);
-  return ret;
+      // Chunk data, followed by CRLF
+      if ((size_t)(end - p) < chunk + 2)
+        return HTTP_STATUS_UNKNOWN;
+      if (p[chunk] != '\r' || p[chunk + 1] != '\n')
+        return HTTP_STATUS_BAD_REQUEST;
+
+      if (out)
+        memcpy(out + *size, p, chunk);
+      *size += chunk;
+      p     += chunk + 2;
+    }
+
+    // Trailer fields are ignored, up to the empty line
+    for (;;) {
+      const char *eol = memchr(p, '\n', (size_t)(end - p));
+      if (!eol)
+        return (size_t)(end - input) > max_body_size ? HTTP_STATUS_PAYLOAD_TOO_LARGE : HTTP_STATUS_UNKNOWN;
+
+      bool empty = eol == p || (eol == p + 1 && *p == '\r');
+      p = eol + 1;
+
+      if (empty)
+        break;
+    }
+
+    *raw_length = (size_t)(p - input);
+    return HTTP_STATUS_OK;
 }
 
-static char *http_extract_header(const char *http, enum RequestHeader header)
+/**
+ * Parse the first HTTP request in a buffer into `struct HttpRequest` for
+ * future processing.
+ *
+ * The buffer is scanned only once, and nothing is allocated: header values
+ * and the content are left in the buffer. Only a chunked body is decoded
+ * into `decoded`, once it has fully arrived.
+ *
+ * Limits are checked as early as possible, so that an oversized request is
+ * rejected before it is buffered.
+ *
+ * @param request  [out] The parsed request.
+ * @param input    [in]  The bytes received from the client.
+ * @param length   [in]  Number of bytes in input.
+ * @param consumed [out] Length of the request, including the content.
+ * @return HTTP_STATUS_OK if the request has fully arrived and is parsed,
+ *         HTTP_STATUS_UNKNOWN if more bytes are needed, or the status to
+ *         reject the request with.
+ */
+static enum HttpStatusCode teapot_http_request_parse(struct TeapotArena *arena, struct HttpRequest *request, const char *input, size_t length, size_t *consumed)
 {
-  if (!http)
-    return NULL;
+    struct TeapotHttpRequest parsed;
 
-  char *buffer = g_malloc0(BUFSIZE);
-  const char *line = NULL;
+    request->decoded = NULL;
 
-  switch (header) {
-    case HTTP_HOST:
-      line = g_strstr_len(http, -1, http_header_host);
-      if (line) {
-        sscanf(line, "%*s %4095s", buffer);
-      }
-      break;
-    case HTTP_CONTENT_TYPE:
-      line = g_strstr_len(http, -1, http_header_content_type);
-      if (line) {
-        sscanf(line, "%*s %4095s", buffer);
-      }
-      break;
-    case HTTP_HEADER_CONTENT_LENGTH:
-      line = g_strstr_len(http, -1, http_header_content_length);
-      if (line) {
-        sscanf(line, "%*s %4095s", buffer);
-      }
-      break;
-    case HTTP_HEADER_EXPECT:
-      line = g_strstr_len(http, -1, http_header_expect);
-      if (line) {
-        sscanf(line, "%*s %4095s", buffer);
+    switch (teapot_parser_parse(&parsed, input, length)) {
+      case TEAPOT_PARSER_DONE:
+        break;
+      case TEAPOT_PARSER_INCOMPLETE:
+        return length > max_header_size ? HTTP_STATUS_HEADER_TOO_LARGE : HTTP_STATUS_UNKNOWN;
+      case TEAPOT_PARSER_INVALID:
+        return HTTP_STATUS_BAD_REQUEST;
+      case TEAPOT_PARSER_TOO_LARGE:
+        return HTTP_STATUS_HEADER_TOO_LARGE;
+    }
+
+    if (parsed.header_length > max_header_size)
+      return HTTP_STATUS_HEADER_TOO_LARGE;
+
+    // Request line
+    request->method   = http_method_from_span(input, parsed.method);
+    request->http_1_0 = teapot_parser_span_is(input, parsed.version, "HTTP/1.0");
+
+    if (parsed.target.length >= sizeof(request->path))
+      return HTTP_STATUS_URI_TOO_LONG;
+    memcpy(request->path, input + parsed.target.offset, parsed.target.length);
+    request->path[parsed.target.length] = '\0';
+
+    // Header fields
+    struct TeapotHttpSpan none = { 0, 0 };
+    request->connection      = none;
+    request->accept_encoding = none;
+    request->range           = none;
+    request->if_range        = none;
+    request->if_none_match   = none;
+    request->if_modified_since = none;
+    request->content_length  = 0;
+
+    bool has_length = false;
+    bool chunked    = false;
+    for (size_t i = 0; i < parsed.n_headers; i++) {
+      const struct TeapotHttpHeader *header = &parsed.headers[i];
+
+      if (teapot_parser_span_is(input, header->name, http_header_connection)) {
+        request->connection = header->value;
+      } else if (teapot_parser_span_is(input, header->name, http_header_accept_encoding)) {
+        request->accept_encoding = header->value;
+      } else if (teapot_parser_span_is(input, header->name, http_header_range)) {
+        request->range = header->value;
+      } else if (teapot_parser_span_is(input, header->name, http_header_if_range)) {
+        request->if_range = header->value;
+      } else if (teapot_parser_span_is(input, header->name, http_header_if_none_match)) {
+        request->if_none_match = header->value;
+      } else if (teapot_parser_span_is(input, header->name, http_header_if_modified_since)) {
+        request->if_modified_since = header->value;
+      } else if (teapot_parser_span_is(input, header->name, http_header_content_length)) {
+        size_t content_length = 0;
+
+        // Conflicting lengths would make the framing ambiguous (RFC 7230 3.3.2)
+        if (!http_parse_length(input, header->value, &content_length) || (has_length && content_length != request->content_length))
+          return HTTP_STATUS_BAD_REQUEST;
+
+        request->content_length = content_length;
+        has_length = true;
+      } else if (teapot_parser_span_is(input, header->name, http_header_transfer_encoding)) {
+        // No other coding is supported, and chunked must come last anyway
+        if (chunked || !teapot_parser_span_is(input, header->value, "chunked"))
+          return HTTP_STATUS_NOT_IMPLEMENTED;
+
+        chunked = true;
       }
-      break;
-    // default: // <- clang thinks this is unnecessary...
-    //   g_warning("%s:%d %s: unexpected header %d", __FILE__, __LINE__, __func__, header);
-    //   break;
-  }
+    }
 
-  char *ret = g_strdup(buffer);
+    // Content
+    const char *body        = input + parsed.header_length;
+    size_t      body_length = length - parsed.header_length;
 
-  g_free(buffer);
-  return ret;
-}
+    if (chunked) {
+      // Transfer-Encoding overrides Content-Length (RFC 7230 3.3.3)
+      size_t raw_length = 0;
+      size_t size       = 0;
 
-static uint8_t *http_extract_content(const char *http)
-{
-  if (!http)
-    return NULL;
+      enum HttpStatusCode status = http_chunked_walk(body, body_length, NULL, &raw_length, &size);
+      if (status != HTTP_STATUS_OK)
+        return status;
 
-  const char *content_start = g_strstr_len(http, -1, "\n\r\n");
-  if (!content_start)
-    return NULL;
+      request->decoded = teapot_arena_alloc(arena, MAX(size, 1));
+      http_chunked_walk(body, raw_length, request->decoded, &raw_length, &size);
 
-  char  *content_length_str = http_extract_header(http, HTTP_HEADER_CONTENT_LENGTH);
-  size_t content_length     = (size_t)toInteger(content_length_str);
+      request->content        = request->decoded;
+      request->content_length = size;
+      *consumed = parsed.header_length + raw_length;
 
-  uint8_t *ret = g_malloc(content_length);
-  memcpy(ret, content_start + strlen("\n\r\n"), content_length);
+      return HTTP_STATUS_OK;
+    }
 
-  g_free(content_length_str);
+    // Reject early rather than wait for a body which would be thrown away
+    if (request->content_length > max_body_size)
+      return HTTP_STATUS_PAYLOAD_TOO_LARGE;
 
-  return ret;
+    if (body_length < request->content_length)
+      return HTTP_STATUS_UNKNOWN;
+
+    request->content = (const uint8_t *)body;
+    *consumed = parsed.header_length + request->content_length;
+
+    return HTTP_STATUS_OK;
 }
 
 /**
- * Parse an HTTP string into `struct HttpRequest` for future processing.
+ * Format a time as an HTTP-date, i.e. IMF-fixdate (RFC 7231 7.1.1.1), e.g.
+ * "Sun, 06 Nov 1994 08:49:37 GMT". It must not depend on the locale.
  *
- * @param http [in] The HTTP string.
- * @return A `struct HttpRequest`.
+ * @return Length of the date.
  */
-static struct HttpRequest teapot_http_request_parse(const char *http)
+static size_t http_format_date(char *buf, size_t size, time_t t)
 {
-    struct HttpRequest request;
-    // Request line
-    request.method = http_extract_request_method(http);
-    request.path = http_extract_request_path(http);
-    request.version = http_extract_request_version(http);
+    struct tm tm;
+    gmtime_r(&t, &tm);
 
-    // Header fields
-    request.host = http_extract_header(http, HTTP_HOST);
-    request.content_type = http_extract_header(http, HTTP_CONTENT_TYPE);
-    request.content_length = (size_t)toInteger(http_extract_header(http, HTTP_HEADER_CONTENT_LENGTH));
-    request.expect = http_extract_header(http, HTTP_HEADER_EXPECT);
+    int length = snprintf(
+      buf, size,
+      "%s, %02d %s %04d %02d:%02d:%02d GMT",
+      http_day_names[tm.tm_wday], tm.tm_mday, http_month_names[tm.tm_mon], tm.tm_year + 1900,
+      tm.tm_hour, tm.tm_min, tm.tm_sec
+    );
 
-    // Content
-    request.content = http_extract_content(http);
-    return request;
+    return length < 0 ? 0 : MIN((size_t)length, size - 1);
 }
 
 /**
- * Convert a `struct HttpResponse` to an HTTP string for sending.
+ * Parse an HTTP-date. Only IMF-fixdate is understood: the obsolete formats
+ * have not been sent by any client in decades.
  *
- * @param response [in] The `struct HttpResponse` to convert.
- * @return A NUL-terminated string of HTTP response.
+ * @return true on success, false if the date is not understood.
  */
-static char *teapot_http_response_construct(size_t *size, const struct HttpResponse response)
+static bool http_parse_date(const char *input, struct TeapotHttpSpan span, time_t *t)
 {
-    size_t response_size = 0;
-    char buffer[16]; // < For store the content-length
+    const char *p = input + span.offset;
+    char month[4] = { 0 };
+    struct tm tm  = { 0 };
 
-    // Calculate the buffer size to allocate
-    response_size += strlen(http_status_to_string(response.status_code)) + strlen("\n");
+    // "Sun, 06 Nov 1994 08:49:37 GMT"
+    if (span.length != 29 || p[3] != ',' || memcmp(p + 25, " GMT", 4) != 0)
+      return false;
 
-    if (response.content_type) {
-      response_size += strlen("Content-Type: ") + strlen(response.content_type) + strlen("\n");
-    }
-    if (response.content_length) {
-      // Convert the integer content_length into string
-      snprintf(buffer, 16, "%zu", response.content_length);
+    char date[30];
+    memcpy(date, p, 29);
+    date[29] = '\0';
 
-      response_size += strlen("Content-Length: ") + strlen(buffer) + strlen("\n");
-    }
-    if (response.connection) {
-      response_size += strlen("Connection: ") + strlen(response.connection) + strlen("\n");
+    if (sscanf(date + 5, "%2d %3s %4d %2d:%2d:%2d", &tm.tm_mday, month, &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+      return false;
+
+    tm.tm_mon = -1;
+    for (int i = 0; i < 12; i++) {
+      if (strcmp(month, http_month_names[i]) == 0)
+        tm.tm_mon = i;
     }
-    if (response.location) {
-      response_size += strlen("Location: ") + strlen(response.location) + strlen("\n");
+    if (tm.tm_mon < 0)
+      return false;
+
+    tm.tm_year -= 1900;
+    *t = timegm(&tm);
+
+    return *t != (time_t)-1;
+}
+
+/**
+ * Modification time of a file, in whole seconds as in Last-Modified.
+ */
+static time_t http_file_mtime(const struct TeapotFile *file)
+{
+    return (time_t)(file->mtime / 1000000000);
+}
+
+/**
+ * Format the strong entity tag of a file, as sent in ETag.
+ *
+ * The tag is made of the identity of the file, which changes whenever the
+ * file does, so it costs nothing to compute. Each content coding is a
+ * different representation, and gets a tag of its own.
+ *
+ * @param coding [in] Content coding of the representation, NULL for identity.
+ * @return Length of the tag.
+ */
+static size_t http_format_etag(char *buf, size_t size, const struct TeapotFile *file, const char *coding)
+{
+    int length = snprintf(
+      buf, size,
+      "\"%" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER "x-%zx%s%s\"",
+      (guint64)file->inode, (guint64)file->mtime, file->size, coding ? "-" : "", coding ? coding : ""
+    );
+
+    return length < 0 ? 0 : MIN((size_t)length, size - 1);
+}
+
+/**
+ * Find a representation of a file in a list of entity tags, as in
+ * If-None-Match and If-Range.
+ *
+ * @param weak   [in]  Whether weak tags ("W/") may match (RFC 7232 2.3.2).
+ * @param coding [out] Content coding of the representation found.
+ * @return true if a tag matches the file, or the list is "*".
+ */
+static bool http_etag_matches(const char *input, struct TeapotHttpSpan span, const struct TeapotFile *file, bool weak, const char **coding)
+{
+    static const char *codings[] = { NULL, "gzip", "deflate" };
+
+    const char *p   = input + span.offset;
+    const char *end = p + span.length;
+
+    *coding = NULL;
+
+    if (span.length == 1 && *p == '*')
+      return true;
+
+    while (p < end) {
+      while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+        p++;
+
+      bool is_weak = end - p >= 2 && p[0] == 'W' && p[1] == '/';
+      if (is_weak)
+        p += 2;
+
+      if (p == end || *p != '"')
+        return false;
+
+      const char *tag = p;
+      const char *tag_end = memchr(p + 1, '"', (size_t)(end - p - 1));
+      if (!tag_end)
+        return false;
+      p = tag_end + 1;
+
+      if (is_weak && !weak)
+        continue;
+
+      for (size_t i = 0; i < G_N_ELEMENTS(codings); i++) {
+        char   etag[96];
+        size_t etag_length = http_format_etag(etag, sizeof(etag), file, codings[i]);
+
+        if ((size_t)(p - tag) == etag_length && memcmp(tag, etag, etag_length) == 0) {
+          *coding = codings[i];
+          return true;
+        }
+      }
     }
-    if (response.allow) {
-      response_size += strlen("Allow: ") + strlen(response.allow) + strlen("\n");
+
+    return false;
+}
+
+/**
+ * Tell whether the client already has the current version of a file, as
+ * told by If-None-Match or If-Modified-Since (RFC 7232 6).
+ *
+ * @param coding [out] Content coding of the representation the client has.
+ * @return true if a 304 is to be sent.
+ */
+static bool http_not_modified(const char *input, const struct HttpRequest *request, const struct TeapotFile *file, const char **coding)
+{
+    *coding = NULL;
+
+    // If-None-Match takes precedence when both are sent
+    if (request->if_none_match.length > 0)
+      return http_etag_matches(input, request->if_none_match, file, true, coding);
+
+    time_t since = 0;
+    if (request->if_modified_since.length > 0 && http_parse_date(input, request->if_modified_since, &since))
+      return http_file_mtime(file) <= since;
+
+    return false;
+}
+
+/**
+ * Tell whether the Range header of a request applies, as told by If-Range
+ * (RFC 7233 3.2).
+ *
+ * @param if_range [in] Value of If-Range, empty if there is none.
+ * @param file     [in] The file requested.
+ * @return true if the ranges are to be sent, false if the whole file is.
+ */
+static bool http_if_range_matches(const char *input, struct TeapotHttpSpan if_range, const struct TeapotFile *file)
+{
+    if (if_range.length == 0)
+      return true;
+
+    // Either an entity tag, which must match exactly...
+    const char *value = input + if_range.offset;
+    if (value[0] == '"' || (if_range.length >= 2 && value[0] == 'W' && value[1] == '/')) {
+      const char *coding = NULL;
+
+      return http_etag_matches(input, if_range, file, false, &coding) && coding == NULL;
     }
-    response_size += strlen("\r\n");
 
-    if (response.content) {
-      response_size += response.content_length;
+    // ... or the exact modification time
+    time_t date = 0;
+    return http_parse_date(input, if_range, &date) && date == http_file_mtime(file);
+}
+
+/**
+ * Turn a response into a 304 if the client already has the current version
+ * of a file.
+ *
+ * @return true if the response is a 304.
+ */
+static bool http_respond_not_modified(struct HttpResponse *response, const char *input, const struct HttpRequest *request, const struct TeapotFile *file)
+{
+    const char *coding = NULL;
+
+    if (!http_not_modified(input, request, file, &coding))
+      return false;
+
+    // Only the validators, and what the response would vary on (RFC 7232 4.1)
+    response->status_code = HTTP_STATUS_NOT_MODIFIED; ///< HTTP 304
+    response->validators  = file;
+    response->etag_coding = coding;
+    if (teapot_compress_eligible(file))
+      response->vary = "Accept-Encoding";
+
+    return true;
+}
+
+/**
+ * Format the Date header field of responses sent in this second.
+ *
+ * Formatting the date takes far longer than copying it, so each thread does
+ * it only once per second.
+ *
+ * @param buf [out] Where to put the line, at least HTTP_DATE_SIZE bytes.
+ * @return Length of the line.
+ */
+static size_t teapot_http_date(char *buf)
+{
+    static __thread gint64 cached_time = -1;
+    static __thread char   cached_line[HTTP_DATE_SIZE];
+    static __thread size_t cached_length = 0;
+
+    gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+
+    if (now != cached_time) {
+      cached_length  = (size_t)snprintf(cached_line, sizeof(cached_line), "Date: ");
+      cached_length += http_format_date(cached_line + cached_length, sizeof(cached_line) - cached_length, (time_t)now);
+      cached_length += (size_t)snprintf(cached_line + cached_length, sizeof(cached_line) - cached_length, "\r\n");
+      cached_time    = now;
     }
 
-    *size = response_size;
-    g_debug("Payload length %zu", response_size);
+    memcpy(buf, cached_line, cached_length);
+    return cached_length;
+}
+
+/**
+ * Append a piece of data to the output.
+ */
+static void teapot_http_output_push(struct TeapotHttpOutput *output, const void *data, size_t length)
+{
+    g_return_if_fail(output->n_iov < TEAPOT_HTTP_OUTPUT_IOV);
+
+    // writev() never writes to the buffers, it just does not say so
+    output->iov[output->n_iov].iov_base = (void *)(uintptr_t)data;
+    output->iov[output->n_iov].iov_len  = length;
+    output->n_iov++;
+    output->length += length;
+}
+
+/**
+ * Format a piece of data into the storage of the output, and append it.
+ */
+G_GNUC_PRINTF(2, 3)
+static void teapot_http_output_printf(struct TeapotHttpOutput *output, const char *format, ...)
+{
+    char  *buf   = output->buf + output->buf_length;
+    size_t space = sizeof(output->buf) - output->buf_length;
+
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buf, space, format, args);
+    va_end(args);
+
+    g_return_if_fail(length >= 0 && (size_t)length < space);
+
+    output->buf_length += (size_t)length;
+    teapot_http_output_push(output, buf, (size_t)length);
+}
+
+/**
+ * Append a header field to the output.
+ */
+static void teapot_http_output_field(struct TeapotHttpOutput *output, struct HttpLine name, const char *value)
+{
+    teapot_http_output_push(output, name.data, name.length);
+    teapot_http_output_push(output, value, strlen(value));
+    teapot_http_output_push(output, http_crlf.data, http_crlf.length);
+}
+
+/**
+ * Append part of a file (in memory or not) to the output as its body.
+ */
+static void teapot_http_output_slice(struct TeapotHttpOutput *output, const struct TeapotFile *file, size_t offset, size_t length)
+{
+    if (file->content) {
+      teapot_http_output_push(output, file->content + offset, length);
+    } else {
+      output->body_fd     = file->fd;
+      output->body_offset = (off_t)offset;
+      output->body_length = length;
+    }
+}
 
-    char *output = g_malloc(response_size + 1);
-    // NOTE: This is required for strcat() to work properly!
-    output[0] = '\0';
+/**
+ * Wrap a `struct HttpResponse` into a `struct TeapotHttpOutput` for sending.
+ *
+ * Nothing is copied: the output refers to the constant strings, the values in
+ * the response and the content, to be gathered by the kernel on sending.
+ *
+ * @param arena    [in] The arena to allocate the output from.
+ * @param response [in] The response. Header values must outlive the output.
+ * @param file     [in] The file the content belongs to, or NULL. The output
+ *                      takes over the reference.
+ */
+static struct TeapotHttpOutput *teapot_http_output_new(struct TeapotArena *arena, const struct HttpResponse *response, struct TeapotFile *file)
+{
+    struct TeapotHttpOutput *output = teapot_arena_new0(arena, struct TeapotHttpOutput);
+    output->body_fd = -1;
+    output->file    = file;
 
     // The first line
-    strcat(output, http_status_to_string(response.status_code));
+    const struct HttpLine *status = &http_status_lines[response->status_code];
+    teapot_http_output_push(output, status->data, status->length);
 
     // Header
-    if (response.content_type) {
-      strcat(output, "\nContent-Type: ");
-      strcat(output, response.content_type);
+    char *date = output->buf;
+    output->buf_length = teapot_http_date(date);
+    teapot_http_output_push(output, date, output->buf_length);
+
+    if (response->boundary)
+      teapot_http_output_printf(output, "Content-Type: multipart/byteranges; boundary=%s\r\n", response->boundary);
+    else if (response->content_type)
+      teapot_http_output_field(output, http_field_content_type, response->content_type);
+    if (response->status_code != HTTP_STATUS_NO_CONTENT && response->status_code != HTTP_STATUS_NOT_MODIFIED) {
+      // NOTE: this is always sent (even if it is 0), otherwise on a persistent
+      // connection the client cannot tell where the response ends
+      teapot_http_output_printf(output, "Content-Length: %zu\r\n", response->content_length);
     }
-    if (response.content_length) {
-      strcat(output, "\nContent-Length: ");
-      strcat(output, buffer);
+    if (response->content_range && response->status_code == HTTP_STATUS_RANGE_NOT_SATISFIABLE)
+      teapot_http_output_printf(output, "Content-Range: bytes */%zu\r\n", response->range_total);
+    else if (response->content_range)
+      teapot_http_output_printf(output, "Content-Range: bytes %zu-%zu/%zu\r\n", response->content_offset, response->content_offset + response->content_length - 1, response->range_total);
+    if (response->accept_ranges)
+      teapot_http_output_field(output, http_field_accept_ranges, response->accept_ranges);
+    if (response->validators) {
+      char validator[96];
+
+      http_format_etag(validator, sizeof(validator), response->validators, response->etag_coding);
+      teapot_http_output_printf(output, "ETag: %s\r\n", validator);
+      http_format_date(validator, sizeof(validator), http_file_mtime(response->validators));
+      teapot_http_output_printf(output, "Last-Modified: %s\r\n", validator);
     }
-    if (response.connection) {
-      strcat(output, "\nConnection: ");
-      strcat(output, response.connection);
-    }
-    if (response.location) {
-      strcat(output, "\nLocation: ");
-      strcat(output, response.location);
-    }
-    if (response.allow) {
-      strcat(output, "\nAllow: ");
-      strcat(output, response.allow);
+    if (response->content_encoding)
+      teapot_http_output_field(output, http_field_content_encoding, response->content_encoding);
+    if (response->vary)
+      teapot_http_output_field(output, http_field_vary, response->vary);
+    if (response->connection)
+      teapot_http_output_field(output, http_field_connection, response->connection);
+    if (response->allow)
+      teapot_http_output_field(output, http_field_allow, response->allow);
+
+    teapot_http_output_push(output, http_crlf.data, http_crlf.length);
+
+    teapot_trace("Header length %zu", output->length);
+
+    // The content follows the header, either from memory or from the file
+    if (response->content) {
+      teapot_http_output_push(output, response->content + response->content_offset, response->content_length);
+    } else if (file && !response->boundary) {
+      teapot_http_output_slice(output, file, response->content_offset, response->content_length);
     }
 
-    strcat(output, "\n\r\n");
+    return output;
+}
 
-    // Content
-    // NOTE: the content may not be ASCII string...
-    if (response.content) {
-      memcpy(output + strlen(output), response.content, response.content_length);
+/**
+ * Produce a redirection, around header fields serialized beforehand.
+ *
+ * @param arena      [in] The arena to allocate the output from.
+ * @param permanent  [in] Whether the redirection is 301 rather than 302.
+ * @param fields     [in] Header fields from `teapot_redir_route`. The output
+ *                        takes over the reference.
+ * @param length     [in] Length of fields.
+ * @param connection [in] Value of the Connection field.
+ */
+static struct TeapotHttpOutput *teapot_http_output_redirect(struct TeapotArena *arena, bool permanent, char *fields, size_t length, const char *connection)
+{
+    struct TeapotHttpOutput *output = teapot_arena_new0(arena, struct TeapotHttpOutput);
+    output->body_fd  = -1;
+    output->redirect = fields;
+
+    const struct HttpLine *status = &http_status_lines[permanent ? HTTP_STATUS_MOVED_PERMANENTLY : HTTP_STATUS_FOUND];
+    teapot_http_output_push(output, status->data, status->length);
+
+    char *date = output->buf;
+    output->buf_length = teapot_http_date(date);
+    teapot_http_output_push(output, date, output->buf_length);
+
+    teapot_http_output_push(output, fields, length);
+    teapot_http_output_field(output, http_field_connection, connection);
+    teapot_http_output_push(output, http_crlf.data, http_crlf.length);
+
+    return output;
+}
+
+/**
+ * Produce a multipart/byteranges response (RFC 7233 4.1).
+ *
+ * Each part goes into an output of its own, chained after the one with the
+ * header, so parts in a file are each sent without being copied, just like a
+ * whole file.
+ *
+ * @param arena    [in] The arena to allocate the outputs from.
+ * @param response [in] The response, with everything but the content set.
+ * @param file     [in] The file the ranges are of. The output takes over the
+ *                      reference.
+ * @param ranges   [in] The ranges to send.
+ * @param n_ranges [in] Number of ranges.
+ */
+static struct TeapotHttpOutput *teapot_http_output_multipart(struct TeapotArena *arena, struct HttpResponse *response, struct TeapotFile *file, const struct HttpRange *ranges, size_t n_ranges)
+{
+    struct TeapotHttpOutput *head = NULL;
+    struct TeapotHttpOutput **tail = &head;
+    size_t content_length = 0;
+
+    for (size_t i = 0; i < n_ranges; i++) {
+      struct TeapotHttpOutput *part = teapot_arena_new0(arena, struct TeapotHttpOutput);
+      part->body_fd = -1;
+      part->file    = teapot_file_ref(file);
+
+      teapot_http_output_printf(part, "\r\n--%s\r\n", response->boundary);
+      if (file->content_type)
+        teapot_http_output_field(part, http_field_content_type, file->content_type);
+      teapot_http_output_printf(part, "Content-Range: bytes %zu-%zu/%zu\r\n\r\n", ranges[i].first, ranges[i].last, file->size);
+      teapot_http_output_slice(part, file, ranges[i].first, ranges[i].last - ranges[i].first + 1);
+
+      content_length += part->length + part->body_length;
+      *tail = part;
+      tail  = &part->next;
     }
 
+    struct TeapotHttpOutput *closing = teapot_arena_new0(arena, struct TeapotHttpOutput);
+    closing->body_fd = -1;
+    teapot_http_output_printf(closing, "\r\n--%s--\r\n", response->boundary);
+
+    content_length += closing->length;
+    *tail = closing;
+
+    response->content_length = content_length;
+
+    struct TeapotHttpOutput *output = teapot_http_output_new(arena, response, file);
+    output->next = head;
+
     return output;
 }
 
 /********** Public APIs **********/
 
-char *teapot_http_process(size_t *size, const char *input)
+void teapot_http_init(size_t header_size, size_t body_size)
+{
+    max_header_size = header_size;
+    max_body_size   = body_size;
+}
+
+/**
+ * Fill the access log record of a response in. It goes on the last output of
+ * the response, so it is logged once the whole response is sent.
+ *
+ * @param request [in] The request, or NULL if it could not be parsed.
+ */
+static void teapot_http_output_record(struct TeapotHttpOutput *output, const struct HttpRequest *request, enum HttpStatusCode status_code)
+{
+    while (output->next)
+      output = output->next;
+
+    output->record.status = http_status_lines[status_code].code;
+
+    const char *method = request ? http_method_to_string(request->method) : NULL;
+    g_strlcpy(output->record.method, method ? method : "-", sizeof(output->record.method));
+    g_strlcpy(output->record.path, request ? request->path : "-", sizeof(output->record.path));
+    output->record.http_1_0 = request ? request->http_1_0 : false;
+}
+
+void teapot_http_output_release(struct TeapotHttpOutput *output)
+{
+    for (; output; output = output->next) {
+      teapot_file_unref(output->file);
+      output->file = NULL;
+
+      teapot_file_unref(output->origin);
+      output->origin = NULL;
+
+      if (output->redirect)
+        g_ref_string_release(output->redirect);
+      output->redirect = NULL;
+    }
+}
+
+struct TeapotHttpOutput *teapot_http_process(struct TeapotArena *arena, bool *keep_alive, size_t *consumed, const char *input, size_t length)
 {
     // get the request
-    struct HttpRequest request = teapot_http_request_parse(input);
+    struct HttpRequest request;
+    gint64 parse_started = teapot_metrics_now();
+    enum HttpStatusCode parsed = teapot_http_request_parse(arena, &request, input, length, consumed);
     // All the information sent by client is storing in request now.
 
+    if (parsed == HTTP_STATUS_UNKNOWN) {
+      *consumed = 0;
+      return NULL;
+    }
+
+    teapot_metrics_observe(TEAPOT_METRICS_STAGE_PARSE, parse_started);
+
+    if (parsed != HTTP_STATUS_OK) {
+      // We cannot tell where a rejected request ends, so nothing after it
+      // can be trusted
+      struct HttpResponse response = {
+        .status_code = parsed,
+        .connection  = "close",
+      };
+
+      const struct HttpLine *status = &http_status_lines[parsed];
+      teapot_trace("HTTP: rejecting request: %.*s", (int)status->length - 2, status->data);
+
+      *consumed   = length;
+      *keep_alive = false;
+
+      struct TeapotHttpOutput *output = teapot_http_output_new(arena, &response, NULL);
+      teapot_http_output_record(output, NULL, parsed);
+
+      return output;
+    }
 
     struct HttpResponse response;
 
     // --- Predefine the connection of the response ---
-    response.connection = "close";
+    // HTTP/1.1 connections are persistent unless the client asks otherwise,
+    // while HTTP/1.0 ones are closed unless the client asks to keep them
+    bool persistent = !request.http_1_0;
+    if (http_span_has_token(input, request.connection, "close"))
+      persistent = false;
+    else if (http_span_has_token(input, request.connection, "keep-alive"))
+      persistent = true;
+
+    *keep_alive = *keep_alive && persistent;
+    response.connection = *keep_alive ? "keep-alive" : "close";
     // below variables may be changed later
+    response.status_code = HTTP_STATUS_INTERNAL_SERVER_ERROR;
     response.content_type = NULL;
     response.content_length = 0;
-    response.location = NULL;
     response.allow = NULL;
+    response.content_encoding = NULL;
+    response.vary = NULL;
+    response.accept_ranges = NULL;
+    response.content_range = false;
+    response.range_total = 0;
+    response.boundary = NULL;
+    response.validators = NULL;
+    response.etag_coding = NULL;
     response.content = NULL;
+    response.file = NULL;
+    response.content_offset = 0;
     // ------------------------------------------------------------
 
     struct TeapotFile *file = NULL;
 
+    struct HttpRange ranges[HTTP_MAX_RANGES];
+    int  n_ranges = -1;
+    char boundary[32];
+
+    gint64 lookup_started = 0;
+
+    // Redirections are answered before anything is looked up: one walk down
+    // the routes, and a response which is mostly ready
+    if (request.method == HTTP_GET || request.method == HTTP_HEAD) {
+      bool   permanent     = false;
+      size_t fields_length = 0;
+      char  *fields        = teapot_redir_route(request.path, &permanent, &fields_length);
+
+      if (fields) {
+        gint64 build_started = teapot_metrics_now();
+        struct TeapotHttpOutput *output = teapot_http_output_redirect(arena, permanent, fields, fields_length, response.connection);
+
+        teapot_http_output_record(output, &request, permanent ? HTTP_STATUS_MOVED_PERMANENTLY : HTTP_STATUS_FOUND);
+        teapot_metrics_observe(TEAPOT_METRICS_STAGE_BUILD, build_started);
+
+        return output;
+      }
+    }
+
     switch (request.method) {
       case HTTP_GET:
-        // Do you want to direct to a new location? ->> 3XX response
-        if (teapot_redir_301_query(request.path) != NULL) {
-          // If the new location is not temporart ->> HTTP 301
-          response.status_code = HTTP_STATUS_MOVED_PERMANENTLY;
-          response.location = teapot_redir_301_query(request.path);
-          break;
-        } else if (teapot_redir_302_query(request.path) != NULL) {
-          // If the new location is temporart ->> HTTP 302
-          response.status_code = HTTP_STATUS_FOUND;
-          response.location = teapot_redir_302_query(request.path);
-          break;
+        // Revalidation only needs the metadata, never the content
+        if (request.if_none_match.length > 0 || request.if_modified_since.length > 0) {
+          lookup_started = teapot_metrics_now();
+          file = teapot_file_stat(request.path);
+          teapot_metrics_observe(TEAPOT_METRICS_STAGE_LOOKUP, lookup_started);
+
+          if (file && http_respond_not_modified(&response, input, &request, file))
+            break;
+
+          g_clear_pointer(&file, teapot_file_unref);
         }
 
-        file = teapot_file_read(request.path, 0, TEAPOT_FILE_READ_RANGE_FULL);
+        // Small files come from the cache and are shared without copying;
+        // large ones are only opened, and sent straight from the disk
+        lookup_started = teapot_metrics_now();
+        file = teapot_cache_get(request.path);
+        teapot_metrics_observe(TEAPOT_METRICS_STAGE_LOOKUP, lookup_started);
 
         if (file == NULL) { // If the file does not exist.
           response.status_code = HTTP_STATUS_NOT_FOUND; ///< HTTP 404
           response.content_type = "text/html; charset=utf8";
           response.content_length = strlen(http_status_not_found_html);
-          response.content = http_status_not_found_html;
+          response.content = (const uint8_t *)http_status_not_found_html;
         } else {
           response.status_code = HTTP_STATUS_OK; ///< HTTP 200
           response.content_type = file -> content_type;
           response.content_length = file -> size;
-          response.content = file -> content;
+          response.file = file;
+          response.accept_ranges = "bytes";
+          response.validators = file;
+
+          // The response depends on Accept-Encoding, even when sent as is
+          if (teapot_compress_eligible(file))
+            response.vary = "Accept-Encoding";
+
+          if (request.range.length > 0 && http_if_range_matches(input, request.if_range, file))
+            n_ranges = http_parse_ranges(input, request.range, file -> size, ranges);
+
+          if (n_ranges == 0) {
+            response.status_code = HTTP_STATUS_RANGE_NOT_SATISFIABLE; ///< HTTP 416
+            response.content_type = NULL;
+            response.content_length = 0;
+            response.content_range = true;
+            response.range_total = file -> size;
+            response.file = NULL;
+            response.validators = NULL;
+          } else if (n_ranges == 1) {
+            response.status_code = HTTP_STATUS_PARTIAL_CONTENT; ///< HTTP 206
+            response.content_offset = ranges[0].first;
+            response.content_length = ranges[0].last - ranges[0].first + 1;
+            response.content_range = true;
+            response.range_total = file -> size;
+          } else if (n_ranges > 1) {
+            response.status_code = HTTP_STATUS_PARTIAL_CONTENT; ///< HTTP 206
+            g_snprintf(boundary, sizeof(boundary), "teapot-%08x%08x", g_random_int(), g_random_int());
+            response.boundary = boundary;
+          } else if (response.vary) {
+            // Ranges are always of the file as is, so only whole files are
+            // compressed
+            enum TeapotEncoding encoding = teapot_compress_negotiate(input + request.accept_encoding.offset, request.accept_encoding.length);
+            struct TeapotFile *variant = NULL;
+            if (encoding != TEAPOT_ENCODING_IDENTITY)
+              variant = teapot_compress_get(request.path, file, encoding);
+
+            if (variant) {
+              // The type is still the one of the original file
+              response.content_length = variant -> size;
+              response.content_encoding = teapot_compress_encoding_to_string(encoding);
+              response.etag_coding = response.content_encoding;
+              response.file = variant;
+            }
+          }
         }
         break;
       case HTTP_HEAD:
-        if (teapot_redir_301_query(request.path) != NULL) {
-          // If the new location is not temporart ->> HTTP 301
-          response.status_code = HTTP_STATUS_MOVED_PERMANENTLY;
-          response.location = teapot_redir_301_query(request.path);
-          break;
-        } else if (teapot_redir_302_query(request.path) != NULL) {
-          // If the new location is temporart ->> HTTP 302
-          response.status_code = HTTP_STATUS_FOUND;
-          response.location = teapot_redir_302_query(request.path);
-          break;
-        }
-
-        file = teapot_file_read(request.path, 0, TEAPOT_FILE_READ_RANGE_FULL);
+        // Only the type and size of the file are needed
+        lookup_started = teapot_metrics_now();
+        file = teapot_file_stat(request.path);
+        teapot_metrics_observe(TEAPOT_METRICS_STAGE_LOOKUP, lookup_started);
 
         if (file == NULL) { // If the file does not exist.
           response.status_code = HTTP_STATUS_NOT_FOUND; ///< HTTP 404
-        } else {
+        } else if (!http_respond_not_modified(&response, input, &request, file)) {
           response.status_code = HTTP_STATUS_OK; ///< HTTP 200
           response.content_type = file -> content_type;
-          response.content_length = 0;
+          response.content_length = file -> size; // no content, but tell the length
+          response.accept_ranges = "bytes";
+          response.validators = file;
           response.content = NULL;
         }
         break;
@@ -573,10 +1309,23 @@ char *teapot_http_process(size_t *size, const char *input)
         break;
     }
 
-    size_t response_size = 0;
-    char *response_str = teapot_http_response_construct(&response_size, response);
-    // char *response_str = "HTTP/1.1 200 OK\nContent-Type: text/plain\nContent-Length: 12\n\nHello world!";
-    *size = response_size;
-    teapot_file_free(file);
-    return response_str;
+    gint64 build_started = teapot_metrics_now();
+    struct TeapotHttpOutput *output = NULL;
+    if (response.boundary)
+      output = teapot_http_output_multipart(arena, &response, response.file, ranges, (size_t)n_ranges);
+    else
+      output = teapot_http_output_new(arena, &response, response.file);
+
+    teapot_http_output_record(output, &request, response.status_code);
+    teapot_metrics_observe(TEAPOT_METRICS_STAGE_BUILD, build_started);
+
+    // The validators are formatted by now, but the type of a compressed
+    // variant or of a HEAD response is the one of the file looked up, which
+    // must outlive the output
+    if (response.file != file && file && response.content_type == file -> content_type)
+      output->origin = file;
+    else if (response.file != file)
+      teapot_file_unref(file);
+
+    return output;
 }
@@ -1,13 +1,91 @@
 #ifndef TEAPOT_HTTP_H
 #define TEAPOT_HTTP_H
 
+// C99 boolean
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <glib.h>
+#include "arena.h"
+#include "file.h"
+#include "log.h"
+
+/**
+ * Maximum number of pieces a response is gathered from.
+ */
+#define TEAPOT_HTTP_OUTPUT_IOV 32
+
+/**
+ * An HTTP response ready to be sent: the header, followed by the body.
+ *
+ * The status line, the header fields and a body in memory are kept as a list
+ * of pieces (`iov`), which are sent together without being copied. A body in
+ * an opened file (`body_fd`) follows them, and can be sent without being
+ * copied into userspace.
+ *
+ * A response may go on in further outputs chained after it (`next`), e.g.
+ * the parts of a multipart response.
+ */
+struct TeapotHttpOutput {
+  struct iovec   iov[TEAPOT_HTTP_OUTPUT_IOV]; ///< Pieces of the response in memory
+  int            n_iov;         ///< Number of pieces
+  size_t         length;        ///< Total length of the pieces
+  int            body_fd;       ///< File to send the body from, or -1
+  off_t          body_offset;   ///< Where the body starts in body_fd
+  size_t         body_length;   ///< Length of the body in body_fd
+  struct TeapotFile *file;      ///< The file the body belongs to, or NULL
+  struct TeapotFile *origin;    ///< The file whose type the header points to, when it is not the body's (a compressed variant, or a HEAD response), or NULL
+  char          *redirect;      ///< Header fields of a redirection (GRefString) the output points into, or NULL
+  struct TeapotHttpOutput *next; ///< Output to send right after this one, or NULL
+  GList          link;          ///< Link in the queue of outputs of a connection
+  char           buf[384];      ///< Storage for generated header fields
+  size_t         buf_length;    ///< Bytes used in buf
+  struct TeapotLogRecord record; ///< Access log record, on the last output of a response
+  int64_t        queued;        ///< When the response was queued, see `teapot_metrics_now`
+};
+
+/**
+ * Set the limits on requests.
+ *
+ * Requests over the limits are rejected as soon as this is known, before the
+ * rest of them is received.
+ *
+ * @param header_size [in] Maximum length of the request line and header.
+ * @param body_size   [in] Maximum length of the content (as sent, for chunked
+ *                         content).
+ */
+void teapot_http_init(size_t header_size, size_t body_size);
+
+/**
+ * Release what `struct TeapotHttpOutput`, and the outputs chained after it,
+ * hold (files, redirections). Their memory belongs to the arena they were
+ * allocated from, and goes when it is reset.
+ *
+ * @param output [in] The `struct TeapotHttpOutput` to release.
+ */
+void teapot_http_output_release(struct TeapotHttpOutput *output);
+
 /**
- * Given an HTTP request string, process it, and give an HTTP output.
+ * Given the bytes received from a client, process the first HTTP request in
+ * them, and give an HTTP output.
  *
- * @param size  [out] The size of the returned HTTP response
- * @param input [in]  The HTTP request given by the client
- * @return The HTTP response produced by the server, NULL on error
+ * @param arena      [in]     The arena to allocate the output (and whatever
+ *                            the request needs) from
+ * @param keep_alive [in,out] Whether the connection may be kept open after
+ *                            this request; set to whether it should be
+ * @param consumed   [out]    Length of the request (header and content)
+ * @param input      [in]     The bytes received from the client so far,
+ *                            possibly with pipelined requests following
+ * @param length     [in]     Number of bytes in input
+ * @return The HTTP response produced by the server, or NULL if the request has
+ *         not fully arrived yet. Release it with
+ *         `teapot_http_output_release` before resetting the arena.
  */
-char *teapot_http_process(size_t *size, const char *input);
+struct TeapotHttpOutput *teapot_http_process(struct TeapotArena *arena, bool *keep_alive, size_t *consumed, const char *input, size_t length);
 
 #endif
@@ -0,0 +1,293 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <glib.h>
+#include "log.h"
+
+/**
+ * Number of records a ring holds (a power of 2). Records pushed while the ring
+ * is full are dropped, so this should cover a burst of requests between two
+ * rounds of the writer.
+ */
+#define LOG_RING_SIZE 1024
+
+/**
+ * Size of the buffer lines are put together in before being written.
+ */
+#define LOG_BUFFER_SIZE (64 * 1024)
+
+/**
+ * Longest line a record may make (the path may be escaped to 4 times its
+ * length).
+ */
+#define LOG_LINE_MAX 1536
+
+/**
+ * How long the writer sleeps when there is nothing to write, in microseconds.
+ */
+#define LOG_INTERVAL (50 * 1000)
+
+/********** Internal types **********/
+
+/**
+ * A single-producer single-consumer ring of records.
+ *
+ * The producer (a reactor thread) only writes head, the consumer (the writer
+ * thread) only writes tail; each publishes its progress to the other with
+ * release stores, so neither ever waits for the other.
+ */
+struct TeapotLogRing {
+  guint head;     ///< Next slot to fill
+  gchar pad1[60]; ///< Keeps head and tail on cache lines of their own
+  guint tail;     ///< Next slot to drain
+  gchar pad2[60];
+
+  struct TeapotLogRecord records[LOG_RING_SIZE];
+};
+
+/********** Internal States **********/
+
+static gchar   *log_path = NULL;
+static gint     log_fd   = -1;
+static gboolean enabled  = FALSE;
+
+static gint reopen_requested = 0; ///< Set by teapot_log_reopen()
+static gint dropped          = 0; ///< Records dropped on full rings, ever
+
+static GMutex     rings_lock;
+static GPtrArray *rings = NULL; ///< Rings of all threads, never freed
+
+static __thread struct TeapotLogRing *thread_ring = NULL;
+
+static const char *log_month_names[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+/********** Private APIs **********/
+
+/**
+ * (Re)open the log file. The old file is kept if the new one cannot be opened.
+ */
+static bool teapot_log_open(void)
+{
+  if (strcmp(log_path, "-") == 0) {
+    log_fd = STDOUT_FILENO;
+    return true;
+  }
+
+  gint fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    g_warning("Log: failed to open %s: %s", log_path, g_strerror(errno));
+    return false;
+  }
+
+  if (log_fd >= 0 && log_fd != STDOUT_FILENO)
+    close(log_fd);
+  log_fd = fd;
+
+  return true;
+}
+
+static void teapot_log_write(const gchar *buf, gsize length)
+{
+  while (length > 0) {
+    gssize r = write(log_fd, buf, length);
+    if (r < 0 && errno == EINTR)
+      continue;
+
+    if (r < 0) {
+      g_warning("Log: failed to write %s: %s", log_path, g_strerror(errno));
+      return;
+    }
+
+    buf    += r;
+    length -= (gsize)r;
+  }
+}
+
+/**
+ * Format the time of a record as in the Common Log Format, e.g.
+ * "10/Oct/2000:13:55:36 +0000". Only called from the writer thread.
+ */
+static const gchar *teapot_log_time(gint64 time)
+{
+  static gint64 cached_second = -1;
+  static gchar  cached_time[32];
+
+  gint64 second = time / G_USEC_PER_SEC;
+  if (second != cached_second) {
+    time_t    t = (time_t)second;
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    snprintf(
+      cached_time, sizeof(cached_time), "%02d/%s/%04d:%02d:%02d:%02d +0000",
+      tm.tm_mday, log_month_names[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec
+    );
+    cached_second = second;
+  }
+
+  return cached_time;
+}
+
+/**
+ * Format a record into a line of the log:
+ *
+ *     client - - [time] "method path version" status bytes duration handling
+ *
+ * which is the Common Log Format followed by the durations, in microseconds.
+ *
+ * @param buf [out] Where to put the line, at least LOG_LINE_MAX bytes.
+ * @return Length of the line.
+ */
+static gsize teapot_log_format(gchar *buf, const struct TeapotLogRecord *record)
+{
+  // The path is as the client sent it, so it must not be able to forge lines
+  gchar path[sizeof(record->path) * 4];
+  gsize path_length = 0;
+
+  for (const gchar *p = record->path; *p; p++) {
+    guchar c = (guchar)*p;
+
+    if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\')
+      path_length += (gsize)snprintf(path + path_length, sizeof(path) - path_length, "\\x%02x", c);
+    else
+      path[path_length++] = (gchar)c;
+  }
+  path[path_length] = '\0';
+
+  gint length = snprintf(
+    buf, LOG_LINE_MAX,
+    "%s - - [%s] \"%s %s %s\" %u %zu %" G_GINT64_FORMAT " %" G_GINT64_FORMAT "\n",
+    record->client, teapot_log_time(record->time), record->method, path,
+    record->http_1_0 ? "HTTP/1.0" : "HTTP/1.1",
+    record->status, record->bytes, record->duration, record->handling
+  );
+
+  return length < 0 ? 0 : MIN((gsize)length, LOG_LINE_MAX - 1);
+}
+
+/**
+ * Main loop of the thread writing the log.
+ */
+static gpointer teapot_log_writer(gpointer data)
+{
+  (void) data;
+
+  gchar *buf      = g_malloc(LOG_BUFFER_SIZE);
+  gint   reported = 0;
+
+  for (;;) {
+    gsize length    = 0;
+    gsize n_records = 0;
+
+    if (g_atomic_int_compare_and_exchange(&reopen_requested, 1, 0) && teapot_log_open())
+      g_message("Log: reopened %s", log_path);
+
+    g_mutex_lock(&rings_lock);
+
+    for (guint i = 0; i < rings->len; i++) {
+      struct TeapotLogRing *ring = g_ptr_array_index(rings, i);
+      guint tail = ring->tail;
+      guint head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+      for (; tail != head; tail++) {
+        if (LOG_BUFFER_SIZE - length < LOG_LINE_MAX) {
+          teapot_log_write(buf, length);
+          length = 0;
+        }
+
+        length += teapot_log_format(buf + length, &ring->records[tail % LOG_RING_SIZE]);
+        n_records++;
+      }
+
+      // The slots may be reused from now on
+      __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    g_mutex_unlock(&rings_lock);
+
+    teapot_log_write(buf, length);
+
+    gint n_dropped = g_atomic_int_get(&dropped);
+    if (n_dropped != reported) {
+      g_warning("Log: %d records dropped, as the log could not keep up", n_dropped - reported);
+      reported = n_dropped;
+    }
+
+    if (n_records == 0)
+      g_usleep(LOG_INTERVAL);
+  }
+
+  return NULL;
+}
+
+/********** Public APIs **********/
+
+void teapot_log_init(const char *path)
+{
+  if (enabled) {
+    g_warning("Log: double initialization");
+    return;
+  }
+
+  if (!path || !*path) {
+    g_message("Log: access log disabled");
+    return;
+  }
+
+  log_path = g_strdup(path);
+  if (!teapot_log_open()) {
+    g_warning("Log: access log disabled");
+    g_clear_pointer(&log_path, g_free);
+    return;
+  }
+
+  rings   = g_ptr_array_new();
+  enabled = TRUE;
+
+  g_thread_unref(g_thread_new("log_writer", teapot_log_writer, NULL));
+
+  g_message("Log: access log in %s", log_path);
+}
+
+void teapot_log_attach(void)
+{
+  if (!enabled || thread_ring)
+    return;
+
+  thread_ring = g_new0(struct TeapotLogRing, 1);
+
+  g_mutex_lock(&rings_lock);
+  g_ptr_array_add(rings, thread_ring);
+  g_mutex_unlock(&rings_lock);
+}
+
+bool teapot_log_enabled(void)
+{
+  return enabled;
+}
+
+void teapot_log_push(const struct TeapotLogRecord *record)
+{
+  struct TeapotLogRing *ring = thread_ring;
+  if (!ring)
+    return;
+
+  guint head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE) {
+    g_atomic_int_inc(&dropped);
+    return;
+  }
+
+  ring->records[head % LOG_RING_SIZE] = *record;
+
+  // Publish the record to the writer
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void teapot_log_reopen(void)
+{
+  g_atomic_int_set(&reopen_requested, 1);
+}
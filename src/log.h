@@ -0,0 +1,75 @@
+#ifndef TEAPOT_LOG_H
+#define TEAPOT_LOG_H
+
+// C99 boolean
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+
+#include <glib.h>
+
+/**
+ * Messages on the hot path (every read, write, accepted connection, ...),
+ * compiled in only if TEAPOT_TRACE is defined (`make TRACE=1`). Everything
+ * worth knowing about a request goes into the access log instead.
+ */
+#ifdef TEAPOT_TRACE
+#define teapot_trace(...) g_debug(__VA_ARGS__)
+#else
+// Still type-checked, and uses the arguments, but never run
+#define teapot_trace(...) do { if (0) g_debug(__VA_ARGS__); } while (0)
+#endif
+
+/**
+ * One line of the access log, i.e. one request.
+ */
+struct TeapotLogRecord {
+  gint64 time;        ///< Wall-clock time the response was sent, in microseconds
+  gint64 duration;    ///< From the request arriving to the response sent, in microseconds
+  gint64 handling;    ///< Spent producing the response, in microseconds
+  gint64 started;     ///< Monotonic time the request arrived
+  gsize  bytes;       ///< Bytes of the response, header included
+  guint  status;      ///< Status code, 0 if there is no record
+  bool   http_1_0;    ///< Whether the request is of HTTP/1.0
+  gchar  client[64];  ///< "address:port" of the client
+  gchar  method[16];  ///< Method of the request, "-" if unknown
+  gchar  path[256];   ///< Requested path (truncated), "-" if unknown
+};
+
+/**
+ * Start the access log.
+ *
+ * Records are pushed by reactor threads into rings of their own, without
+ * locking, and written out in batches by a background thread.
+ *
+ * @param path [in] File to append the log to, "-" for the standard output, or
+ *                  NULL to disable the access log.
+ */
+void teapot_log_init(const char *path);
+
+/**
+ * Give the calling thread a ring to push records into. Records pushed by
+ * threads without one are dropped.
+ */
+void teapot_log_attach(void);
+
+/**
+ * Tell whether records are being logged at all.
+ */
+bool teapot_log_enabled(void);
+
+/**
+ * Log a request. Never blocks: if the ring of the thread is full, the record
+ * is dropped (and counted).
+ *
+ * @param record [in] The record, which is copied.
+ */
+void teapot_log_push(const struct TeapotLogRecord *record);
+
+/**
+ * Reopen the log file, e.g. after it has been rotated. This is async-signal
+ * safe; the file is reopened by the writer thread.
+ */
+void teapot_log_reopen(void);
+
+#endif
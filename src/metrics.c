@@ -0,0 +1,369 @@
+#include <time.h>
+#include <glib.h>
+#include "metrics.h"
+
+/**
+ * Histograms are HDR-style: each power of 2 is split into 2^METRICS_SUB_BITS
+ * buckets, which bounds the error of any value to 1/2^METRICS_SUB_BITS (12.5%)
+ * whatever its magnitude.
+ */
+#define METRICS_SUB_BITS 3
+#define METRICS_SUB      (1 << METRICS_SUB_BITS)
+
+/**
+ * Largest power of 2 (of nanoseconds) told apart; longer durations (over 18
+ * minutes) all go into the last bucket.
+ */
+#define METRICS_MAX_EXPONENT 40
+
+#define METRICS_BUCKETS ((METRICS_MAX_EXPONENT - METRICS_SUB_BITS + 2) * METRICS_SUB)
+
+/**
+ * Smallest bucket boundary exported, as a power of 2 of nanoseconds (~1 us).
+ */
+#define METRICS_MIN_EXPORTED_EXPONENT 10
+
+/**
+ * Status codes counted one by one; others are not counted.
+ */
+#define METRICS_MAX_STATUS 600
+
+/********** Internal types **********/
+
+/**
+ * A latency histogram.
+ */
+struct TeapotMetricsHistogram {
+  guint64 buckets[METRICS_BUCKETS]; ///< Number of values in each bucket
+  guint64 sum;                      ///< Sum of the values, in nanoseconds
+};
+
+/**
+ * Metrics of one thread. Only the thread writes to it; readers may see
+ * slightly stale values, which is fine for metrics.
+ */
+struct TeapotMetricsShard {
+  gchar   pad1[64]; ///< Keeps the shard off cache lines written by others
+
+  guint64 counters[TEAPOT_METRICS_COUNTERS];
+  guint64 statuses[METRICS_MAX_STATUS];
+  struct TeapotMetricsHistogram histograms[TEAPOT_METRICS_STAGES];
+
+  gchar   pad2[64];
+};
+
+/**
+ * A thread pool being watched.
+ */
+struct TeapotMetricsPool {
+  const char  *name;
+  const char  *listener;
+  GThreadPool *pool;
+};
+
+/********** Internal States **********/
+
+static gboolean enabled = FALSE;
+
+static GMutex     shards_lock;
+static GPtrArray *shards = NULL; ///< Shards of all threads, never freed
+
+/**
+ * Shard of the threads without one of their own (e.g. in thread pools, which
+ * come and go), written to with atomic operations.
+ */
+static struct TeapotMetricsShard shared_shard;
+static GArray    *pools  = NULL; ///< struct TeapotMetricsPool
+
+static __thread struct TeapotMetricsShard *thread_shard = NULL;
+
+static const char *stage_names[TEAPOT_METRICS_STAGES] = {
+  [TEAPOT_METRICS_STAGE_ACCEPT] = "accept",
+  [TEAPOT_METRICS_STAGE_HANDSHAKE] = "handshake",
+  [TEAPOT_METRICS_STAGE_PARSE]  = "parse",
+  [TEAPOT_METRICS_STAGE_LOOKUP] = "lookup",
+  [TEAPOT_METRICS_STAGE_BUILD]  = "build",
+  [TEAPOT_METRICS_STAGE_WRITE]  = "write",
+};
+
+/********** Private APIs **********/
+
+static struct TeapotMetricsShard *teapot_metrics_shard(void)
+{
+  return G_LIKELY(thread_shard) ? thread_shard : &shared_shard;
+}
+
+/**
+ * Add to a value of the shard of the calling thread. As nobody else writes
+ * to a shard of a thread, this needs no atomic read-modify-write; the relaxed
+ * accesses only keep readers from seeing torn values.
+ */
+static inline void teapot_metrics_add(guint64 *value, guint64 n)
+{
+  if (G_LIKELY(thread_shard))
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+  else
+    __atomic_fetch_add(value, n, __ATOMIC_RELAXED);
+}
+
+static inline guint64 teapot_metrics_read(const guint64 *value)
+{
+  return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Find the bucket of a value.
+ */
+static guint teapot_metrics_bucket(guint64 value)
+{
+  if (value < METRICS_SUB)
+    return (guint)value;
+
+  guint exponent = (guint)(63 - __builtin_clzll(value));
+  if (exponent > METRICS_MAX_EXPONENT)
+    return METRICS_BUCKETS - 1;
+
+  guint sub = (guint)(value >> (exponent - METRICS_SUB_BITS)) & (METRICS_SUB - 1);
+
+  return (exponent - METRICS_SUB_BITS + 1) * METRICS_SUB + sub;
+}
+
+/**
+ * Upper bound (exclusive) of a bucket.
+ */
+static guint64 teapot_metrics_bucket_upper(guint bucket)
+{
+  if (bucket < METRICS_SUB)
+    return bucket + 1;
+
+  guint exponent = bucket / METRICS_SUB + METRICS_SUB_BITS - 1;
+  guint64 sub    = bucket % METRICS_SUB;
+
+  return (METRICS_SUB + sub + 1) << (exponent - METRICS_SUB_BITS);
+}
+
+/**
+ * Find the value under which a fraction of the values of a histogram lie.
+ */
+static guint64 teapot_metrics_quantile(const struct TeapotMetricsHistogram *histogram, guint64 count, gdouble q)
+{
+  guint64 rank = (guint64)((gdouble)count * q);
+  guint64 seen = 0;
+
+  for (guint i = 0; i < METRICS_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen > rank)
+      return teapot_metrics_bucket_upper(i);
+  }
+
+  return 0;
+}
+
+/********** Public APIs **********/
+
+void teapot_metrics_init(bool enable)
+{
+  if (shards) {
+    g_warning("Metrics: double initialization");
+    return;
+  }
+
+  shards  = g_ptr_array_new();
+  pools   = g_array_new(FALSE, FALSE, sizeof(struct TeapotMetricsPool));
+  enabled = enable;
+
+  g_ptr_array_add(shards, &shared_shard);
+
+  g_message("Metrics: %s", enabled ? "enabled" : "disabled");
+}
+
+void teapot_metrics_attach(void)
+{
+  if (!enabled || thread_shard)
+    return;
+
+  thread_shard = g_new0(struct TeapotMetricsShard, 1);
+
+  g_mutex_lock(&shards_lock);
+  g_ptr_array_add(shards, thread_shard);
+  g_mutex_unlock(&shards_lock);
+}
+
+gint64 teapot_metrics_now(void)
+{
+  if (!enabled)
+    return 0;
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void teapot_metrics_count(enum TeapotMetricsCounter counter, guint64 n)
+{
+  if (!enabled)
+    return;
+
+  teapot_metrics_add(&teapot_metrics_shard()->counters[counter], n);
+}
+
+void teapot_metrics_status(guint code)
+{
+  if (!enabled || code >= METRICS_MAX_STATUS)
+    return;
+
+  teapot_metrics_add(&teapot_metrics_shard()->statuses[code], 1);
+}
+
+void teapot_metrics_observe(enum TeapotMetricsStage stage, gint64 since)
+{
+  if (!enabled || since == 0)
+    return;
+
+  gint64  now   = teapot_metrics_now();
+  guint64 value = now > since ? (guint64)(now - since) : 0;
+
+  struct TeapotMetricsHistogram *histogram = &teapot_metrics_shard()->histograms[stage];
+  teapot_metrics_add(&histogram->buckets[teapot_metrics_bucket(value)], 1);
+  teapot_metrics_add(&histogram->sum, value);
+}
+
+void teapot_metrics_watch_pool(const char *name, const char *listener, GThreadPool *pool)
+{
+  struct TeapotMetricsPool watched = {
+    .name     = name,
+    .listener = listener,
+    .pool     = pool,
+  };
+
+  g_mutex_lock(&shards_lock);
+  g_array_append_val(pools, watched);
+  g_mutex_unlock(&shards_lock);
+}
+
+GString *teapot_metrics_render(void)
+{
+  guint64 counters[TEAPOT_METRICS_COUNTERS] = { 0 };
+  guint64 statuses[METRICS_MAX_STATUS]      = { 0 };
+  struct TeapotMetricsHistogram *histograms = g_new0(struct TeapotMetricsHistogram, TEAPOT_METRICS_STAGES);
+
+  GString *out = g_string_sized_new(16 * 1024);
+
+  // Add the shards up
+  g_mutex_lock(&shards_lock);
+
+  for (guint i = 0; i < shards->len; i++) {
+    const struct TeapotMetricsShard *shard = g_ptr_array_index(shards, i);
+
+    for (guint c = 0; c < TEAPOT_METRICS_COUNTERS; c++)
+      counters[c] += teapot_metrics_read(&shard->counters[c]);
+    for (guint s = 0; s < METRICS_MAX_STATUS; s++)
+      statuses[s] += teapot_metrics_read(&shard->statuses[s]);
+    for (guint s = 0; s < TEAPOT_METRICS_STAGES; s++) {
+      for (guint b = 0; b < METRICS_BUCKETS; b++)
+        histograms[s].buckets[b] += teapot_metrics_read(&shard->histograms[s].buckets[b]);
+      histograms[s].sum += teapot_metrics_read(&shard->histograms[s].sum);
+    }
+  }
+
+  g_string_append(out, "# HELP teapot_thread_pool_queued Tasks waiting in a thread pool.\n");
+  g_string_append(out, "# TYPE teapot_thread_pool_queued gauge\n");
+  for (guint i = 0; i < pools->len; i++) {
+    const struct TeapotMetricsPool *watched = &g_array_index(pools, struct TeapotMetricsPool, i);
+    g_string_append_printf(out, "teapot_thread_pool_queued{pool=\"%s\",listener=\"%s\"} %u\n", watched->name, watched->listener, g_thread_pool_unprocessed(watched->pool));
+  }
+
+  g_string_append(out, "# HELP teapot_thread_pool_threads Threads running in a thread pool.\n");
+  g_string_append(out, "# TYPE teapot_thread_pool_threads gauge\n");
+  for (guint i = 0; i < pools->len; i++) {
+    const struct TeapotMetricsPool *watched = &g_array_index(pools, struct TeapotMetricsPool, i);
+    g_string_append_printf(out, "teapot_thread_pool_threads{pool=\"%s\",listener=\"%s\"} %u\n", watched->name, watched->listener, g_thread_pool_get_num_threads(watched->pool));
+  }
+
+  g_mutex_unlock(&shards_lock);
+
+  g_string_append_printf(
+    out,
+    "# HELP teapot_connections_accepted_total Connections accepted.\n"
+    "# TYPE teapot_connections_accepted_total counter\n"
+    "teapot_connections_accepted_total %" G_GUINT64_FORMAT "\n"
+    "# HELP teapot_connections_closed_total Connections closed.\n"
+    "# TYPE teapot_connections_closed_total counter\n"
+    "teapot_connections_closed_total %" G_GUINT64_FORMAT "\n"
+    "# HELP teapot_connections_shed_total Connections shed under overload.\n"
+    "# TYPE teapot_connections_shed_total counter\n"
+    "teapot_connections_shed_total %" G_GUINT64_FORMAT "\n"
+    "# HELP teapot_connections_open Connections open.\n"
+    "# TYPE teapot_connections_open gauge\n"
+    "teapot_connections_open %" G_GUINT64_FORMAT "\n"
+    "# HELP teapot_handshake_failures_total TLS handshakes which failed.\n"
+    "# TYPE teapot_handshake_failures_total counter\n"
+    "teapot_handshake_failures_total %" G_GUINT64_FORMAT "\n"
+    "# HELP teapot_tls_handshakes_total TLS handshakes completed, by whether the client offered to resume a session.\n"
+    "# TYPE teapot_tls_handshakes_total counter\n"
+    "teapot_tls_handshakes_total{resumption=\"offered\"} %" G_GUINT64_FORMAT "\n"
+    "teapot_tls_handshakes_total{resumption=\"none\"} %" G_GUINT64_FORMAT "\n"
+    "# HELP teapot_sent_bytes_total Bytes of responses sent.\n"
+    "# TYPE teapot_sent_bytes_total counter\n"
+    "teapot_sent_bytes_total %" G_GUINT64_FORMAT "\n",
+    counters[TEAPOT_METRICS_CONNECTIONS_ACCEPTED],
+    counters[TEAPOT_METRICS_CONNECTIONS_CLOSED],
+    counters[TEAPOT_METRICS_CONNECTIONS_SHED],
+    counters[TEAPOT_METRICS_CONNECTIONS_ACCEPTED] - MIN(counters[TEAPOT_METRICS_CONNECTIONS_CLOSED], counters[TEAPOT_METRICS_CONNECTIONS_ACCEPTED]),
+    counters[TEAPOT_METRICS_HANDSHAKE_FAILURES],
+    counters[TEAPOT_METRICS_HANDSHAKES_RESUMING],
+    counters[TEAPOT_METRICS_HANDSHAKES] - MIN(counters[TEAPOT_METRICS_HANDSHAKES_RESUMING], counters[TEAPOT_METRICS_HANDSHAKES]),
+    counters[TEAPOT_METRICS_BYTES_SENT]
+  );
+
+  g_string_append(out, "# HELP teapot_responses_total Responses sent, by status code.\n");
+  g_string_append(out, "# TYPE teapot_responses_total counter\n");
+  for (guint s = 0; s < METRICS_MAX_STATUS; s++) {
+    if (statuses[s] > 0)
+      g_string_append_printf(out, "teapot_responses_total{code=\"%u\"} %" G_GUINT64_FORMAT "\n", s, statuses[s]);
+  }
+
+  // Exported buckets are powers of 2, each covering whole internal buckets
+  g_string_append(out, "# HELP teapot_stage_duration_seconds Time spent in each stage of a request.\n");
+  g_string_append(out, "# TYPE teapot_stage_duration_seconds histogram\n");
+  for (guint s = 0; s < TEAPOT_METRICS_STAGES; s++) {
+    guint64 count = 0;
+    guint   b     = 0;
+
+    for (guint e = METRICS_MIN_EXPORTED_EXPONENT; e <= METRICS_MAX_EXPONENT; e++) {
+      guint64 bound = (guint64)1 << e;
+
+      for (; b < METRICS_BUCKETS - 1 && teapot_metrics_bucket_upper(b) <= bound; b++)
+        count += histograms[s].buckets[b];
+
+      g_string_append_printf(out, "teapot_stage_duration_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %" G_GUINT64_FORMAT "\n", stage_names[s], (gdouble)bound / 1e9, count);
+    }
+    for (; b < METRICS_BUCKETS; b++)
+      count += histograms[s].buckets[b];
+
+    g_string_append_printf(out, "teapot_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %" G_GUINT64_FORMAT "\n", stage_names[s], count);
+    g_string_append_printf(out, "teapot_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n", stage_names[s], (gdouble)histograms[s].sum / 1e9);
+    g_string_append_printf(out, "teapot_stage_duration_seconds_count{stage=\"%s\"} %" G_GUINT64_FORMAT "\n", stage_names[s], count);
+  }
+
+  // Quantiles, from the finer internal buckets
+  static const gdouble quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+  g_string_append(out, "# HELP teapot_stage_duration_quantile_seconds Quantiles of the time spent in each stage of a request, since startup.\n");
+  g_string_append(out, "# TYPE teapot_stage_duration_quantile_seconds gauge\n");
+  for (guint s = 0; s < TEAPOT_METRICS_STAGES; s++) {
+    guint64 count = 0;
+    for (guint b = 0; b < METRICS_BUCKETS; b++)
+      count += histograms[s].buckets[b];
+
+    for (gsize q = 0; q < G_N_ELEMENTS(quantiles); q++) {
+      guint64 value = teapot_metrics_quantile(&histograms[s], count, quantiles[q]);
+      g_string_append_printf(out, "teapot_stage_duration_quantile_seconds{stage=\"%s\",quantile=\"%g\"} %.9g\n", stage_names[s], quantiles[q], (gdouble)value / 1e9);
+    }
+  }
+
+  g_free(histograms);
+
+  return out;
+}
@@ -0,0 +1,96 @@
+#ifndef TEAPOT_METRICS_H
+#define TEAPOT_METRICS_H
+
+// C99 boolean
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+
+#include <glib.h>
+
+/**
+ * Counters.
+ */
+enum TeapotMetricsCounter {
+  TEAPOT_METRICS_CONNECTIONS_ACCEPTED, ///< Connections accepted
+  TEAPOT_METRICS_CONNECTIONS_CLOSED,   ///< Connections closed (for any reason)
+  TEAPOT_METRICS_CONNECTIONS_SHED,     ///< Connections not admitted, or dropped from a queue
+  TEAPOT_METRICS_HANDSHAKE_FAILURES,   ///< TLS handshakes which failed
+  TEAPOT_METRICS_HANDSHAKES,           ///< TLS handshakes which succeeded
+  TEAPOT_METRICS_HANDSHAKES_RESUMING,  ///< ... of which the client offered to resume a session
+  TEAPOT_METRICS_BYTES_SENT,           ///< Bytes of responses fully sent
+  TEAPOT_METRICS_COUNTERS,             ///< Number of counters
+};
+
+/**
+ * Stages a request goes through, each timed in a histogram.
+ */
+enum TeapotMetricsStage {
+  TEAPOT_METRICS_STAGE_ACCEPT, ///< From accepting a connection to its first bytes read
+  TEAPOT_METRICS_STAGE_HANDSHAKE, ///< TLS handshake, once started in the pool
+  TEAPOT_METRICS_STAGE_PARSE,  ///< Parsing a request
+  TEAPOT_METRICS_STAGE_LOOKUP, ///< Looking the requested file up
+  TEAPOT_METRICS_STAGE_BUILD,  ///< Building the response
+  TEAPOT_METRICS_STAGE_WRITE,  ///< From the response queued to its last byte written
+  TEAPOT_METRICS_STAGES,       ///< Number of stages
+};
+
+/**
+ * Initialize metrics.
+ *
+ * Metrics are recorded into per-thread shards without any synchronization,
+ * and only added up when rendered.
+ *
+ * @param enabled [in] Whether to record anything. When disabled, every
+ *                     function below does nothing (and does not read clocks).
+ */
+void teapot_metrics_init(bool enabled);
+
+/**
+ * Give the calling thread a shard of its own. Threads without one (meant for
+ * short-lived threads) share a shard, written to with atomic operations.
+ */
+void teapot_metrics_attach(void);
+
+/**
+ * Get the current time, to be passed to `teapot_metrics_observe` later.
+ *
+ * @return Monotonic time in nanoseconds, or 0 if metrics are disabled.
+ */
+gint64 teapot_metrics_now(void);
+
+/**
+ * Add to a counter.
+ */
+void teapot_metrics_count(enum TeapotMetricsCounter counter, guint64 n);
+
+/**
+ * Count a response sent, by its status code.
+ */
+void teapot_metrics_status(guint code);
+
+/**
+ * Record the time a stage took, from a time given by `teapot_metrics_now`
+ * until now.
+ *
+ * @param since [in] When the stage started. Nothing is recorded if it is 0.
+ */
+void teapot_metrics_observe(enum TeapotMetricsStage stage, gint64 since);
+
+/**
+ * Report the queue depth of a thread pool in the metrics.
+ *
+ * @param name     [in] Name of the pool in the metrics.
+ * @param listener [in] Name of the listener the pool works for.
+ * @param pool     [in] The pool, which must live forever, like the names.
+ */
+void teapot_metrics_watch_pool(const char *name, const char *listener, GThreadPool *pool);
+
+/**
+ * Add all the metrics up, in the Prometheus text format (version 0.0.4).
+ *
+ * @return The metrics. The caller should free it.
+ */
+GString *teapot_metrics_render(void);
+
+#endif
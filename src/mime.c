@@ -0,0 +1,186 @@
+#include <string.h>
+#include <stdlib.h>
+#include <glib.h>
+#include "mime.h"
+
+/********** Internal types **********/
+
+/**
+ * An entry of the MIME type table.
+ */
+struct TeapotMimeEntry {
+  char        extension[TEAPOT_MIME_MAX_EXTENSION + 1]; ///< In lower case, padded with NUL
+  const char *type;                                     ///< MIME type
+};
+
+/********** Internal States **********/
+
+/**
+ * Common types, sorted by extension (as compared by `teapot_mime_compare`).
+ */
+static const struct TeapotMimeEntry builtin_types[] = {
+  { "7z",          "application/x-7z-compressed" },
+  { "aac",         "audio/aac" },
+  { "apng",        "image/apng" },
+  { "avif",        "image/avif" },
+  { "bin",         "application/octet-stream" },
+  { "bmp",         "image/bmp" },
+  { "bz2",         "application/x-bzip2" },
+  { "css",         "text/css" },
+  { "csv",         "text/csv" },
+  { "doc",         "application/msword" },
+  { "docx",        "application/vnd.openxmlformats-officedocument.wordprocessingml.document" },
+  { "eot",         "application/vnd.ms-fontobject" },
+  { "epub",        "application/epub+zip" },
+  { "flac",        "audio/flac" },
+  { "gif",         "image/gif" },
+  { "gz",          "application/gzip" },
+  { "htm",         "text/html" },
+  { "html",        "text/html" },
+  { "ico",         "image/vnd.microsoft.icon" },
+  { "ics",         "text/calendar" },
+  { "jar",         "application/java-archive" },
+  { "jpeg",        "image/jpeg" },
+  { "jpg",         "image/jpeg" },
+  { "js",          "text/javascript" },
+  { "json",        "application/json" },
+  { "jsonld",      "application/ld+json" },
+  { "m4a",         "audio/mp4" },
+  { "md",          "text/markdown" },
+  { "mjs",         "text/javascript" },
+  { "mp3",         "audio/mpeg" },
+  { "mp4",         "video/mp4" },
+  { "mpeg",        "video/mpeg" },
+  { "oga",         "audio/ogg" },
+  { "ogg",         "audio/ogg" },
+  { "ogv",         "video/ogg" },
+  { "opus",        "audio/opus" },
+  { "otf",         "font/otf" },
+  { "pdf",         "application/pdf" },
+  { "png",         "image/png" },
+  { "rss",         "application/rss+xml" },
+  { "rtf",         "application/rtf" },
+  { "svg",         "image/svg+xml" },
+  { "tar",         "application/x-tar" },
+  { "tif",         "image/tiff" },
+  { "tiff",        "image/tiff" },
+  { "ttf",         "font/ttf" },
+  { "txt",         "text/plain" },
+  { "wasm",        "application/wasm" },
+  { "wav",         "audio/wav" },
+  { "weba",        "audio/webm" },
+  { "webm",        "video/webm" },
+  { "webmanifest", "application/manifest+json" },
+  { "webp",        "image/webp" },
+  { "woff",        "font/woff" },
+  { "woff2",       "font/woff2" },
+  { "xhtml",       "application/xhtml+xml" },
+  { "xml",         "application/xml" },
+  { "xz",          "application/x-xz" },
+  { "zip",         "application/zip" },
+};
+
+static const struct TeapotMimeEntry *mime_table   = builtin_types;
+static size_t                        mime_entries = G_N_ELEMENTS(builtin_types);
+static bool                          mime_sniff   = false;
+
+/********** Private APIs **********/
+
+static int teapot_mime_compare(const void *a, const void *b)
+{
+  return memcmp(
+    ((const struct TeapotMimeEntry *)a)->extension,
+    ((const struct TeapotMimeEntry *)b)->extension,
+    TEAPOT_MIME_MAX_EXTENSION + 1
+  );
+}
+
+/**
+ * Put the extension of a file name into the form it has in the table.
+ *
+ * @return false if the name has no extension, or one too long to be known.
+ */
+static bool teapot_mime_key(const char *filename, char key[TEAPOT_MIME_MAX_EXTENSION + 1])
+{
+  const char *dot   = strrchr(filename, '.');
+  const char *slash = strrchr(filename, '/');
+  if (!dot || (slash && slash > dot))
+    return false;
+
+  size_t length = strlen(dot + 1);
+  if (length == 0 || length > TEAPOT_MIME_MAX_EXTENSION)
+    return false;
+
+  memset(key, 0, TEAPOT_MIME_MAX_EXTENSION + 1);
+  for (size_t i = 0; i < length; i++)
+    key[i] = g_ascii_tolower(dot[1 + i]);
+
+  return true;
+}
+
+/********** Public APIs **********/
+
+void teapot_mime_init(GHashTable *types, bool sniff)
+{
+  mime_sniff = sniff;
+
+  if (!types || g_hash_table_size(types) == 0) {
+    g_message("MIME: %zu types%s", mime_entries, mime_sniff ? ", sniffing the rest" : "");
+    return;
+  }
+
+  // Configured types replace compiled-in ones of the same extension
+  size_t n = g_hash_table_size(types) + G_N_ELEMENTS(builtin_types);
+  struct TeapotMimeEntry *table = g_new0(struct TeapotMimeEntry, n);
+  size_t n_entries = 0;
+
+  GHashTableIter iter;
+  gpointer extension, type;
+  g_hash_table_iter_init(&iter, types);
+  while (g_hash_table_iter_next(&iter, &extension, &type)) {
+    struct TeapotMimeEntry *entry = &table[n_entries];
+    gchar *name = g_strconcat(".", extension, NULL);
+
+    if (!teapot_mime_key(name, entry->extension)) {
+      g_warning("MIME: invalid extension \"%s\", ignored", (const char *)extension);
+      g_free(name);
+      continue;
+    }
+    g_free(name);
+
+    entry->type = g_strdup(type);
+    n_entries++;
+  }
+
+  size_t n_configured = n_entries;
+  qsort(table, n_configured, sizeof(*table), teapot_mime_compare);
+
+  for (size_t i = 0; i < G_N_ELEMENTS(builtin_types); i++) {
+    if (!bsearch(&builtin_types[i], table, n_configured, sizeof(*table), teapot_mime_compare))
+      table[n_entries++] = builtin_types[i];
+  }
+
+  qsort(table, n_entries, sizeof(*table), teapot_mime_compare);
+
+  // The previous table, if any, is never freed: lookups may be running on it
+  mime_table   = table;
+  mime_entries = n_entries;
+
+  g_message("MIME: %zu types%s", mime_entries, mime_sniff ? ", sniffing the rest" : "");
+}
+
+const char *teapot_mime_type(const char *filename)
+{
+  struct TeapotMimeEntry key;
+  if (!teapot_mime_key(filename, key.extension))
+    return NULL;
+
+  const struct TeapotMimeEntry *entry = bsearch(&key, mime_table, mime_entries, sizeof(key), teapot_mime_compare);
+
+  return entry ? entry->type : NULL;
+}
+
+bool teapot_mime_sniffing(void)
+{
+  return mime_sniff;
+}
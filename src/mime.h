@@ -0,0 +1,47 @@
+#ifndef TEAPOT_MIME_H
+#define TEAPOT_MIME_H
+
+// C99 boolean
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+
+#include <glib.h>
+
+/**
+ * Longest file name extension known to the MIME table.
+ */
+#define TEAPOT_MIME_MAX_EXTENSION 11
+
+/**
+ * Initialize the MIME type table.
+ *
+ * A table of common types is compiled in; entries given here are added to
+ * it, replacing compiled-in ones of the same extension.
+ *
+ * @param types [in] Extension (without the dot, e.g. "html") -> MIME type. The
+ *                   table is copied, so it may be freed afterwards. NULL for
+ *                   no additional types.
+ * @param sniff [in] Whether files of unknown extensions are sniffed (by GIO,
+ *                   from their content).
+ */
+void teapot_mime_init(GHashTable *types, bool sniff);
+
+/**
+ * Find the MIME type of a file from its name.
+ *
+ * This is a binary search over a sorted table, without allocating memory. It
+ * may be called before `teapot_mime_init`, in which case only the compiled-in
+ * table is used.
+ *
+ * @param filename [in] Name (or path) of the file.
+ * @return The MIME type, or NULL if the extension is unknown.
+ */
+const char *teapot_mime_type(const char *filename);
+
+/**
+ * Tell whether files of unknown extensions are to be sniffed.
+ */
+bool teapot_mime_sniffing(void);
+
+#endif
@@ -0,0 +1,192 @@
+#include <string.h>
+#include <glib.h>
+#include "parser.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/********** Private APIs **********/
+
+/**
+ * Find the first occurrence of either of two bytes.
+ *
+ * With SSE2 (and AVX2, if enabled at compile time) 16 (32) bytes are looked
+ * at in one go; the rest is scanned byte by byte.
+ *
+ * @return Pointer to the byte found, or end if there is none.
+ */
+static const char *teapot_parser_find(const char *p, const char *end, char a, char b)
+{
+#if defined(__AVX2__)
+  const __m256i a32 = _mm256_set1_epi8(a);
+  const __m256i b32 = _mm256_set1_epi8(b);
+
+  while (end - p >= 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)(const void *)p);
+    __m256i match = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, a32), _mm256_cmpeq_epi8(chunk, b32));
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(match);
+
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 32;
+  }
+#endif
+
+#if defined(__SSE2__)
+  const __m128i a16 = _mm_set1_epi8(a);
+  const __m128i b16 = _mm_set1_epi8(b);
+
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(const void *)p);
+    __m128i match = _mm_or_si128(_mm_cmpeq_epi8(chunk, a16), _mm_cmpeq_epi8(chunk, b16));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(match);
+
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#endif
+
+  while (p < end && *p != a && *p != b)
+    p++;
+
+  return p;
+}
+
+/**
+ * Find the end of a line, i.e. the CR of a CRLF, or a bare LF.
+ *
+ * @param eol  [out] Where the line ends.
+ * @param next [out] Where the next line starts.
+ * @return TEAPOT_PARSER_DONE if the line is complete, TEAPOT_PARSER_INCOMPLETE
+ *         if it has not fully arrived, TEAPOT_PARSER_INVALID if it has a stray
+ *         CR in it.
+ */
+static enum TeapotParserResult teapot_parser_line(const char *p, const char *end, const char **eol, const char **next)
+{
+  p = teapot_parser_find(p, end, '\r', '\n');
+  if (p == end)
+    return TEAPOT_PARSER_INCOMPLETE;
+
+  if (*p == '\r') {
+    if (p + 1 == end)
+      return TEAPOT_PARSER_INCOMPLETE;
+    if (p[1] != '\n')
+      return TEAPOT_PARSER_INVALID;
+  }
+
+  *eol  = p;
+  *next = p + (*p == '\r' ? 2 : 1);
+  return TEAPOT_PARSER_DONE;
+}
+
+static struct TeapotHttpSpan teapot_parser_span(const char *input, const char *start, const char *stop)
+{
+  struct TeapotHttpSpan span = {
+    .offset = (size_t)(start - input),
+    .length = (size_t)(stop - start),
+  };
+
+  return span;
+}
+
+/********** Public APIs **********/
+
+enum TeapotParserResult teapot_parser_parse(struct TeapotHttpRequest *request, const char *input, size_t length)
+{
+  const char *p   = input;
+  const char *end = input + length;
+  const char *eol = NULL;
+  enum TeapotParserResult r = TEAPOT_PARSER_DONE;
+
+  request->n_headers = 0;
+
+  // Empty lines before the request line are to be ignored (RFC 7230 3.5)
+  while (p < end && (*p == '\r' || *p == '\n'))
+    p++;
+
+  // Method: a token ending with a space
+  const char *method = p;
+  while (p < end && *p != ' ' && *p != '\r' && *p != '\n')
+    p++;
+  if (p == end)
+    return TEAPOT_PARSER_INCOMPLETE;
+  if (*p != ' ' || p == method)
+    return TEAPOT_PARSER_INVALID;
+  request->method = teapot_parser_span(input, method, p);
+  p++;
+
+  // Target: anything up to the next space
+  const char *target = p;
+  p = teapot_parser_find(p, end, ' ', '\n');
+  if (p == end)
+    return TEAPOT_PARSER_INCOMPLETE;
+  if (*p != ' ' || p == target)
+    return TEAPOT_PARSER_INVALID;
+  request->target = teapot_parser_span(input, target, p);
+  p++;
+
+  // Version: the rest of the line
+  const char *version = p;
+  r = teapot_parser_line(p, end, &eol, &p);
+  if (r != TEAPOT_PARSER_DONE)
+    return r;
+  if (eol == version)
+    return TEAPOT_PARSER_INVALID;
+  request->version = teapot_parser_span(input, version, eol);
+
+  // Header fields, until an empty line
+  for (;;) {
+    if (p == end)
+      return TEAPOT_PARSER_INCOMPLETE;
+
+    if (*p == '\n' || *p == '\r') {
+      r = teapot_parser_line(p, end, &eol, &p);
+      if (r != TEAPOT_PARSER_DONE)
+        return r;
+      break;
+    }
+
+    // Line folding is obsolete, and may be rejected (RFC 7230 3.2.4)
+    if (*p == ' ' || *p == '\t')
+      return TEAPOT_PARSER_INVALID;
+
+    const char *name  = p;
+    const char *colon = teapot_parser_find(p, end, ':', '\n');
+    if (colon == end)
+      return TEAPOT_PARSER_INCOMPLETE;
+    // No whitespace is allowed between the name and the colon either
+    if (*colon != ':' || colon == name || colon[-1] == ' ' || colon[-1] == '\t')
+      return TEAPOT_PARSER_INVALID;
+
+    const char *value = colon + 1;
+    r = teapot_parser_line(value, end, &eol, &p);
+    if (r != TEAPOT_PARSER_DONE)
+      return r;
+
+    if (request->n_headers == TEAPOT_PARSER_MAX_HEADERS)
+      return TEAPOT_PARSER_TOO_LARGE;
+
+    // Strip optional whitespace around the value
+    while (value < eol && (*value == ' ' || *value == '\t'))
+      value++;
+    while (eol > value && (eol[-1] == ' ' || eol[-1] == '\t'))
+      eol--;
+
+    struct TeapotHttpHeader *header = &request->headers[request->n_headers++];
+    header->name  = teapot_parser_span(input, name, colon);
+    header->value = teapot_parser_span(input, value, eol);
+  }
+
+  request->header_length = (size_t)(p - input);
+
+  return TEAPOT_PARSER_DONE;
+}
+
+bool teapot_parser_span_is(const char *input, struct TeapotHttpSpan span, const char *str)
+{
+  return strlen(str) == span.length && g_ascii_strncasecmp(input + span.offset, str, span.length) == 0;
+}
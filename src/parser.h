@@ -0,0 +1,82 @@
+#ifndef TEAPOT_PARSER_H
+#define TEAPOT_PARSER_H
+
+// C99 boolean
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+
+#include <stddef.h>
+
+/**
+ * Maximum number of header fields in a request.
+ */
+#define TEAPOT_PARSER_MAX_HEADERS 64
+
+/**
+ * A piece of the request, located in the buffer the request was parsed from.
+ */
+struct TeapotHttpSpan {
+  size_t offset; ///< Where the piece starts in the buffer
+  size_t length; ///< Length of the piece
+};
+
+/**
+ * A header field of a request.
+ */
+struct TeapotHttpHeader {
+  struct TeapotHttpSpan name;  ///< Field name, as sent by the client
+  struct TeapotHttpSpan value; ///< Field value, without surrounding spaces
+};
+
+/**
+ * The request line and header fields of a parsed request.
+ *
+ * Nothing is copied: everything refers to the buffer the request was parsed
+ * from, which must be kept while the request is in use.
+ */
+struct TeapotHttpRequest {
+  struct TeapotHttpSpan method;  ///< e.g. "GET"
+  struct TeapotHttpSpan target;  ///< e.g. "/index.html"
+  struct TeapotHttpSpan version; ///< e.g. "HTTP/1.1"
+
+  struct TeapotHttpHeader headers[TEAPOT_PARSER_MAX_HEADERS]; ///< Header fields, in order
+  size_t n_headers;     ///< Number of header fields
+
+  size_t header_length; ///< Length of the request line and header, including the empty line
+};
+
+/**
+ * Result of `teapot_parser_parse`.
+ */
+enum TeapotParserResult {
+  TEAPOT_PARSER_DONE,       ///< The header has fully arrived and is parsed
+  TEAPOT_PARSER_INCOMPLETE, ///< More bytes are needed
+  TEAPOT_PARSER_INVALID,    ///< The request is malformed
+  TEAPOT_PARSER_TOO_LARGE,  ///< The request has too many header fields
+};
+
+/**
+ * Parse the request line and header of an HTTP request.
+ *
+ * The buffer is scanned once, front to back, without allocating memory.
+ * Both CRLF and bare LF line endings are accepted.
+ *
+ * @param request [out] Where to record the request.
+ * @param input   [in]  The bytes received from the client.
+ * @param length  [in]  Number of bytes in input.
+ * @return See `enum TeapotParserResult`.
+ */
+enum TeapotParserResult teapot_parser_parse(struct TeapotHttpRequest *request, const char *input, size_t length);
+
+/**
+ * Compare a span of the buffer to a string, ignoring case.
+ *
+ * @param input [in] The buffer the span refers to.
+ * @param span  [in] The span to compare.
+ * @param str   [in] The string to compare to.
+ * @return true if they are equal.
+ */
+bool teapot_parser_span_is(const char *input, struct TeapotHttpSpan span, const char *str);
+
+#endif
@@ -0,0 +1,360 @@
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <glib.h>
+#include "connection.h"
+#include "log.h"
+#include "metrics.h"
+#include "reactor.h"
+#include "redir.h"
+
+/**
+ * Maximum number of events handled in one round of epoll_wait().
+ */
+#define MAX_EVENTS 256
+
+/********** Internal types **********/
+
+/**
+ * A reactor: one thread, one epoll instance.
+ */
+struct TeapotReactor {
+  guint        id;         ///< Index of the reactor, for logging
+  gint         epoll_fd;   ///< The epoll instance
+  gint         event_fd;   ///< Wakes the reactor up when connections arrive
+  GAsyncQueue *incoming;   ///< Connections dispatched but not registered yet
+  GQueue       idle;       ///< Connections, least recently active first
+};
+
+/********** Internal States **********/
+
+static struct TeapotReactor *reactors = NULL;
+static guint n_reactors   = 0;
+static gint  next_reactor = 0;
+static gint64 idle_timeout = 0; ///< In microseconds
+
+static bool      affinity = false; ///< Whether threads are pinned to processors
+static cpu_set_t allowed;          ///< Processors the process may run on
+static guint     n_allowed = 0;
+
+/********** Private APIs **********/
+
+/**
+ * Translate the state of a connection into epoll events to wait for.
+ */
+static guint32 teapot_reactor_interest(enum TeapotConnectionState state)
+{
+  return state == TEAPOT_CONNECTION_WRITING ? EPOLLOUT : EPOLLIN;
+}
+
+/**
+ * Mark a connection as active just now.
+ *
+ * Since the timeout is the same for every connection, moving the connection to
+ * the tail keeps the idle queue sorted by expiry time.
+ */
+static void teapot_reactor_touch(struct TeapotReactor *reactor, struct TeapotConnection *conn)
+{
+  conn->last_active = g_get_monotonic_time();
+
+  g_queue_unlink(&reactor->idle, &conn->idle_link);
+  g_queue_push_tail_link(&reactor->idle, &conn->idle_link);
+}
+
+/**
+ * Stop driving a connection and free it.
+ */
+static void teapot_reactor_close(struct TeapotReactor *reactor, struct TeapotConnection *conn)
+{
+  // Stop watching before the fd is closed (and possibly reused)
+  epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  g_queue_unlink(&reactor->idle, &conn->idle_link);
+  teapot_connection_free(conn);
+}
+
+/**
+ * Close the connections which have been idle for too long.
+ *
+ * @return Milliseconds until the next connection expires, or -1 if there is
+ *         no connection (or no timeout).
+ */
+static int teapot_reactor_expire(struct TeapotReactor *reactor)
+{
+  gint64 now = g_get_monotonic_time();
+  GList *head = NULL;
+
+  if (idle_timeout == 0)
+    return -1;
+
+  while ((head = g_queue_peek_head_link(&reactor->idle))) {
+    struct TeapotConnection *conn = head->data;
+    gint64 expiry = conn->last_active + idle_timeout;
+
+    if (expiry > now)
+      return (int)((expiry - now + 999) / 1000);
+
+    teapot_trace("%s: %s idle for too long", conn->protocol, conn->peer);
+    teapot_reactor_close(reactor, conn);
+  }
+
+  return -1;
+}
+
+/**
+ * Register connections handed over by other threads into the epoll instance.
+ */
+static void teapot_reactor_accept_incoming(struct TeapotReactor *reactor)
+{
+  guint64 counter = 0;
+  struct TeapotConnection *conn = NULL;
+
+  // Reset the eventfd counter; it is non-blocking so this never hangs
+  if (read(reactor->event_fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN)
+    g_warning("Reactor %u: failed to read eventfd: %s", reactor->id, g_strerror(errno));
+
+  while ((conn = g_async_queue_try_pop(reactor->incoming))) {
+    struct epoll_event event = {
+      .events   = teapot_reactor_interest(conn->state),
+      .data.ptr = conn,
+    };
+
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) < 0) {
+      g_warning("Reactor %u: failed to watch connection: %s", reactor->id, g_strerror(errno));
+      teapot_connection_free(conn);
+      continue;
+    }
+
+    conn->last_active = g_get_monotonic_time();
+    g_queue_push_tail_link(&reactor->idle, &conn->idle_link);
+  }
+}
+
+/**
+ * Run one event of a connection through its state machine.
+ */
+static void teapot_reactor_handle(struct TeapotReactor *reactor, struct TeapotConnection *conn, guint32 events)
+{
+  enum TeapotConnectionState before = conn->state;
+  enum TeapotConnectionState after  = teapot_connection_handle(conn, events);
+
+  if (after == TEAPOT_CONNECTION_CLOSED) {
+    teapot_reactor_close(reactor, conn);
+    return;
+  }
+
+  teapot_reactor_touch(reactor, conn);
+
+  if (teapot_reactor_interest(before) != teapot_reactor_interest(after)) {
+    struct epoll_event event = {
+      .events   = teapot_reactor_interest(after),
+      .data.ptr = conn,
+    };
+
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) < 0) {
+      g_warning("Reactor %u: failed to update connection: %s", reactor->id, g_strerror(errno));
+      teapot_reactor_close(reactor, conn);
+    }
+  }
+}
+
+/**
+ * Wake a reactor up, for it to take the connections handed over.
+ */
+static void teapot_reactor_wake(struct TeapotReactor *reactor)
+{
+  guint64 one = 1;
+  if (write(reactor->event_fd, &one, sizeof(one)) < 0)
+    g_warning("Reactor %u: failed to write eventfd: %s", reactor->id, g_strerror(errno));
+}
+
+/**
+ * Pick a reactor of a shard, going round them.
+ */
+static guint teapot_reactor_pick(guint shard, guint n_shards)
+{
+  // Each dispatching thread goes round its reactors by itself, sharing
+  // nothing with the other shards
+  static __thread guint round = 0;
+  guint index = shard % n_reactors;
+
+  if (n_shards < n_reactors) {
+    guint n_own = (n_reactors - shard + n_shards - 1) / n_shards;
+    index = shard + (round++ % n_own) * n_shards;
+  }
+
+  return index;
+}
+
+/**
+ * Hand a connection over to the given reactor, and wake it up.
+ */
+static void teapot_reactor_push(struct TeapotReactor *reactor, struct TeapotConnection *conn)
+{
+  g_async_queue_push(reactor->incoming, conn);
+  teapot_reactor_wake(reactor);
+}
+
+/**
+ * Main loop of a reactor thread.
+ */
+static gpointer teapot_reactor_run(struct TeapotReactor *reactor)
+{
+  struct epoll_event events[MAX_EVENTS];
+  int timeout = -1;
+
+  g_debug("Reactor %u: running", reactor->id);
+
+  // The connections of the acceptor pinned to the same processor come here
+  teapot_reactor_pin(reactor->id);
+
+  // Requests served by this thread are logged through a ring of its own, and
+  // counted in a shard of its own
+  teapot_log_attach();
+  teapot_metrics_attach();
+
+  // Redirections are read without locking; waiting for events is the
+  // quiescent state after which replaced ones may be freed
+  teapot_redir_attach();
+
+  for (;;) {
+    teapot_redir_offline();
+    int n = epoll_wait(reactor->epoll_fd, events, MAX_EVENTS, timeout);
+    teapot_redir_online();
+
+    if (n < 0) {
+      if (errno != EINTR)
+        g_warning("Reactor %u: epoll_wait failed: %s", reactor->id, g_strerror(errno));
+      continue;
+    }
+
+    for (int i = 0; i < n; i++) {
+      // The eventfd is registered with a NULL pointer
+      if (!events[i].data.ptr)
+        teapot_reactor_accept_incoming(reactor);
+      else
+        teapot_reactor_handle(reactor, events[i].data.ptr, events[i].events);
+    }
+
+    // Sleep no longer than the first idle connection may live
+    timeout = teapot_reactor_expire(reactor);
+  }
+
+  return NULL;
+}
+
+/********** Public APIs **********/
+
+void teapot_reactor_init(guint n_threads, guint timeout, bool pin)
+{
+  if (reactors) {
+    g_warning("Reactor: double initialization");
+    return;
+  }
+
+  if (n_threads == 0)
+    n_threads = g_get_num_processors();
+
+  g_message("Reactor: starting %u threads", n_threads);
+
+  reactors     = g_new0(struct TeapotReactor, n_threads);
+  n_reactors   = n_threads;
+  idle_timeout = (gint64)timeout * G_USEC_PER_SEC;
+
+  // Threads are pinned to the processors the process is allowed on (e.g.
+  // by taskset or a cgroup), in order
+  if (pin) {
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0 && CPU_COUNT(&allowed) > 0) {
+      affinity  = true;
+      n_allowed = (guint)CPU_COUNT(&allowed);
+      g_message("Reactor: pinning threads to %u processors", n_allowed);
+    } else {
+      g_warning("Reactor: cannot tell the processors to pin threads to: %s", g_strerror(errno));
+    }
+  }
+
+  for (guint i = 0; i < n_threads; i++) {
+    struct TeapotReactor *reactor = &reactors[i];
+
+    reactor->id       = i;
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    reactor->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    reactor->incoming = g_async_queue_new();
+    g_queue_init(&reactor->idle);
+
+    if (reactor->epoll_fd < 0 || reactor->event_fd < 0)
+      g_error("Reactor %u: failed to create epoll instance: %s", i, g_strerror(errno));
+
+    struct epoll_event event = {
+      .events   = EPOLLIN,
+      .data.ptr = NULL,
+    };
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->event_fd, &event) < 0)
+      g_error("Reactor %u: failed to watch eventfd: %s", i, g_strerror(errno));
+
+    gchar *name = g_strdup_printf("reactor_%u", i);
+    g_thread_unref(g_thread_new(name, (GThreadFunc)teapot_reactor_run, reactor));
+    g_free(name);
+  }
+}
+
+void teapot_reactor_dispatch(struct TeapotConnection *conn)
+{
+  guint index = (guint)g_atomic_int_add(&next_reactor, 1) % n_reactors;
+
+  teapot_reactor_push(&reactors[index], conn);
+}
+
+void teapot_reactor_dispatch_shard(struct TeapotConnection *conn, guint shard, guint n_shards)
+{
+  teapot_reactor_push(&reactors[teapot_reactor_pick(shard, n_shards)], conn);
+}
+
+void teapot_reactor_dispatch_batch(struct TeapotConnection **conns, guint n, guint shard, guint n_shards)
+{
+  bool *woken = g_newa(bool, n_reactors);
+  memset(woken, 0, n_reactors * sizeof(bool));
+
+  for (guint i = 0; i < n; i++) {
+    guint index = teapot_reactor_pick(shard, n_shards);
+
+    g_async_queue_push(reactors[index].incoming, conns[i]);
+    woken[index] = true;
+  }
+
+  // A reactor takes all it has been handed at each wakeup
+  for (guint i = 0; i < n_reactors; i++)
+    if (woken[i])
+      teapot_reactor_wake(&reactors[i]);
+}
+
+void teapot_reactor_pin(guint index)
+{
+  if (!affinity)
+    return;
+
+  // The index-th allowed processor, wrapping around
+  guint target = index % n_allowed;
+  guint seen   = 0;
+
+  for (guint cpu = 0; cpu < (guint)CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed))
+      continue;
+
+    if (seen++ == target) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+
+      // 0 is the calling thread
+      if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        g_warning("Reactor: failed to pin a thread to processor %u: %s", cpu, g_strerror(errno));
+      else
+        teapot_trace("Reactor: thread pinned to processor %u", cpu);
+
+      return;
+    }
+  }
+}
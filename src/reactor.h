@@ -0,0 +1,72 @@
+#ifndef TEAPOT_REACTOR_H
+#define TEAPOT_REACTOR_H
+
+#include <glib.h>
+#include "connection.h"
+
+/**
+ * Start the reactor threads.
+ *
+ * Each reactor thread owns an epoll instance and drives the non-blocking
+ * connections assigned to it through their state machines. Connections are
+ * spread over the reactors in round-robin order.
+ *
+ * Connections which make no progress (including persistent connections
+ * waiting for their next request) are closed after the idle timeout.
+ *
+ * @param n_threads [in] Number of reactor threads to spawn. 0 for one per
+ *                       processor.
+ * @param timeout   [in] Idle timeout of connections, in seconds. 0 to never
+ *                       time out.
+ * @param pin       [in] Whether to pin reactor threads (and those calling
+ *                       `teapot_reactor_pin`) to processors.
+ */
+void teapot_reactor_init(guint n_threads, guint timeout, bool pin);
+
+/**
+ * Hand a connection over to a reactor.
+ *
+ * This function is thread-safe, and is meant to be called from the listener
+ * (and TLS handshake) threads. The reactor takes the ownership of the
+ * connection and frees it when it is closed.
+ *
+ * @param conn [in] The connection to drive.
+ */
+void teapot_reactor_dispatch(struct TeapotConnection *conn);
+
+/**
+ * Hand a connection over to a reactor of a shard of a listener, so that a
+ * connection stays on the processor of the acceptor which accepted it.
+ *
+ * Shard i owns the reactors whose index is i modulo the number of shards,
+ * which it spreads its connections over; with fewer reactors than shards,
+ * shards share reactor i modulo the number of reactors.
+ *
+ * @param conn     [in] The connection to drive.
+ * @param shard    [in] Index of the shard.
+ * @param n_shards [in] Number of shards of the listener.
+ */
+void teapot_reactor_dispatch_shard(struct TeapotConnection *conn, guint shard, guint n_shards);
+
+/**
+ * Hand connections over to the reactors of a shard, as
+ * `teapot_reactor_dispatch_shard` does one by one, but waking each reactor
+ * up once for all the connections it is handed.
+ *
+ * @param conns    [in] The connections to drive.
+ * @param n        [in] Number of connections.
+ * @param shard    [in] Index of the shard.
+ * @param n_shards [in] Number of shards of the listener (1 if not sharded).
+ */
+void teapot_reactor_dispatch_batch(struct TeapotConnection **conns, guint n, guint shard, guint n_shards);
+
+/**
+ * Pin the calling thread to the processor reactor `index` is pinned to,
+ * i.e. the index-th processor the process may run on (modulo their number).
+ * Does nothing unless pinning is enabled by `teapot_reactor_init`.
+ *
+ * @param index [in] Index of the processor.
+ */
+void teapot_reactor_pin(guint index);
+
+#endif
@@ -1,71 +1,501 @@
+#include <string.h>
 #include <glib.h>
 #include "redir.h"
 
+/**
+ * Header fields of a redirection; the status line, Date and Connection are
+ * added by the HTTP layer.
+ */
+#define REDIR_FIELDS_FORMAT "Location: %s\r\nContent-Length: 0\r\n"
+
+/********** Internal types **********/
+
+/**
+ * A redirection rule.
+ */
+struct TeapotRedirRule {
+  bool   permanent;     ///< 301 rather than 302
+  char  *target;        ///< Target with `$n` to substitute, or NULL if it has none
+  char  *fields;        ///< Serialized header fields (GRefString), if the target has no `$n`
+  gsize  fields_length; ///< Length of fields
+};
+
+/**
+ * A node of the radix tree. Each node is reached through a piece of literal
+ * text (its label), or through a segment wildcard.
+ */
+struct TeapotRedirNode {
+  char      *label;        ///< Text leading to this node, empty for the root and wildcards
+  gsize      label_length;
+  GPtrArray *children;     ///< Nodes reached through text, sorted by their first byte
+  struct TeapotRedirNode *segment; ///< Node reached through a segment wildcard, or NULL
+  struct TeapotRedirRule *exact;   ///< Rule for paths ending here, or NULL
+  struct TeapotRedirRule *prefix;  ///< Rule for paths starting here, or NULL
+};
+
+struct TeapotRedirRoutes {
+  struct TeapotRedirNode *root;
+  guint   n_rules;
+  guint64 retired; ///< Epoch at which the set was replaced
+};
+
+/**
+ * What the wildcards of a rule matched.
+ */
+struct TeapotRedirMatch {
+  const char *captures[TEAPOT_REDIR_MAX_CAPTURES];
+  gsize       lengths[TEAPOT_REDIR_MAX_CAPTURES];
+  guint       n_captures;
+};
+
+/**
+ * What a reader thread last announced.
+ */
+struct TeapotRedirReader {
+  guint64 epoch; ///< Epoch observed when going online, 0 while offline
+};
+
 /********** Internal States **********/
 
-static GHashTable *redir_301_list = NULL;
-static GHashTable *redir_302_list = NULL;
+static struct TeapotRedirRoutes *current = NULL; ///< Set in use (atomic)
+static guint64                   epoch   = 1;    ///< Bumped on each publish (atomic)
 
-/********** Public APIs **********/
+static GMutex     lock;              ///< Protects the fields below
+static GPtrArray *readers = NULL;    ///< Attached threads
+static GQueue     retired = G_QUEUE_INIT; ///< Sets replaced, oldest first
+
+static __thread struct TeapotRedirReader *thread_reader = NULL;
 
-void teapot_redir_301_init(GHashTable *table)
+/********** Private APIs **********/
+
+static char *teapot_redir_fields_new(const char *location, gsize *length)
 {
-  if (!redir_301_list) {
-    g_debug("Redirection 301 list with %u elements initialized", g_hash_table_size(redir_301_list));
-    redir_301_list = g_hash_table_ref(table);
-  } else {
-    g_warning("Redir: 301: double initialization");
+  gchar *fields = g_strdup_printf(REDIR_FIELDS_FORMAT, location);
+
+  *length = strlen(fields);
+  char *ret = g_ref_string_new_len(fields, (gssize)*length);
+  g_free(fields);
+
+  return ret;
+}
+
+static void teapot_redir_rule_free(struct TeapotRedirRule *rule)
+{
+  if (!rule)
+    return;
+
+  g_free(rule->target);
+  if (rule->fields)
+    g_ref_string_release(rule->fields);
+  g_free(rule);
+}
+
+static struct TeapotRedirNode *teapot_redir_node_new(const char *label, gsize length)
+{
+  struct TeapotRedirNode *node = g_new0(struct TeapotRedirNode, 1);
+
+  node->label        = g_strndup(label, length);
+  node->label_length = length;
+  node->children     = g_ptr_array_new();
+
+  return node;
+}
+
+static void teapot_redir_node_free(struct TeapotRedirNode *node)
+{
+  if (!node)
+    return;
+
+  for (guint i = 0; i < node->children->len; i++)
+    teapot_redir_node_free(g_ptr_array_index(node->children, i));
+  g_ptr_array_free(node->children, TRUE);
+
+  teapot_redir_node_free(node->segment);
+  teapot_redir_rule_free(node->exact);
+  teapot_redir_rule_free(node->prefix);
+  g_free(node->label);
+  g_free(node);
+}
+
+/**
+ * Find the child of a node whose label starts with the given byte.
+ *
+ * @param index [out] Where the child is, or would be inserted.
+ * @return The child, or NULL.
+ */
+static struct TeapotRedirNode *teapot_redir_node_child(const struct TeapotRedirNode *node, guchar first, guint *index)
+{
+  guint low  = 0;
+  guint high = node->children->len;
+
+  while (low < high) {
+    guint mid = low + (high - low) / 2;
+    struct TeapotRedirNode *child = g_ptr_array_index(node->children, mid);
+    guchar c = (guchar)child->label[0];
+
+    if (c == first) {
+      *index = mid;
+      return child;
+    }
+
+    if (c < first)
+      low = mid + 1;
+    else
+      high = mid;
   }
+
+  *index = low;
+  return NULL;
 }
 
-void teapot_redir_302_init(GHashTable *table)
+/**
+ * Walk down a piece of literal text from a node, adding (or splitting) nodes
+ * as needed.
+ *
+ * @return The node reached at the end of the text.
+ */
+static struct TeapotRedirNode *teapot_redir_node_insert(struct TeapotRedirNode *node, const char *text, gsize length)
 {
-  if (!redir_302_list) {
-    g_debug("Redirection 302 list with %u elements initialized", g_hash_table_size(table));
-    redir_302_list = g_hash_table_ref(table);
-  } else {
-    g_warning("Redir: 302: double initialization");
+  while (length > 0) {
+    guint index = 0;
+    struct TeapotRedirNode *child = teapot_redir_node_child(node, (guchar)text[0], &index);
+
+    if (!child) {
+      child = teapot_redir_node_new(text, length);
+      g_ptr_array_insert(node->children, (gint)index, child);
+      return child;
+    }
+
+    gsize common = 0;
+    while (common < child->label_length && common < length && child->label[common] == text[common])
+      common++;
+
+    // The text leaves the label halfway: split the label there
+    if (common < child->label_length) {
+      struct TeapotRedirNode *split = teapot_redir_node_new(child->label, common);
+      char *rest = g_strndup(child->label + common, child->label_length - common);
+
+      g_free(child->label);
+      child->label         = rest;
+      child->label_length -= common;
+
+      g_ptr_array_add(split->children, child);
+      node->children->pdata[index] = split;
+      child = split;
+    }
+
+    node    = child;
+    text   += common;
+    length -= common;
   }
+
+  return node;
 }
 
-void teapot_redir_301_free(void)
+/**
+ * Find the rule a path matches below a node, trying text, then a segment
+ * wildcard, then a prefix, and backtracking when a branch leads nowhere.
+ */
+static const struct TeapotRedirRule *teapot_redir_node_match(const struct TeapotRedirNode *node, const char *path, struct TeapotRedirMatch *match)
 {
-  if (redir_301_list) {
-    g_debug("Redir: 301: freeing redirection list");
-    g_hash_table_destroy(redir_301_list);
-    redir_301_list = NULL;
+  const struct TeapotRedirRule *rule = NULL;
+
+  if (*path == '\0') {
+    if (node->exact)
+      return node->exact;
   } else {
-    g_warning("Redir: 301: double free");
+    guint index = 0;
+    const struct TeapotRedirNode *child = teapot_redir_node_child(node, (guchar)*path, &index);
+
+    if (child && strncmp(path, child->label, child->label_length) == 0) {
+      rule = teapot_redir_node_match(child, path + child->label_length, match);
+      if (rule)
+        return rule;
+    }
+  }
+
+  // Patterns have no more wildcards than captures, so there is room
+  if (node->segment) {
+    gsize length = strcspn(path, "/");
+
+    if (length > 0) {
+      match->captures[match->n_captures] = path;
+      match->lengths[match->n_captures]  = length;
+      match->n_captures++;
+
+      rule = teapot_redir_node_match(node->segment, path + length, match);
+      if (rule)
+        return rule;
+
+      match->n_captures--;
+    }
+  }
+
+  if (node->prefix) {
+    match->captures[match->n_captures] = path;
+    match->lengths[match->n_captures]  = strlen(path);
+    match->n_captures++;
+
+    return node->prefix;
   }
+
+  return NULL;
 }
 
-void teapot_redir_302_free(void)
+/**
+ * Substitute what the wildcards matched into the target of a rule.
+ *
+ * @return The location, or NULL if a capture cannot go into a header field.
+ */
+static char *teapot_redir_substitute(const char *target, const struct TeapotRedirMatch *match)
 {
-  if (redir_302_list) {
-    g_debug("Redir: 302: freeing redirection list");
-    g_hash_table_destroy(redir_302_list);
-    redir_302_list = NULL;
-  } else {
-    g_warning("Redir: 302: double free");
+  GString *location = g_string_new(NULL);
+
+  for (const char *p = target; *p; p++) {
+    if (p[0] == '$' && p[1] >= '1' && p[1] <= '9') {
+      guint n = (guint)(p[1] - '1');
+
+      // Whatever the client sent is copied into the header
+      for (gsize i = 0; i < match->lengths[n]; i++) {
+        guchar c = (guchar)match->captures[n][i];
+
+        if (c <= ' ' || c == 0x7f) {
+          g_string_free(location, TRUE);
+          return NULL;
+        }
+      }
+
+      g_string_append_len(location, match->captures[n], (gssize)match->lengths[n]);
+      p++;
+    } else {
+      g_string_append_c(location, *p);
+    }
   }
+
+  return g_string_free(location, FALSE);
 }
 
-char *teapot_redir_301_query(const char *path)
+/**
+ * Whether every attached thread has been quiescent since the given epoch.
+ * Must be called with the lock held.
+ */
+static bool teapot_redir_quiescent_since(guint64 since)
 {
-  char *ret = NULL;
+  for (guint i = 0; i < readers->len; i++) {
+    struct TeapotRedirReader *reader = g_ptr_array_index(readers, i);
+    guint64 seen = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
 
-  if (redir_301_list)
-    ret = g_strdup(g_hash_table_lookup(redir_301_list, path));
+    if (seen != 0 && seen < since)
+      return false;
+  }
 
-  return ret;
+  return true;
+}
+
+/********** Public APIs **********/
+
+struct TeapotRedirRoutes *teapot_redir_routes_new(void)
+{
+  struct TeapotRedirRoutes *routes = g_new0(struct TeapotRedirRoutes, 1);
+  routes->root = teapot_redir_node_new("", 0);
+
+  return routes;
 }
 
-char *teapot_redir_302_query(const char *path)
+bool teapot_redir_routes_add(struct TeapotRedirRoutes *routes, bool permanent, const char *pattern, const char *target)
+{
+  guint n_wildcards = 0;
+
+  // Wildcards are either at the end, or whole segments
+  for (const char *p = pattern; (p = strchr(p, '*')) != NULL; p++) {
+    bool last  = p[1] == '\0';
+    bool whole = p > pattern && p[-1] == '/' && p[1] == '/';
+
+    if (!last && !whole) {
+      g_warning("Redir: %s: a wildcard must be at the end, or a whole segment", pattern);
+      return false;
+    }
+
+    if (++n_wildcards > TEAPOT_REDIR_MAX_CAPTURES) {
+      g_warning("Redir: %s: more than %d wildcards", pattern, TEAPOT_REDIR_MAX_CAPTURES);
+      return false;
+    }
+  }
+
+  // The target goes into a header field as it is
+  bool captures = false;
+  for (const char *p = target; *p; p++) {
+    if ((guchar)*p < ' ' || *p == 0x7f) {
+      g_warning("Redir: %s: control characters in target", pattern);
+      return false;
+    }
+
+    if (p[0] == '$' && p[1] >= '1' && p[1] <= '9') {
+      if ((guint)(p[1] - '0') > n_wildcards) {
+        g_warning("Redir: %s: target uses $%c, but the pattern has %u wildcards", pattern, p[1], n_wildcards);
+        return false;
+      }
+      captures = true;
+    }
+  }
+
+  // Walk down the pattern, text and wildcards in turn
+  struct TeapotRedirNode *node = routes->root;
+  const char *text = pattern;
+  const char *star;
+  struct TeapotRedirRule **slot = NULL;
+
+  for (;;) {
+    star = strchr(text, '*');
+    node = teapot_redir_node_insert(node, text, star ? (gsize)(star - text) : strlen(text));
+
+    if (!star) {
+      slot = &node->exact;
+      break;
+    }
+
+    if (star[1] == '\0') {
+      slot = &node->prefix;
+      break;
+    }
+
+    if (!node->segment)
+      node->segment = teapot_redir_node_new("", 0);
+    node = node->segment;
+    text = star + 1;
+  }
+
+  struct TeapotRedirRule *rule = g_new0(struct TeapotRedirRule, 1);
+  rule->permanent = permanent;
+
+  // Responses without captures are the same for every request
+  if (captures)
+    rule->target = g_strdup(target);
+  else
+    rule->fields = teapot_redir_fields_new(target, &rule->fields_length);
+
+  // The same pattern twice: the latter wins, as it did in a hash table
+  if (*slot) {
+    g_debug("Redir: %s: defined twice, the latter wins", pattern);
+    teapot_redir_rule_free(*slot);
+    routes->n_rules--;
+  }
+
+  *slot = rule;
+  routes->n_rules++;
+
+  return true;
+}
+
+void teapot_redir_routes_free(struct TeapotRedirRoutes *routes)
+{
+  if (!routes)
+    return;
+
+  teapot_redir_node_free(routes->root);
+  g_free(routes);
+}
+
+void teapot_redir_publish(struct TeapotRedirRoutes *routes)
+{
+  g_debug("Redir: publishing %u rules", routes->n_rules);
+
+  // Readers going online after the epoch is bumped see the new set; the old
+  // one waits for those which went online before
+  struct TeapotRedirRoutes *old = __atomic_exchange_n(&current, routes, __ATOMIC_SEQ_CST);
+
+  if (old) {
+    old->retired = __atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+
+    g_mutex_lock(&lock);
+    g_queue_push_tail(&retired, old);
+    g_mutex_unlock(&lock);
+
+    teapot_redir_reclaim();
+  }
+}
+
+bool teapot_redir_reclaim(void)
+{
+  g_mutex_lock(&lock);
+
+  // Sets are retired in epoch order, so stop at the first still in use
+  struct TeapotRedirRoutes *routes;
+  while ((routes = g_queue_peek_head(&retired)) != NULL) {
+    if (readers && !teapot_redir_quiescent_since(routes->retired))
+      break;
+
+    g_queue_pop_head(&retired);
+    teapot_redir_routes_free(routes);
+  }
+
+  bool pending = !g_queue_is_empty(&retired);
+
+  g_mutex_unlock(&lock);
+
+  return pending;
+}
+
+void teapot_redir_attach(void)
+{
+  if (thread_reader)
+    return;
+
+  thread_reader = g_new0(struct TeapotRedirReader, 1);
+  teapot_redir_online();
+
+  g_mutex_lock(&lock);
+  if (!readers)
+    readers = g_ptr_array_new();
+  g_ptr_array_add(readers, thread_reader);
+  g_mutex_unlock(&lock);
+}
+
+void teapot_redir_offline(void)
+{
+  if (thread_reader)
+    __atomic_store_n(&thread_reader->epoch, 0, __ATOMIC_SEQ_CST);
+}
+
+void teapot_redir_online(void)
+{
+  if (thread_reader)
+    __atomic_store_n(&thread_reader->epoch, __atomic_load_n(&epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+char *teapot_redir_route(const char *path, bool *permanent, size_t *length)
 {
   char *ret = NULL;
 
-  if (redir_302_list)
-    ret = g_strdup(g_hash_table_lookup(redir_302_list, path));
+  // Threads not attached cannot tell when they are done reading; they read
+  // under the lock, which freeing a set takes too
+  if (!thread_reader)
+    g_mutex_lock(&lock);
+
+  struct TeapotRedirRoutes *routes = __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+
+  if (routes && routes->n_rules > 0) {
+    struct TeapotRedirMatch match = { .n_captures = 0 };
+    const struct TeapotRedirRule *rule = teapot_redir_node_match(routes->root, path, &match);
+
+    if (rule && rule->fields) {
+      ret     = g_ref_string_acquire(rule->fields);
+      *length = rule->fields_length;
+    } else if (rule) {
+      char *location = teapot_redir_substitute(rule->target, &match);
+
+      if (location) {
+        ret = teapot_redir_fields_new(location, length);
+        g_free(location);
+      }
+    }
+
+    if (ret)
+      *permanent = rule->permanent;
+  }
+
+  if (!thread_reader)
+    g_mutex_unlock(&lock);
 
   return ret;
 }
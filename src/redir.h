@@ -1,54 +1,107 @@
 #ifndef TEAPOT_REDIR_H
 #define TEAPOT_REDIR_H
 
+// C99 boolean
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+
+#include <stddef.h>
 #include <glib.h>
 
 /**
- * Initialize the 301 redirection list using the given GHashTable.
- *
- * @param table [in] The hash table to initialize. This redirection provider
- *                   holds a reference to the hash table, so you may unref it,
- *                   but do not free it.
+ * Maximum number of wildcards in a pattern, each captured as `$1` to `$9`.
+ */
+#define TEAPOT_REDIR_MAX_CAPTURES 9
+
+/**
+ * A set of redirection rules compiled into a radix tree, where each path is
+ * routed with a single walk, however many rules there are.
  */
-void teapot_redir_301_init(GHashTable *table);
+struct TeapotRedirRoutes;
 
 /**
- * Initialize the 302 redirection list using the given GHashTable.
+ * Create an empty set of rules.
+ */
+struct TeapotRedirRoutes *teapot_redir_routes_new(void);
+
+/**
+ * Add a rule to a set.
  *
- * @param table [in] The hash table to initialize. This redirection provider
- *                   holds a reference to the hash table, so you may unref it,
- *                   but do not free it.
+ * A pattern is matched against the whole request target. A `*` at its end
+ * matches the rest of the target, whatever it is (a prefix rule); a `*`
+ * elsewhere must make up a whole segment, between two slashes, and matches
+ * one non-empty segment. Where several rules match, text is preferred at
+ * each character, then a segment wildcard, then a prefix; so `/docs/api`
+ * wins over a segment wildcard after `/docs/`, which wins over `/doc*`. What
+ * each `*` matched replaces `$1`, `$2`... in the target.
+ *
+ * @param routes    [in] The set to add to.
+ * @param permanent [in] Whether to answer 301 Moved Permanently rather than
+ *                       302 Found.
+ * @param pattern   [in] The pattern of paths to redirect. Copied.
+ * @param target    [in] The location to redirect to. Copied.
+ * @return false if the pattern or the target is malformed, in which case the
+ *         rule is not added.
+ */
+bool teapot_redir_routes_add(struct TeapotRedirRoutes *routes, bool permanent, const char *pattern, const char *target);
+
+/**
+ * Free a set of rules which has not been published.
  */
-void teapot_redir_302_init(GHashTable *table);
+void teapot_redir_routes_free(struct TeapotRedirRoutes *routes);
 
 /**
- * Free the 301 redirection list.
+ * Publish a set of rules, replacing the one in use.
+ *
+ * Routing reads the set without locking. The set replaced is freed once
+ * every attached thread has gone through a quiescent state (see
+ * `teapot_redir_offline`), or later by `teapot_redir_reclaim`.
+ *
+ * @param routes [in] The set to publish, which is taken over and must not
+ *                    be modified any more.
  */
-void teapot_redir_301_free(void);
+void teapot_redir_publish(struct TeapotRedirRoutes *routes);
 
 /**
- * Free the 301 redirection list.
+ * Free the sets replaced which no thread may still be reading.
+ *
+ * @return true if some are still waiting for a thread to be quiescent.
  */
-void teapot_redir_302_free(void);
+bool teapot_redir_reclaim(void);
 
 /**
- * Query whether a given path should be redirected.
+ * Register the calling thread as a reader of the rules. Threads not attached
+ * may still route, at the cost of a lock.
  *
- * @param path [in] The path to query.
- * @return NULL if there is no redirection, or a string representing the
- *         location URL. The caller should free the returned string when it is
- *         no longer used.
+ * An attached thread is online from then on, and must go offline whenever it
+ * may block for long (or publishing would wait for it).
+ */
+void teapot_redir_attach(void);
+
+/**
+ * Mark the calling thread quiescent: it holds no set until it goes online
+ * again.
+ */
+void teapot_redir_offline(void);
+
+/**
+ * Mark the calling thread as reading sets again.
  */
-char *teapot_redir_301_query(const char *path);
+void teapot_redir_online(void);
 
 /**
- * Query whether a given path should be redirected.
+ * Route a path through the rules in use.
  *
- * @param path [in] The path to query.
- * @return NULL if there is no redirection, or a string representing the
- *         location URL. The caller should free the returned string when it is
- *         no longer used.
+ * @param path      [in]  The request target to route.
+ * @param permanent [out] Whether the redirection is 301 rather than 302.
+ * @param length    [out] Length of the header fields returned.
+ * @return NULL if the path is not redirected. Otherwise the header fields of
+ *         the response (`Location` and `Content-Length`, serialized when the
+ *         rule was added unless it has captures), as a reference on a
+ *         GRefString to release with `g_ref_string_release`. It stays valid
+ *         after the rules are replaced.
  */
-char *teapot_redir_302_query(const char *path);
+char *teapot_redir_route(const char *path, bool *permanent, size_t *length);
 
 #endif
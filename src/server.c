@@ -1,344 +1,589 @@
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <gio/gio.h>
-#include "http.h"
+#include <gio/gunixsocketaddress.h>
+#include <glib/gstdio.h>
+#include "admission.h"
+#include "connection.h"
+#include "log.h"
+#include "metrics.h"
+#include "parser.h"
+#include "reactor.h"
 #include "server.h"
 #include "config.h"
 
-#define BUFSIZE 16384
+/**
+ * Time to wait before accepting again when accepting fails (e.g. for lack of
+ * file descriptors), in microseconds.
+ */
+#define ACCEPT_RETRY_DELAY (10 * G_TIME_SPAN_MILLISECOND)
+
+/********** Internal types **********/
+
+/**
+ * One socket of a listener, with what serves it.
+ */
+struct TeapotListenerShard {
+  gchar *name;                       ///< Name of the listener, followed by "#index" if sharded
+  guint  index;                      ///< Index of the shard
+  guint  n_shards;                   ///< Number of shards of the listener
+
+  GSocket                          *socket;    ///< The listening socket
+  const struct TeapotSocketOptions *options;
+  struct TeapotAdmission           *admission; ///< Shared by all shards
+  GTlsCertificate                  *tls;       ///< Certificate for HTTPS, or NULL
+  GThreadPool                      *pool;      ///< Handshake threads, for HTTPS
+};
 
 /********** Private APIs **********/
 
-static void teapot_http_accepter(GSocketConnection *conn)
+/**
+ * Hand a connection over to a reactor, keeping to those of the shard.
+ */
+static void teapot_listener_dispatch(const struct TeapotListenerShard *shard, struct TeapotConnection *conn)
 {
-  GError *error = NULL;
+  if (shard->n_shards > 1)
+    teapot_reactor_dispatch_shard(conn, shard->index, shard->n_shards);
+  else
+    teapot_reactor_dispatch(conn);
+}
 
-  // Get information about the client
-  GSocketAddress *remote_addr = g_socket_connection_get_remote_address(conn, &error);
-  if (!remote_addr) {
-    g_warning("HTTP: failed to retrieve remote address: %s", error->message);
-    g_clear_error(&error);
+static void teapot_https_handshaker(struct TeapotConnection *conn, const struct TeapotListenerShard *shard)
+{
+  // Idle threads are shared by all pools, so one may have served another
+  // shard last
+  static __thread gint pinned = -1;
 
-    g_message("HTTP: closing socket");
-    g_io_stream_close(G_IO_STREAM(conn), NULL, NULL);
+  if (shard->n_shards > 1 && pinned != (gint)shard->index) {
+    teapot_reactor_pin(shard->index);
+    pinned = (gint)shard->index;
+  }
+
+  // The client has waited too long already; serving it would only make
+  // those behind it wait as long
+  if (!teapot_admission_dequeue(conn->admission, conn->handshake_queued)) {
+    teapot_trace("HTTPS: %s waited too long for a handshake", conn->peer);
+    teapot_metrics_count(TEAPOT_METRICS_CONNECTIONS_SHED, 1);
+    teapot_connection_free(conn);
     return;
   }
 
-  gchar  *client_addr = g_inet_address_to_string(g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(remote_addr)));
-  guint16 client_port = g_inet_socket_address_get_port(G_INET_SOCKET_ADDRESS(remote_addr));
+  if (!teapot_connection_handshake(conn)) {
+    teapot_metrics_count(TEAPOT_METRICS_HANDSHAKE_FAILURES, 1);
+    teapot_connection_free(conn);
+    return;
+  }
 
-  g_message("HTTP: accepting connection from %s:%" G_GUINT16_FORMAT, client_addr, client_port);
+  // From now on the connection is driven without blocking
+  teapot_listener_dispatch(shard, conn);
+}
 
-  // We no longer need the information above (they are only used to show to people)
-  g_free(client_addr);
-  g_clear_object(&remote_addr);
+/**
+ * Answer one scrape on a connection to the metrics listener.
+ */
+static void teapot_metrics_serve(GSocketConnection *conn, const struct TeapotMetricsBinding *binding)
+{
+  GSocket *socket = g_socket_connection_get_socket(conn);
+  gchar    buf[4096];
+  gsize    length = 0;
 
-  // I/O streams
-  // NOTE: transfer-none, do not free
-  GInputStream  *socket_in  = g_io_stream_get_input_stream(G_IO_STREAM(conn));
-  GOutputStream *socket_out = g_io_stream_get_output_stream(G_IO_STREAM(conn));
+  struct TeapotHttpRequest request;
+  enum TeapotParserResult r = TEAPOT_PARSER_INCOMPLETE;
 
-  gchar *buf_in = g_malloc(BUFSIZE);
-  gssize bytes  = 0;
+  // A scraper which never finishes its request must not hold the listener
+  g_socket_set_timeout(socket, TEAPOT_DEFAULT_METRICS_TIMEOUT);
 
-  // Read request into memory
-  // FIXME: fixed size buffer
-  bytes = g_input_stream_read(socket_in, buf_in, BUFSIZE, NULL, &error);
-  if (bytes < 0) {
-    g_warning("HTTP: failed to read from the client: %s", error->message);
-    g_clear_error(&error);
-    g_free(buf_in);
+  while (r == TEAPOT_PARSER_INCOMPLETE && length < sizeof(buf)) {
+    gssize bytes = g_socket_receive(socket, buf + length, sizeof(buf) - length, NULL, NULL);
+    if (bytes <= 0)
+      return;
 
-    g_message("HTTP: closing socket");
-    g_io_stream_close(G_IO_STREAM(conn), NULL, NULL);
-    return;
+    length += (gsize)bytes;
+    r = teapot_parser_parse(&request, buf, length);
   }
 
-  g_message("HTTP: read %" G_GSSIZE_FORMAT " bytes", bytes);
+  GString *body = NULL;
+  const gchar *status = "404 Not Found";
 
-  // Handle it
-  size_t response_length = 0;
-  gchar *buf_out = teapot_http_process(&response_length, buf_in);
-  if (!buf_out) {
-    g_warning("HTTP: handler failed to process request");
-    g_free(buf_in);
+  if (r == TEAPOT_PARSER_DONE && teapot_parser_span_is(buf, request.method, "GET")) {
+    // The query string (if any) does not matter
+    gsize target_length = strcspn(buf + request.target.offset, "?");
+    if (target_length > request.target.length)
+      target_length = request.target.length;
 
-    g_message("HTTP: closing socket");
-    g_io_stream_close(G_IO_STREAM(conn), NULL, NULL);
-    return;
+    if (target_length == strlen(binding->path) && memcmp(buf + request.target.offset, binding->path, target_length) == 0) {
+      body   = teapot_metrics_render();
+      status = "200 OK";
+    }
+  } else if (r != TEAPOT_PARSER_DONE) {
+    status = "400 Bad Request";
   }
 
-  gsize bytes_written = 0;
-  gboolean r = FALSE;
+  if (!body)
+    body = g_string_new(status + 4);
 
-  // Write it back
-  r = g_output_stream_write_all(socket_out, buf_out, response_length, &bytes_written, NULL, &error);
-  if (!r) {
-    g_message("HTTP: failed to write to the client: %s, %zu bytes remaining", error->message, response_length - bytes_written);
-    g_clear_error(&error);
-    g_free(buf_out);
-    g_free(buf_in);
+  gchar *header = g_strdup_printf(
+    "HTTP/1.1 %s\r\n"
+    "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+    "Content-Length: %zu\r\n"
+    "Connection: close\r\n"
+    "\r\n",
+    status, body->len
+  );
 
-    g_message("HTTP: closing socket");
-    g_io_stream_close(G_IO_STREAM(conn), NULL, NULL);
-    return;
-  }
+  GOutputStream *out = g_io_stream_get_output_stream(G_IO_STREAM(conn));
+  if (g_output_stream_write_all(out, header, strlen(header), NULL, NULL, NULL))
+    g_output_stream_write_all(out, body->str, body->len, NULL, NULL, NULL);
 
-  g_message("HTTP: written %" G_GSSIZE_FORMAT " bytes", bytes_written);
+  g_free(header);
+  g_string_free(body, TRUE);
+}
 
-  // Free resources
-  g_free(buf_out);
-  g_free(buf_in);
+/**
+ * Describe a socket address for people: "address:port", "[address]:port" for
+ * IPv6, or "unix:path".
+ */
+static gchar *teapot_listener_describe(GSocketAddress *address)
+{
+  if (G_IS_UNIX_SOCKET_ADDRESS(address))
+    return g_strdup_printf("unix:%s", g_unix_socket_address_get_path(G_UNIX_SOCKET_ADDRESS(address)));
+
+  GInetSocketAddress *inet = G_INET_SOCKET_ADDRESS(address);
+  gchar *host = g_inet_address_to_string(g_inet_socket_address_get_address(inet));
+  gchar *ret  = g_strdup_printf(
+    g_socket_address_get_family(address) == G_SOCKET_FAMILY_IPV6 ? "[%s]:%" G_GUINT16_FORMAT : "%s:%" G_GUINT16_FORMAT,
+    host, g_inet_socket_address_get_port(inet)
+  );
 
-  g_message("HTTP: closing socket");
-  g_io_stream_close(G_IO_STREAM(conn), NULL, NULL);
+  g_free(host);
+  return ret;
 }
 
-static void teapot_https_accepter(GSocketConnection *conn, GTlsCertificate *tls)
+/**
+ * Set an option of a listening socket, telling people if it cannot be.
+ */
+static void teapot_listener_set_option(const gchar *name, GSocket *socket, gint level, gint option, gint value, const gchar *what)
 {
   GError *error = NULL;
 
-  // Get information about the client
-  GSocketAddress *remote_addr = g_socket_connection_get_remote_address(conn, &error);
-  if (!remote_addr) {
-    g_warning("HTTPS: failed to retrieve remote address: %s", error->message);
+  if (!g_socket_set_option(socket, level, option, value, &error)) {
+    g_message("%s: cannot set %s: %s", name, what, error->message);
     g_clear_error(&error);
-
-    g_message("HTTPS: closing socket");
-    g_io_stream_close(G_IO_STREAM(conn), NULL, NULL);
-    return;
   }
+}
 
-  gchar  *client_addr = g_inet_address_to_string(g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(remote_addr)));
-  guint16 client_port = g_inet_socket_address_get_port(G_INET_SOCKET_ADDRESS(remote_addr));
+/**
+ * Create a socket listening on the address of a binding, with its options.
+ *
+ * @param name      [in] Name of the listener, for logging.
+ * @param binding   [in] Address, port, and options of the socket.
+ * @param reuseport [in] Whether to share the address with other sockets
+ *                       (SO_REUSEPORT), for the kernel to balance them.
+ * @return The socket, or NULL on failure.
+ */
+static GSocket *teapot_listener_open(const gchar *name, const struct TeapotBinding *binding, gboolean reuseport)
+{
+  GError         *error          = NULL;
+  GSocketAddress *socket_address = NULL;
+  const gchar    *path           = NULL;
+
+  const struct TeapotSocketOptions *options = &binding->options;
+
+  if (g_str_has_prefix(binding->address, "unix:")) {
+    struct stat st;
+    path = binding->address + strlen("unix:");
+
+    // A socket left by a previous run would make binding fail
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+      g_unlink(path);
+
+    socket_address = g_unix_socket_address_new(path);
+  } else {
+    socket_address = g_inet_socket_address_new_from_string(binding->address, binding->port);
+    if (!socket_address) {
+      g_warning("%s: %s is not an IP address", name, binding->address);
+      return NULL;
+    }
+  }
 
-  g_message("HTTPS: accepting connection from %s:%" G_GUINT16_FORMAT, client_addr, client_port);
+  GSocket *socket = g_socket_new(g_socket_address_get_family(socket_address), G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, &error);
+  if (!socket) {
+    g_warning("%s: failed to create a socket: %s", name, error->message);
+    g_clear_error(&error);
+    g_clear_object(&socket_address);
+    return NULL;
+  }
 
-  // We no longer need the information above (they are only used to show to people)
-  g_free(client_addr);
-  g_clear_object(&remote_addr);
+  // Dual-stack or not is up to the configuration, not to the system default
+  if (g_socket_address_get_family(socket_address) == G_SOCKET_FAMILY_IPV6 && !g_socket_set_option(socket, IPPROTO_IPV6, IPV6_V6ONLY, binding->ipv6_only, &error)) {
+    g_message("%s: cannot choose whether to accept IPv4: %s", name, error->message);
+    g_clear_error(&error);
+  }
 
-  // Wrap the connection with GTlsServerConnection
-  GTlsServerConnection *conn_tls = G_TLS_SERVER_CONNECTION(
-    g_tls_server_connection_new(G_IO_STREAM(conn), tls, &error)
-  );
-  if (!conn_tls) {
-    g_warning("HTTPS: failed to wrap the stream into a TLS one: %s", error->message);
+  if (reuseport && !g_socket_set_option(socket, SOL_SOCKET, SO_REUSEPORT, TRUE, &error)) {
+    g_warning("%s: failed to share the address: %s", name, error->message);
     g_clear_error(&error);
+    g_clear_object(&socket);
+    g_clear_object(&socket_address);
+    return NULL;
+  }
 
-    g_message("HTTPS: closing socket");
-    g_io_stream_close(G_IO_STREAM(conn), NULL, NULL);
-    return;
+  // Connections accepted inherit these from the listening socket, and the
+  // receive buffer must be set before listening for the window to scale
+  if (options->send_buffer)
+    teapot_listener_set_option(name, socket, SOL_SOCKET, SO_SNDBUF, (gint)options->send_buffer, "the send buffer size");
+  if (options->receive_buffer)
+    teapot_listener_set_option(name, socket, SOL_SOCKET, SO_RCVBUF, (gint)options->receive_buffer, "the receive buffer size");
+
+  if (!path) {
+    if (options->nodelay)
+      teapot_listener_set_option(name, socket, IPPROTO_TCP, TCP_NODELAY, TRUE, "TCP_NODELAY");
+
+    // Connections are only accepted once their request has arrived, so
+    // that none of the threads waits for it
+    if (options->defer_accept)
+      teapot_listener_set_option(name, socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, (gint)options->defer_accept, "TCP_DEFER_ACCEPT");
+
+    // Returning clients may send their request along with the SYN
+    if (options->fast_open)
+      teapot_listener_set_option(name, socket, IPPROTO_TCP, TCP_FASTOPEN, (gint)options->fast_open, "TCP Fast Open");
   }
 
-  // I/O streams
-  // NOTE: transfer-none, do not free
-  GInputStream  *socket_in  = g_io_stream_get_input_stream(G_IO_STREAM(conn_tls));
-  GOutputStream *socket_out = g_io_stream_get_output_stream(G_IO_STREAM(conn_tls));
+  gboolean r = g_socket_bind(socket, socket_address, TRUE, &error);
+  g_clear_object(&socket_address);
+
+  if (r && path && binding->mode && g_chmod(path, (int)binding->mode) != 0)
+    g_message("%s: failed to set the permissions of %s: %s", name, path, g_strerror(errno));
 
-  gchar *buf_in = g_malloc(BUFSIZE);
-  gssize bytes_read  = 0;
+  if (r) {
+    g_socket_set_listen_backlog(socket, (gint)options->backlog);
+    r = g_socket_listen(socket, &error);
+  }
 
-  // Read request into memory
-  // FIXME: fixed size buffer
-  bytes_read = g_input_stream_read(socket_in, buf_in, BUFSIZE, NULL, &error);
-  if (bytes_read < 0) {
-    g_warning("HTTPS: failed to read from the client: %s", error->message);
+  if (!r) {
+    g_warning("%s: failed to create a socket listener: %s", name, error->message);
     g_clear_error(&error);
-    g_free(buf_in);
+    g_clear_object(&socket);
+    return NULL;
+  }
 
-    g_message("HTTPS: closing socket");
-    g_io_stream_close(G_IO_STREAM(conn_tls), NULL, NULL);
-    g_io_stream_close(G_IO_STREAM(conn), NULL, NULL);
-    return;
+  GSocketAddress *effective_address = g_socket_get_local_address(socket, NULL);
+  if (effective_address) {
+    gchar *effective_address_str = teapot_listener_describe(effective_address);
+    g_message("%s: service listening on %s", name, effective_address_str);
+    g_free(effective_address_str);
+    g_clear_object(&effective_address);
   }
 
-  g_message("HTTPS: read %" G_GSSIZE_FORMAT " bytes", bytes_read);
+  return socket;
+}
 
-  // Handle it
-  size_t response_length = 0;
-  gchar *buf_out = teapot_http_process(&response_length, buf_in);
-  if (!buf_out) {
-    g_warning("HTTPS: handler failed to process request");
-    g_free(buf_in);
+/**
+ * Wait for connections on the socket of a shard, then accept all of those
+ * pending, up to a batch.
+ *
+ * @param shard [in]  The shard.
+ * @param conns [out] Connections accepted, at least `accept_batch` of them.
+ * @return Number of connections accepted, which may be 0.
+ */
+static guint teapot_listener_accept_batch(const struct TeapotListenerShard *shard, GSocketConnection **conns)
+{
+  GError *error = NULL;
+  guint   n     = 0;
 
-    g_message("HTTPS: closing socket");
-    g_io_stream_close(G_IO_STREAM(conn_tls), NULL, NULL);
-    g_io_stream_close(G_IO_STREAM(conn), NULL, NULL);
-    return;
+  // Blocking sockets are emulated by GLib: the descriptor itself never blocks
+  if (!g_socket_condition_wait(shard->socket, G_IO_IN, NULL, &error)) {
+    g_warning("%s: failed to wait for incoming connections: %s", shard->name, error->message);
+    g_clear_error(&error);
+    return 0;
   }
 
-  gsize bytes_written = 0;
-  gboolean r = FALSE;
+  while (n < shard->options->accept_batch) {
+    int fd = accept4(g_socket_get_fd(shard->socket), NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      // The client gave up, or a signal came: the next one may be there
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
 
-  // Write it back
-  r = g_output_stream_write_all(socket_out, buf_out, response_length, &bytes_written, NULL, &error);
-  if (!r) {
-    g_message("HTTPS: failed to write to the client: %s, %zu bytes remaining", error->message, response_length - bytes_written);
-    g_clear_error(&error);
-    g_free(buf_out);
-    g_free(buf_in);
+      // All those pending have been taken
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
 
-    g_message("HTTPS: closing socket");
-    g_io_stream_close(G_IO_STREAM(conn_tls), NULL, NULL);
-    g_io_stream_close(G_IO_STREAM(conn), NULL, NULL);
-    return;
-  }
+      g_warning("%s: failed to accept an incoming socket connection: %s", shard->name, g_strerror(errno));
 
-  g_message("HTTPS: written %" G_GSSIZE_FORMAT " bytes", bytes_written);
+      // Out of descriptors, most likely: the connection stays pending, so
+      // give those open some time to close rather than trying again at once
+      if (n == 0)
+        g_usleep((gulong)ACCEPT_RETRY_DELAY);
+      break;
+    }
 
-  // Free resources
-  g_free(buf_out);
-  g_free(buf_in);
+    GSocket *socket = g_socket_new_from_fd(fd, &error);
+    if (!socket) {
+      g_warning("%s: failed to wrap an incoming socket connection: %s", shard->name, error->message);
+      g_clear_error(&error);
+      close(fd);
+      continue;
+    }
 
-  g_message("HTTPS: closing socket");
-  g_io_stream_close(G_IO_STREAM(conn_tls), NULL, NULL);
-  g_io_stream_close(G_IO_STREAM(conn), NULL, NULL);
-}
+    conns[n++] = g_socket_connection_factory_create_connection(socket);
+    g_object_unref(socket);
+  }
 
-/********** Public APIs **********/
+  return n;
+}
 
-void *teapot_http_listener(const struct TeapotHttpBinding *binding)
+/**
+ * Accept plain HTTP connections, and hand them over to the reactors.
+ */
+static void teapot_listener_serve_http(const struct TeapotListenerShard *shard)
 {
-  g_debug("In HTTP listener: {%s, %d}", binding->address, binding->port);
+  GSocketConnection       **accepted    = g_new(GSocketConnection *, shard->options->accept_batch);
+  struct TeapotConnection **connections = g_new(struct TeapotConnection *, shard->options->accept_batch);
 
-  GError  *error = NULL;
-  gboolean r     = FALSE;
+  struct TeapotAdmission *admission = shard->admission;
 
-  g_debug("HTTP: creating thread pool");
-  GThreadPool *pool = g_thread_pool_new((GFunc)teapot_http_accepter, NULL, TEAPOT_DEFAULT_THREAD_POOL_MAX_THREADS, FALSE, &error);
-  if (error) {
-    // "An error can only occur when exclusive is set to TRUE and not all
-    // max_threads threads could be created... Note, even in case of error a
-    // valid GThreadPool is returned."
-    g_message("HTTP: error on creating the thread pool: %s", error->message);
-    g_message("HTTP: continue running since pool is valid");
-    g_clear_error(&error);
+  for (;;) {
+    guint n_accepted = teapot_listener_accept_batch(shard, accepted);
+    guint n          = 0;
+
+    for (guint i = 0; i < n_accepted; i++) {
+      // Too many already: answer at once, at no cost to the others
+      if (!teapot_admission_enter(admission)) {
+        teapot_admission_shed(accepted[i], true);
+        continue;
+      }
+
+      struct TeapotConnection *connection = teapot_connection_new(accepted[i], NULL);
+      if (!connection) {
+        teapot_admission_leave(admission);
+        continue;
+      }
+
+      connection->admission = admission;
+      connections[n++]      = connection;
+    }
+
+    // Hand them over to the reactors, waking each up once
+    if (n > 0)
+      teapot_reactor_dispatch_batch(connections, n, shard->index, shard->n_shards);
   }
+}
 
-  g_debug("HTTP: creating socket");
-  GSocketListener *listener = g_socket_listener_new();
-  GSocketAddress  *address  = g_inet_socket_address_new_from_string(binding->address, binding->port);
-  GSocketAddress  *effective_address = NULL;
-
-  r = g_socket_listener_add_address(
-    listener,
-    address,
-    G_SOCKET_TYPE_STREAM,
-    G_SOCKET_PROTOCOL_TCP,
-    NULL,
-    &effective_address,
-    &error
-  );
-  if (!r) {
-    g_warning("HTTP: failed to create a socket listener: %s", error->message);
-    g_clear_error(&error);
-    g_clear_object(&address);
-    g_clear_object(&listener);
+/**
+ * Accept HTTPS connections, and queue them for their handshakes.
+ */
+static void teapot_listener_serve_https(const struct TeapotListenerShard *shard)
+{
+  GError  *error = NULL;
+  gboolean r     = FALSE;
 
-    g_warning("HTTP: can do nothing, exit");
-    return NULL;
-  }
+  GSocketConnection **accepted = g_new(GSocketConnection *, shard->options->accept_batch);
 
-  gchar *effective_address_str = g_inet_address_to_string(g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(effective_address)));
-  g_message("HTTP: service listening on %s:%" G_GUINT16_FORMAT, effective_address_str, g_inet_socket_address_get_port(G_INET_SOCKET_ADDRESS(effective_address)));
-  g_free(effective_address_str);
+  struct TeapotAdmission *admission = shard->admission;
 
   for (;;) {
-    // Wait for an incoming connection
-    GSocketConnection *conn = g_socket_listener_accept(listener, NULL, NULL, &error);
-    if (!conn) {
-      g_warning("HTTP: failed to accept an incoming socket connection: %s", error->message);
-      g_clear_error(&error);
-      continue;
-    }
-
-    // Spawn an accepter in the thread pool
-    r = g_thread_pool_push(pool, conn, &error);
-    if (!r) {
-      // "An error can only occur when a new thread couldn't be created. In that
-      // case data is simply appended to the queue of work to do."
-      g_message("HTTP: thread pool throws an error: %s", error->message);
-      g_message("HTTP: request is delayed");
-      g_clear_error(&error);
+    guint n_accepted = teapot_listener_accept_batch(shard, accepted);
+
+    for (guint i = 0; i < n_accepted; i++) {
+      GSocketConnection *conn = accepted[i];
+
+      // Too many already: close at once, as answering would take a handshake
+      if (!teapot_admission_enter(admission)) {
+        teapot_admission_shed(conn, false);
+        continue;
+      }
+      if (!teapot_admission_enqueue(admission)) {
+        teapot_admission_leave(admission);
+        teapot_admission_shed(conn, false);
+        continue;
+      }
+
+      struct TeapotConnection *connection = teapot_connection_new(conn, shard->tls);
+      if (!connection) {
+        teapot_admission_dequeue(admission, g_get_monotonic_time());
+        teapot_admission_leave(admission);
+        continue;
+      }
+
+      connection->admission        = admission;
+      connection->handshake_queued = g_get_monotonic_time();
+
+      // TLS handshakes block, so they are done in the thread pool; the
+      // connection goes to a reactor afterwards
+      r = g_thread_pool_push(shard->pool, connection, &error);
+      if (!r) {
+        // "An error can only occur when a new thread couldn't be created. In that
+        // case data is simply appended to the queue of work to do."
+        g_message("%s: thread pool throws an error: %s", shard->name, error->message);
+        g_message("%s: handshake is delayed", shard->name);
+        g_clear_error(&error);
+      }
     }
   }
+}
+
+/**
+ * Accepting thread of a shard (GThreadFunc).
+ */
+static gpointer teapot_listener_acceptor(struct TeapotListenerShard *shard)
+{
+  // Connections accepted are counted here
+  teapot_metrics_attach();
+
+  if (shard->n_shards > 1)
+    teapot_reactor_pin(shard->index);
+
+  if (shard->tls)
+    teapot_listener_serve_https(shard);
+  else
+    teapot_listener_serve_http(shard);
 
   return NULL;
 }
 
-void *teapot_https_listener(const struct TeapotHttpsBinding *binding)
+/********** Public APIs **********/
+
+void *teapot_listener(const struct TeapotBinding *binding)
 {
-  g_debug("In HTTPS listener: {%s, %d, %s, %s}", binding->address, binding->port, binding->cert_path, binding->pkey_path);
+  g_debug("In listener %s: {%s, %d, %s}", binding->name, binding->address, binding->port, binding->tls ? "TLS" : "plain");
 
-  GError  *error = NULL;
-  gboolean r     = FALSE;
+  GError          *error = NULL;
+  GTlsCertificate *tls   = NULL;
 
-  g_debug("HTTPS: loading certificate");
-  GTlsCertificate *tls = g_tls_certificate_new_from_files(binding->cert_path, binding->pkey_path, &error);
-  if (!tls) {
-    g_warning("HTTPS: failed to load certificate or key file: %s", error->message);
-    g_clear_error(&error);
+  guint n_shards = binding->acceptors ? binding->acceptors : g_get_num_processors();
+
+  // A Unix domain socket is a file, which a second socket would replace
+  if (n_shards > 1 && g_str_has_prefix(binding->address, "unix:")) {
+    g_message("%s: Unix domain sockets cannot be shared, accepting on one", binding->name);
+    n_shards = 1;
+  }
+
+  if (binding->tls) {
+    g_debug("%s: loading certificate {%s, %s}", binding->name, binding->cert_path, binding->pkey_path);
+    tls = g_tls_certificate_new_from_files(binding->cert_path, binding->pkey_path, &error);
+    if (!tls) {
+      g_warning("%s: failed to load certificate or key file: %s", binding->name, error->message);
+      g_clear_error(&error);
+
+      g_warning("%s: can do nothing, exit", binding->name);
+      return NULL;
+    }
+  }
+
+  struct TeapotAdmission *admission = g_new0(struct TeapotAdmission, 1);
+  if (binding->tls)
+    teapot_admission_init(admission, binding->name, binding->max_connections, binding->handshake_queue, binding->handshake_queue_wait, binding->adaptive);
+  else
+    teapot_admission_init(admission, binding->name, binding->max_connections, 0, 0, false);
+
+  // Sockets are all bound before any is served, so that the shards are known
+  // to the dispatching for good
+  struct TeapotListenerShard *shards = g_new0(struct TeapotListenerShard, n_shards);
+  guint n_open = 0;
+
+  for (; n_open < n_shards; n_open++) {
+    struct TeapotListenerShard *shard = &shards[n_open];
+    shard->name = n_shards > 1 ? g_strdup_printf("%s#%u", binding->name, n_open) : g_strdup(binding->name);
+
+    g_debug("%s: creating socket", shard->name);
+    shard->socket = teapot_listener_open(shard->name, binding, n_shards > 1);
+    if (!shard->socket) {
+      g_free(shard->name);
+      break;
+    }
+  }
 
-    g_warning("HTTPS: can do nothing, exit");
+  if (n_open == 0) {
+    g_warning("%s: can do nothing, exit", binding->name);
     return NULL;
   }
 
-  g_debug("HTTPS: creating thread pool");
-  GThreadPool *pool = g_thread_pool_new((GFunc)teapot_https_accepter, tls, TEAPOT_DEFAULT_THREAD_POOL_MAX_THREADS, FALSE, &error);
-  if (error) {
-    // "An error can only occur when exclusive is set to TRUE and not all
-    // max_threads threads could be created... Note, even in case of error a
-    // valid GThreadPool is returned."
-    g_message("HTTP: error on creating the thread pool: %s", error->message);
-    g_message("HTTP: continue running since pool is valid");
-    g_clear_error(&error);
+  if (n_open < n_shards)
+    g_warning("%s: accepting on %u sockets out of %u", binding->name, n_open, n_shards);
+
+  // Handshake threads are split among the shards
+  guint threads = MAX(1, (binding->handshake_threads + n_open - 1) / n_open);
+
+  for (guint i = 0; i < n_open; i++) {
+    struct TeapotListenerShard *shard = &shards[i];
+    shard->index     = i;
+    shard->n_shards  = n_open;
+    shard->options   = &binding->options;
+    shard->admission = admission;
+    shard->tls       = tls;
+
+    if (binding->tls) {
+      g_debug("%s: creating handshake thread pool", shard->name);
+      shard->pool = g_thread_pool_new((GFunc)teapot_https_handshaker, shard, (gint)threads, FALSE, &error);
+      if (error) {
+        // "An error can only occur when exclusive is set to TRUE and not all
+        // max_threads threads could be created... Note, even in case of error a
+        // valid GThreadPool is returned."
+        g_message("%s: error on creating the thread pool: %s", shard->name, error->message);
+        g_message("%s: continue running since pool is valid", shard->name);
+        g_clear_error(&error);
+      }
+
+      teapot_metrics_watch_pool("handshake", shard->name, shard->pool);
+    }
   }
 
-  g_debug("HTTPS: creating socket");
-  GSocketListener *listener = g_socket_listener_new();
-  GSocketAddress  *address  = g_inet_socket_address_new_from_string(binding->address, binding->port);
-  GSocketAddress  *effective_address = NULL;
-
-  r = g_socket_listener_add_address(
-    listener,
-    address,
-    G_SOCKET_TYPE_STREAM,
-    G_SOCKET_PROTOCOL_TCP,
-    NULL,
-    &effective_address,
-    &error
-  );
-  if (!r) {
-    g_warning("HTTPS: failed to create a socket listener: %s", error->message);
-    g_clear_error(&error);
-    g_clear_object(&address);
-    g_clear_object(&listener);
+  if (n_open > 1)
+    g_message("%s: %u acceptors sharing the address", binding->name, n_open);
+
+  // This thread serves the first shard
+  for (guint i = 1; i < n_open; i++) {
+    gchar *name = g_strdup_printf("acceptor_%s_%u", binding->name, i);
+    g_thread_unref(g_thread_new(name, (GThreadFunc)teapot_listener_acceptor, &shards[i]));
+    g_free(name);
+  }
+
+  return teapot_listener_acceptor(&shards[0]);
+}
+
+void *teapot_metrics_listener(const struct TeapotMetricsBinding *binding)
+{
+  g_debug("In metrics listener: {%s, %d, %s}", binding->address, binding->port, binding->path);
 
-    g_warning("HTTPS: can do nothing, exit");
+  GError *error = NULL;
+
+  // Scrapers need none of the tuning of the other listeners
+  struct TeapotBinding listening = {
+    .name    = "Metrics",
+    .address = binding->address,
+    .port    = binding->port,
+    .options = { .backlog = TEAPOT_DEFAULT_LISTEN_BACKLOG },
+  };
+
+  g_debug("Metrics: creating socket");
+  GSocket *listener = teapot_listener_open("Metrics", &listening, FALSE);
+  if (!listener) {
+    g_warning("Metrics: can do nothing, exit");
     return NULL;
   }
 
-  gchar *effective_address_str = g_inet_address_to_string(g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(effective_address)));
-  g_message("HTTPS: service listening on %s:%" G_GUINT16_FORMAT, effective_address_str, g_inet_socket_address_get_port(G_INET_SOCKET_ADDRESS(effective_address)));
-  g_free(effective_address_str);
+  g_message("Metrics: serving %s", binding->path);
 
   for (;;) {
-    // Wait for an incoming connection
-    GSocketConnection *conn = g_socket_listener_accept(listener, NULL, NULL, &error);
-    if (!conn) {
-      g_warning("HTTPS: failed to accept an incoming socket connection: %s", error->message);
+    GSocket *socket = g_socket_accept(listener, NULL, &error);
+    if (!socket) {
+      g_warning("Metrics: failed to accept an incoming socket connection: %s", error->message);
       g_clear_error(&error);
       continue;
     }
 
-    // Spawn an accepter in the thread pool
-    r = g_thread_pool_push(pool, conn, &error);
-    if (!r) {
-      // "An error can only occur when a new thread couldn't be created. In that
-      // case data is simply appended to the queue of work to do."
-      g_message("HTTPS: thread pool throws an error: %s", error->message);
-      g_message("HTTPS: request is delayed");
-      g_clear_error(&error);
-    }
+    GSocketConnection *conn = g_socket_connection_factory_create_connection(socket);
+    g_object_unref(socket);
+
+    teapot_metrics_serve(conn, binding);
+
+    g_io_stream_close(G_IO_STREAM(conn), NULL, NULL);
+    g_clear_object(&conn);
   }
 
   return NULL;
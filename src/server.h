@@ -2,49 +2,79 @@
 #define TEAPOT_SERVER_H
 
 /**
- * Binding information for HTTP listener.
+ * Options of a listening socket, and of how connections are taken from it.
  */
-struct TeapotHttpBinding {
-  gchar  *address; ///< Binding address of Teapot
-  guint16 port;    ///< Binding port of Teapot
+struct TeapotSocketOptions {
+  guint    backlog;        ///< Connections the kernel queues for accepting
+  guint    defer_accept;   ///< Seconds a connection may stay silent before being accepted anyway (TCP_DEFER_ACCEPT), 0 to accept it at once
+  guint    fast_open;      ///< Pending TCP Fast Open requests, 0 to disable it
+  gboolean nodelay;        ///< Whether to disable Nagle's algorithm on connections (TCP_NODELAY)
+  guint    send_buffer;    ///< Send buffer size of connections, 0 for the system default
+  guint    receive_buffer; ///< Receive buffer size of connections, 0 for the system default
+  guint    accept_batch;   ///< Most connections accepted in a row before dispatching them
 };
 
 /**
- * Binding information for HTTPS listener.
+ * Binding information for a listener.
  */
-struct TeapotHttpsBinding {
-  gchar  *address;   ///< Binding address of Teapot
-  guint16 port;      ///< Binding port of Teapot
-  gchar  *cert_path; ///< Path to TLS certificate file
-  gchar  *pkey_path; ///< Path to TLS private key file
+struct TeapotBinding {
+  const gchar *name;  ///< Name of the listener, for logging and metrics
+  gchar   *address;   ///< Binding address (IPv4 or IPv6), or "unix:" followed by the path of a Unix domain socket
+  guint16  port;      ///< Binding port, for IPv4 and IPv6
+  gboolean ipv6_only; ///< Whether an IPv6 address leaves IPv4 out, rather than accepting both (dual-stack)
+  guint    mode;      ///< Permissions of a Unix domain socket, 0 to leave them to the umask
+  gboolean tls;       ///< Whether to speak HTTPS rather than HTTP
+  gchar   *cert_path; ///< Path to TLS certificate file
+  gchar   *pkey_path; ///< Path to TLS private key file
+  guint    max_connections;      ///< Most connections open at once, 0 for no limit
+  guint    handshake_threads;    ///< Threads doing TLS handshakes
+  guint    handshake_queue;      ///< Most connections waiting for a handshake thread, 0 for no limit
+  guint    handshake_queue_wait; ///< Longest wait for a handshake thread (ms), 0 for no limit
+  gboolean adaptive;             ///< Adapt the queue limit to the waits observed
+  guint    acceptors;            ///< Sockets sharing the address (SO_REUSEPORT), each with its own acceptor; 0 for one per processor
+  struct TeapotSocketOptions options;
 };
 
 /**
- * The Teapot HTTP listener.
+ * Binding information for the metrics listener.
+ */
+struct TeapotMetricsBinding {
+  gchar  *address; ///< Binding address of the metrics endpoint
+  guint16 port;    ///< Binding port of the metrics endpoint, 0 for none
+  gchar  *path;    ///< Path the metrics are served at
+};
+
+/**
+ * A Teapot listener, serving HTTP or HTTPS on one address.
+ *
+ * With several acceptors, as many sockets are bound to the address with
+ * SO_REUSEPORT, so that the kernel spreads connections over them. Each
+ * socket is a shard with its own accepting thread and handshake threads,
+ * which (like the reactors it hands connections to) run on one processor
+ * when the reactors are pinned. The limits are shared by all shards.
  *
  * This function is designed to be used with GThread to spawn (GThreadFunc):
  *
  * ```c
- * gpointer teapot_http_listener(gpointer data);
+ * gpointer teapot_listener(gpointer data);
  * ```
  *
- * @param bindings [in] Binding information packed into struct TeapotBinding.
+ * @param binding [in] Binding information, which must live forever.
  * @return Something.
  */
-void *teapot_http_listener(const struct TeapotHttpBinding *binding);
+void *teapot_listener(const struct TeapotBinding *binding);
 
 /**
- * The Teapot HTTPS listener.
+ * The metrics listener, serving `teapot_metrics_render` in the Prometheus
+ * text format to scrapers.
  *
- * This function is designed to be used with GThread to spawn (GThreadFunc):
- *
- * ```c
- * gpointer teapot_https_listener(gpointer data);
- * ```
+ * Scrapes are rare, so connections are served one at a time, blocking, and
+ * closed after one request. This function is designed to be used with
+ * GThread to spawn (GThreadFunc), like `teapot_listener`.
  *
- * @param bindings [in] Binding information packed into struct TeapotBinding.
+ * @param binding [in] Binding information.
  * @return Something.
  */
-void *teapot_https_listener(const struct TeapotHttpsBinding *binding);
+void *teapot_metrics_listener(const struct TeapotMetricsBinding *binding);
 
 #endif